@@ -3,12 +3,14 @@
 #include "queuehandler.h"
 #include <QThread>
 #include <QMetaObject>
+#include <QtGlobal>
 
 #include "activelogs.h"
 #ifdef ABSTRACT_OPERATION
     #define ENABLE_LOG_MACROS
 #endif
-#include "logmacros.h"
+#include "workerlog.h"
+WORKER_LOG_CATEGORY("AbstractOperation");
 
 //TODOs and known problems:
 /*
@@ -18,9 +20,46 @@
 3) implement pre-emption?
 
 */
+AbstractOperation::RetryPolicy::RetryPolicy() :
+        m_maxAttempts(1),
+        m_initialBackoff(100),
+        m_multiplier(2.0),
+        m_maxBackoff(30 * 1000),
+        m_jitter(0.2)
+{
+    m_retryOn << OperationFailed << OperationTimedOut;
+}
+
+bool AbstractOperation::RetryPolicy::retriesOn(OperationStatus aStatus) const {
+    return aStatus != OperationCancelled && m_retryOn.contains(aStatus);
+}
+
+int AbstractOperation::RetryPolicy::backoff(int aAttempt, double aSpread) const {
+    double delay = m_initialBackoff;
+    for(int attempt = 1; attempt < aAttempt && delay < m_maxBackoff; ++attempt) {
+        delay *= m_multiplier;
+    }
+    delay = qMin<double>(delay, m_maxBackoff);
+    if(m_jitter > 0) {
+        // spread the retries of operations which failed together (e.g. the server went down)
+        delay += delay * m_jitter * qBound(-1.0, aSpread, 1.0);
+    }
+    return qMax(0, qRound(delay));
+}
+
 AbstractOperation::AbstractOperation(QObject* aObserver, const char* aSlot) :
         m_observer(aObserver),
-        m_status(OperationNotStarted)
+        m_status(OperationNotStarted),
+        m_queueHandler(0),
+        m_enqueueTime(0),
+        m_tenantKey(0),
+        m_hasTenantKey(false),
+        m_attempts(0),
+        m_attemptToken(-1),
+        m_deliveryPolicy(DeliverToObserverThread),
+        m_workloadClass(WorkloadCpu),
+        m_journalEntry(-1),
+        m_priority(PriorityNormal)
 {
     if(m_observer) {
         Q_ASSERT(aSlot);
@@ -65,9 +104,107 @@ const char* AbstractOperation::callbackMethod() {
     return m_slotToBeCalled.data();
 }
 
+QByteArray AbstractOperation::rateLimitKey() const {
+    return m_rateLimitKey;
+}
+
+void AbstractOperation::setRateLimitKey(const QByteArray& aKey) {
+    m_rateLimitKey = aKey;
+}
+
+quintptr AbstractOperation::tenantKey() const {
+    return m_hasTenantKey ? m_tenantKey : (quintptr)m_observer;
+}
+
+void AbstractOperation::setTenantKey(quintptr aKey) {
+    m_tenantKey = aKey;
+    m_hasTenantKey = true;
+}
+
+QByteArray AbstractOperation::batchKey() const {
+    return QByteArray();
+}
+
+QByteArray AbstractOperation::cacheKey() const {
+    return QByteArray();
+}
+
+QVariant AbstractOperation::resultForCache() const {
+    return QVariant();
+}
+
+void AbstractOperation::setResultFromCache(const QVariant& /*aResult*/) {
+}
+
+int AbstractOperation::cacheCost() const {
+    return 1;
+}
+
+QByteArray AbstractOperation::journalType() const {
+    return QByteArray();
+}
+
+QByteArray AbstractOperation::serialize() const {
+    return QByteArray();
+}
+
+qint64 AbstractOperation::enqueueTime() const {
+    return m_enqueueTime;
+}
+
+void AbstractOperation::addGroupTag(const QByteArray& aTag) {
+    if(!m_groupTags.contains(aTag)) {
+        m_groupTags.append(aTag);
+    }
+}
+
+QList<QByteArray> AbstractOperation::groupTags() const {
+    return m_groupTags;
+}
+
+bool AbstractOperation::hasGroupTag(const QByteArray& aTag) const {
+    return m_groupTags.contains(aTag);
+}
+
+void AbstractOperation::setRetryPolicy(const RetryPolicy& aPolicy) {
+    m_retryPolicy = aPolicy;
+}
+
+const AbstractOperation::RetryPolicy& AbstractOperation::retryPolicy() const {
+    return m_retryPolicy;
+}
+
+int AbstractOperation::attemptCount() const {
+    return m_attempts;
+}
+
+void AbstractOperation::setDeliveryPolicy(DeliveryPolicy aPolicy) {
+    m_deliveryPolicy = aPolicy;
+}
+
+AbstractOperation::DeliveryPolicy AbstractOperation::deliveryPolicy() const {
+    return m_deliveryPolicy;
+}
+
+AbstractOperation::WorkloadClass AbstractOperation::workloadClass() const {
+    return m_workloadClass;
+}
+
+void AbstractOperation::setWorkloadClass(WorkloadClass aClass) {
+    m_workloadClass = aClass;
+}
+
+AbstractOperation::PriorityClass AbstractOperation::priorityClass() const {
+    return m_priority;
+}
+
 void AbstractOperation::started(int aTimeout) {
     setStatus(OperationRunning);
-    m_queueHandler->startTimer(aTimeout);
+    m_attemptToken = m_queueHandler->currentEpoch();
+    // the members of a batch run by the default executeBatch() leave the timer of the batch alone
+    if(m_queueHandler->isCurrentOperation(this)) {
+        m_queueHandler->startTimer(aTimeout < 0 ? m_queueHandler->defaultTimeout() : aTimeout);
+    }
 }
 
 void AbstractOperation::success() {
@@ -78,14 +215,36 @@ void AbstractOperation::failed() {
     setStatus(OperationFailed);
 }
 
-void AbstractOperation::finished() {
+int AbstractOperation::attemptToken() const {
+    return m_attemptToken;
+}
+
+void AbstractOperation::finished(int aAttemptToken) {
     //do NOT make the operation call operationFinished if it timeout
     //since the queue handler would have called it already!
-    if( status() != OperationTimedOut) {
+    //the same goes for a late call from an attempt which has already been ended,
+    //a retry runs with the same operation: only the token tells them apart
+    if( status() != OperationTimedOut && m_queueHandler->isCurrentAttempt(this, aAttemptToken)) {
         m_queueHandler->operationFinished();
     }
 }
 
+void AbstractOperation::executeBatch(const QList<AbstractOperation*>& aBatch) {
+    // not batch aware: each one on its own, their finished() is ignored (they are not current)
+    foreach(AbstractOperation* operation, aBatch) {
+        if(operation != this && operation->status() == OperationRunning) {
+            operation->execute();
+        }
+    }
+    execute();
+}
+
+void AbstractOperation::pause(int aAttemptToken) {
+    if( status() != OperationTimedOut && m_queueHandler->isCurrentAttempt(this, aAttemptToken)) {
+        m_queueHandler->operationPaused();
+    }
+}
+
 void AbstractOperation::cancel() {
 }
 
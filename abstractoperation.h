@@ -4,6 +4,8 @@
 #include <QObject>
 #include <QByteArray>
 #include <QMetaType>
+#include <QList>
+#include <QVariant>
 
 class WorkerThread;
 class QueueHandler;
@@ -31,6 +33,67 @@ public:
     };
     static const int MASK_OperationStatus                = 0xFFFF0000;
     static const int MASK_OperationCustomStatusCode      = 0x0000FFFF;
+    /**
+      * The queue of a QueueHandler an operation has been added to.
+      */
+    enum PriorityClass
+    {
+        PriorityNormal,
+        PriorityHigh,
+        // runs only when there is nothing else to do (see pause())
+        PriorityIdle
+    };
+    /**
+      * What the operation spends its time on, it picks the lane of a WorkerLanes.
+      */
+    enum WorkloadClass
+    {
+        // computing: there is no point in running more of them than there are cores
+        WorkloadCpu,
+        // mostly blocked on files or sockets
+        WorkloadIo
+    };
+    /**
+      * Where the observer callback is called.
+      */
+    enum DeliveryPolicy
+    {
+        // queued to the thread of the observer (the default)
+        DeliverToObserverThread,
+        // right away in the worker thread, as soon as the QueueHandler has released its mutexes
+        // (so the observer may add or cancel operations), from its event loop when the result
+        // comes out of addOperation() or cancelOperation(): the observer must be thread safe
+        DeliverDirect,
+        // queued to the callback thread or pool of the QueueHandler (see QueueHandler::setCallbackThread),
+        // the observer must be thread safe
+        DeliverToCallbackThread
+    };
+    /**
+      * When an execution ends with one of the m_retryOn statuses the QueueHandler queues
+      * the operation again after a backoff delay, up to m_maxAttempts executions in all.
+      * The observer is called only once, with the outcome of the last attempt.
+      */
+    struct RetryPolicy {
+        RetryPolicy();
+        // executions in all, 1 means never retry (the default)
+        int m_maxAttempts;
+        // msecs before the first retry, multiplied by m_multiplier before each following one
+        int m_initialBackoff;
+        double m_multiplier;
+        int m_maxBackoff;
+        // each delay is randomly spread by +/- this fraction of it (0.2 is +/-20%)
+        double m_jitter;
+        // OperationFailed and OperationTimedOut by default, cancelled operations never retry
+        QList<OperationStatus> m_retryOn;
+
+        bool retriesOn(OperationStatus aStatus) const;
+        /**
+          * Delay (msecs) before running again after the execution number @aAttempt (1 based).
+          * @aSpread, in [-1, 1], is where the delay falls in its jitter range: the QueueHandler
+          * draws it from its own random sequence.
+          */
+        int backoff(int aAttempt, double aSpread) const;
+    };
 public:
     AbstractOperation(QObject* aObserver = 0, const char* aSlot = 0);
     virtual ~AbstractOperation();
@@ -52,13 +115,107 @@ public:
 
     QObject* observer();
     const char* callbackMethod();
+    /**
+      * Operations sharing the same key share the same rate limit (see QueueHandler::setRateLimit).
+      * By default it is the one set with setRateLimitKey(), empty means not limited.
+      * It is read once, when the operation is queued.
+      */
+    virtual QByteArray rateLimitKey() const;
+    void setRateLimitKey(const QByteArray& aKey);
+    /**
+      * Who this operation is done for, when the queue is in fair share mode
+      * (see QueueHandler::setFairShare). By default it is the observer.
+      */
+    virtual quintptr tenantKey() const;
+    void setTenantKey(quintptr aKey);
+    /**
+      * Queued operations with the same non empty key can be executed together by
+      * executeBatch() (see QueueHandler::setBatching). Empty by default.
+      */
+    virtual QByteArray batchKey() const;
+    /**
+      * Operations with the same non empty key compute the same result: when the QueueHandler has
+      * a ResultCache (see QueueHandler::setResultCache) a cached result is given to them instead of
+      * executing them, and the ones added while that key is being computed share that execution.
+      * Empty by default (never cached).
+      */
+    virtual QByteArray cacheKey() const;
+    /**
+      * The result of a successful execution, as cached (or sent back by a helper process,
+      * see ProcessQueueHandler), and how to take it back.
+      * setResultFromCache() of a cache hit is called in the thread adding the operation.
+      */
+    virtual QVariant resultForCache() const;
+    virtual void setResultFromCache(const QVariant& aResult);
+    /**
+      * How much of the cache the result takes: 1 by default, its size in bytes
+      * (for instance) if the cache cost is memory.
+      */
+    virtual int cacheCost() const;
+    /**
+      * Operations with a non empty type are kept in the OperationJournal of the QueueHandler
+      * (see QueueHandler::setJournal()) until they are over, and rebuilt from serialize() by
+      * the factory registered for their type if the process ends before that.
+      * A ProcessQueueHandler runs them in its helper process the same way.
+      * Empty by default (not journaled).
+      */
+    virtual QByteArray journalType() const;
+    virtual QByteArray serialize() const;
+    /**
+      * When the operation entered the queue (QueueHandler clock msecs).
+      */
+    qint64 enqueueTime() const;
+    /**
+      * Make the operation part of the group @aTag (e.g. the document it works on), an operation
+      * can be in several groups. See QueueHandler::cancelGroup(). Tag it before adding it to the queue.
+      */
+    void addGroupTag(const QByteArray& aTag);
+    QList<QByteArray> groupTags() const;
+    bool hasGroupTag(const QByteArray& aTag) const;
+    /**
+      * Set it before adding the operation to the queue.
+      */
+    void setRetryPolicy(const RetryPolicy& aPolicy);
+    const RetryPolicy& retryPolicy() const;
+    /**
+      * How many times the operation has been executed since it was added (the current one included).
+      */
+    int attemptCount() const;
+    void setDeliveryPolicy(DeliveryPolicy aPolicy);
+    DeliveryPolicy deliveryPolicy() const;
+    /**
+      * By default the one set with setWorkloadClass(), WorkloadCpu if none.
+      */
+    virtual WorkloadClass workloadClass() const;
+    void setWorkloadClass(WorkloadClass aClass);
+    PriorityClass priorityClass() const;
 protected:
     /**
       * This is the first function that should be executed in the execute of the Operation.
       * As parameter put the desired timeout it the default one does not suit
-      * that particular operation.
+      * that particular operation. -1 is the default timeout of the QueueHandler
+      * (see QueueHandler::setDefaultTimeout()). The timeout counts from the start of the
+      * execution: calling it again changes the timeout, it does not push it back.
       */
-    void started(int aTimeout = KDefaultTimeoutOperation);
+    void started(int aTimeout = -1);
+    /**
+      * Identifies the execution started last. An operation finishing asynchronously should keep it
+      * with the work it starts and pass it to finished() or pause(): when that execution has already
+      * been ended (e.g. it timed out and a retry is running now) the call is then ignored.
+      */
+    int attemptToken() const;
+    /**
+      * Execute together the operations in @aBatch, all with the same batchKey(); this one is
+      * the first of them. They are all OperationRunning when it is called: set the status of
+      * each of them (leave alone the ones cancelled in the meanwhile) and call finished()
+      * on this one only, when the whole batch is done. The timeout covers the whole batch.
+      * A batch of one operation is run with execute() instead.
+      * By default they are executed one after the other with execute(), this one last since its
+      * finished() ends the batch: the others must be done when their execute() returns. Their
+      * started() does not touch the timeout, and the one of this operation counts from the start
+      * of the batch.
+      */
+    virtual void executeBatch(const QList<AbstractOperation*>& aBatch);
     /**
       * When writing a operation, it should be periodically checking this method
       * and, if possible, gracefully stop the ongoing operation should this
@@ -87,8 +244,16 @@ protected:
       * Call this function when the operation is finished (whether successfully or not)
       * If this function is not called, the operation will eventually killed
       * by the timeout event.
+      * @aAttemptToken is the attemptToken() of the execution being finished, -1 for the current one.
+      */
+    void finished(int aAttemptToken = -1);
+    /**
+      * Idle priority operations only: call it instead of finished() when canContinue()
+      * returns false because other work has arrived. The operation goes back to the idle
+      * queue and execute() is called again later: keep in it what is needed to resume.
+      * If the operation has been cancelled or timed out instead, it is the same as finished().
       */
-    void finished();
+    void pause(int aAttemptToken = -1);
     /**
       * Function called if the operation has to stop, whether for a timeout or because it has been cancelled.
       * Do any clean up here if needed.
@@ -109,6 +274,10 @@ protected:
     QueueHandler* queueHandler();
 private: // defyning methods not to be used by anyone apart from the QueueHandler
     friend class QueueHandler;
+    friend class ResultCache;
+    friend class OperationJournal;
+    friend class ProcessQueueHandler;
+    friend class WorkerPool;
     void setQueueHandler(QueueHandler* aQueueHandler);
 private:
     QObject* m_observer;
@@ -116,6 +285,22 @@ private:
 
     int m_status;
     QueueHandler* m_queueHandler;
+    // when the operation entered the queue (monotonic msecs)
+    qint64 m_enqueueTime;
+    QByteArray m_rateLimitKey;
+    quintptr m_tenantKey;
+    bool m_hasTenantKey;
+    QList<QByteArray> m_groupTags;
+    RetryPolicy m_retryPolicy;
+    int m_attempts;
+    // QueueHandler epoch of the execution started last, -1 if none
+    int m_attemptToken;
+    DeliveryPolicy m_deliveryPolicy;
+    WorkloadClass m_workloadClass;
+    // in the OperationJournal, -1 if not journaled
+    qint64 m_journalEntry;
+    // the queue it was added to, where its retries go
+    PriorityClass m_priority;
 };
 
 #endif // ABSTRACTOPERATION_H
@@ -4,7 +4,8 @@
 #ifdef ABSTRACT_OPERATION_HANDLER
     #define ENABLE_LOG_MACROS
 #endif
-#include "logmacros.h"
+#include "workerlog.h"
+WORKER_LOG_CATEGORY("AbstractOperationObserver");
 
 AbstractOperationObserver::AbstractOperationObserver(QObject* aParent)
     : QObject(aParent)
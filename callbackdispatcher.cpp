@@ -0,0 +1,57 @@
+#include "callbackdispatcher.h"
+#include "abstractoperation.h"
+
+#include <QByteArray>
+#include <QMetaObject>
+#include <QRunnable>
+#include <QThreadPool>
+
+#include "activelogs.h"
+#ifdef CALLBACK_DISPATCHER
+    #define ENABLE_LOG_MACROS
+#endif
+#include "workerlog.h"
+WORKER_LOG_CATEGORY("CallbackDispatcher");
+
+namespace {
+    class CallbackRunnable : public QRunnable
+    {
+    public:
+        CallbackRunnable(AbstractOperation* aOperation) :
+                m_operation(aOperation)
+        {
+            setAutoDelete(true);
+        }
+        void run() {
+            CallbackDispatcher::invokeCallback(m_operation, Qt::DirectConnection);
+        }
+    private:
+        AbstractOperation* m_operation;
+    };
+}
+
+CallbackDispatcher::CallbackDispatcher(QObject* aParent) :
+        QObject(aParent)
+{
+}
+
+bool CallbackDispatcher::invokeCallback(AbstractOperation* aOperation, Qt::ConnectionType aConnectionType) {
+    QObject* observer = aOperation->observer();
+    QByteArray callbackMethodFullSig( aOperation->callbackMethod() );
+    int parenthesis = callbackMethodFullSig.indexOf("(");
+    QByteArray callbackMethod( callbackMethodFullSig.left(parenthesis) );
+
+    if(false == QMetaObject::invokeMethod( observer, callbackMethod.data(), aConnectionType, Q_ARG( void*, (void*) aOperation ))) {
+        CRITICAL("could not invoke" << callbackMethod.data() << "callback method for operation!");
+        return false;
+    }
+    return true;
+}
+
+void CallbackDispatcher::deliverInPool(QThreadPool* aPool, AbstractOperation* aOperation) {
+    aPool->start(new CallbackRunnable(aOperation));
+}
+
+void CallbackDispatcher::deliver(void* aOperation) {
+    invokeCallback(reinterpret_cast<AbstractOperation*>(aOperation), Qt::DirectConnection);
+}
@@ -0,0 +1,36 @@
+#ifndef CALLBACKDISPATCHER_H
+#define CALLBACKDISPATCHER_H
+
+#include <QObject>
+
+class AbstractOperation;
+class QThreadPool;
+
+/**
+  * Gives the finished operations back to their observers on behalf of a QueueHandler,
+  * from the thread it lives in or from a thread pool (see AbstractOperation::DeliverToCallbackThread).
+  * The observer callback is called directly there, whatever thread the observer lives in.
+  */
+class CallbackDispatcher : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CallbackDispatcher(QObject* aParent = 0);
+public:
+    /**
+      * Invoke the observer callback of @aOperation with @aConnectionType.
+      * Returns false if the observer has no such callback.
+      */
+    static bool invokeCallback(AbstractOperation* aOperation, Qt::ConnectionType aConnectionType);
+    /**
+      * Invoke the observer callback of @aOperation from one of the threads of @aPool.
+      */
+    static void deliverInPool(QThreadPool* aPool, AbstractOperation* aOperation);
+public slots:
+    /**
+      * Invoke the observer callback of @aOperation from the thread of the dispatcher.
+      */
+    void deliver(void* aOperation);
+};
+
+#endif // CALLBACKDISPATCHER_H
@@ -0,0 +1,568 @@
+#include "operationjournal.h"
+#include "abstractoperation.h"
+
+#include <QMutexLocker>
+#include <QThread>
+#include <cstdio>
+#include <cstring>
+
+#ifdef Q_OS_WIN
+    #include <windows.h>
+    #include <io.h>
+#else
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
+
+#include "activelogs.h"
+#ifdef OPERATION_JOURNAL
+    #define ENABLE_LOG_MACROS
+#endif
+#include "workerlog.h"
+WORKER_LOG_CATEGORY("OperationJournal");
+
+namespace {
+    const quint32 KJournalMagic = 0x574A524E;
+    // 2: 32 bit checksums covering the record header
+    const quint32 KJournalVersion = 2;
+    // compact when less than 1/KJournalCompactRatio of the records written are still pending
+    const int KJournalCompactRatio = 4;
+    // the new file while compacting, left behind only by a crash before it replaced the journal
+    const char* const KCompactSuffix = ".compact";
+
+    // records are 8 bytes aligned
+    inline qint64 recordSize(qint64 aHeaderSize, qint64 aPayloadSize) {
+        return (aHeaderSize + aPayloadSize + 7) & ~7;
+    }
+
+    void syncRange(uchar* aAddress, qint64 aSize) {
+#ifdef Q_OS_WIN
+        FlushViewOfFile(aAddress, aSize);
+#else
+        msync(aAddress, aSize, MS_SYNC);
+#endif
+    }
+
+    bool syncFile(QFile& aFile) {
+#ifdef Q_OS_WIN
+        return FlushFileBuffers((HANDLE)_get_osfhandle(aFile.handle()));
+#else
+        return fsync(aFile.handle()) == 0;
+#endif
+    }
+
+    // atomically, the old file stays as it was if it fails (as it does on Windows while
+    // either file is open: the journal is not compacted there)
+    bool replaceFile(const QString& aFrom, const QString& aTo) {
+#ifdef Q_OS_WIN
+        return MoveFileExW((LPCWSTR)aFrom.utf16(), (LPCWSTR)aTo.utf16(),
+                           MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+        return ::rename(QFile::encodeName(aFrom).constData(), QFile::encodeName(aTo).constData()) == 0;
+#endif
+    }
+
+    // the CRC-32 of zlib and Ethernet, built before main() so that no thread races to build it
+    struct Crc32Table {
+        Crc32Table() {
+            for(quint32 i = 0; i < 256; ++i) {
+                quint32 crc = i;
+                for(int bit = 0; bit < 8; ++bit) {
+                    crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+                }
+                m_table[i] = crc;
+            }
+        }
+        quint32 m_table[256];
+    };
+    const Crc32Table KCrc32Table;
+
+    quint32 crc32(quint32 aCrc, const uchar* aData, qint64 aSize) {
+        quint32 crc = ~aCrc;
+        for(qint64 i = 0; i < aSize; ++i) {
+            crc = KCrc32Table.m_table[(crc ^ aData[i]) & 0xFF] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+}
+
+/**
+  * Syncs the journal in the background, see OperationJournal::setCommitPolicy().
+  */
+class JournalCommitThread : public QThread
+{
+public:
+    JournalCommitThread(OperationJournal* aJournal) :
+            m_journal(aJournal)
+    {
+    }
+protected:
+    void run() {
+        m_journal->commitLoop();
+    }
+private:
+    OperationJournal* m_journal;
+};
+
+OperationJournal::OperationJournal() :
+        m_file(new QFile),
+        m_map(0),
+        m_mapSize(0),
+        m_end(0),
+        m_pending(0),
+        m_liveBytes(0),
+        m_nextEntry(0),
+        m_dirty(0),
+        m_commitInterval(KDefaultJournalCommitInterval),
+        m_commitBatch(KDefaultJournalCommitBatch),
+        m_closing(false),
+        m_compactRequested(false),
+        m_compactFailed(false),
+        m_commitThread(0)
+{
+}
+
+OperationJournal::~OperationJournal() {
+    close();
+    delete m_file;
+}
+
+bool OperationJournal::open(const QString& aFileName) {
+    DEBUG_ENTER_FN();
+    {
+        QMutexLocker locker(&m_mutex);
+        if(m_map) {
+            WARNING("journal already open");
+            return false;
+        }
+        // an interrupted compaction, the journal itself is still whole
+        QFile::remove(aFileName + KCompactSuffix);
+        m_fileName = aFileName;
+        m_file->setFileName(aFileName);
+        if(!m_file->open(QIODevice::ReadWrite)) {
+            CRITICAL("can not open" << aFileName << ":" << m_file->errorString());
+            return false;
+        }
+        if(!remap(qMax<qint64>(m_file->size(), KDefaultJournalSize))) {
+            m_file->close();
+            return false;
+        }
+        FileHeader* fileHeader = header();
+        if(fileHeader->m_magic == 0) {
+            // a new file, zero filled
+            fileHeader->m_magic = KJournalMagic;
+            fileHeader->m_version = KJournalVersion;
+            fileHeader->m_generation = 1;
+        } else if(fileHeader->m_magic != KJournalMagic || fileHeader->m_version != KJournalVersion) {
+            CRITICAL(aFileName << "is not a journal of this version");
+            QMutexLocker mapLocker(&m_mapMutex);
+            m_file->unmap(m_map);
+            m_map = 0;
+            m_mapSize = 0;
+            m_file->close();
+            return false;
+        }
+        recover();
+        DEBUG("opened" << aFileName << "with" << m_pending << "pending entries");
+        m_closing = false;
+        m_compactRequested = false;
+        m_compactFailed = false;
+        m_commitThread = new JournalCommitThread(this);
+        m_commitThread->start();
+    }
+    DEBUG_EXIT_FN();
+    return true;
+}
+
+void OperationJournal::close() {
+    DEBUG_ENTER_FN();
+    {
+        QMutexLocker locker(&m_mutex);
+        // the mapping may be gone already if growing it failed
+        if(!m_commitThread) {
+            return;
+        }
+        m_closing = true;
+        m_commitWait.wakeAll();
+    }
+    m_commitThread->wait();
+    delete m_commitThread;
+    m_commitThread = 0;
+    {
+        QMutexLocker locker(&m_mutex);
+        QMutexLocker mapLocker(&m_mapMutex);
+        if(m_map) {
+            syncRange(m_map, m_mapSize);
+            m_file->unmap(m_map);
+        }
+        m_map = 0;
+        m_mapSize = 0;
+        m_file->close();
+        m_recovered.clear();
+        m_offsets.clear();
+        m_pending = 0;
+        m_liveBytes = 0;
+        m_dirty = 0;
+    }
+    DEBUG_EXIT_FN();
+}
+
+bool OperationJournal::isOpen() {
+    QMutexLocker locker(&m_mutex);
+    return m_map != 0;
+}
+
+void OperationJournal::setCommitPolicy(int aInterval, int aBatch) {
+    QMutexLocker locker(&m_mutex);
+    m_commitInterval = qMax(0, aInterval);
+    m_commitBatch = qMax(1, aBatch);
+}
+
+void OperationJournal::registerType(const QByteArray& aType, OperationFactory aFactory) {
+    QMutexLocker locker(&m_mutex);
+    m_factories.insert(aType, aFactory);
+}
+
+QList<AbstractOperation*> OperationJournal::replay(QObject* aObserver, const char* aSlot) {
+    QList<AbstractOperation*> result;
+    QMutexLocker locker(&m_mutex);
+    foreach(qint64 entry, m_recovered) {
+        RecordHeader* recordHeader = record(m_offsets.value(entry));
+        const char* payload = reinterpret_cast<const char*>(recordHeader + 1);
+        QByteArray type(payload, recordHeader->m_typeSize);
+        OperationFactory factory = m_factories.value(type);
+        AbstractOperation* operation = 0;
+        if(factory) {
+            operation = factory(QByteArray(payload + recordHeader->m_typeSize, recordHeader->m_dataSize), aObserver, aSlot);
+        }
+        if(!operation) {
+            CRITICAL("can not rebuild an operation of type" << type << ", discarded");
+            recordHeader->m_state = RecordDone;
+            m_pending--;
+            m_liveBytes -= recordSize(sizeof(RecordHeader), recordHeader->m_typeSize + recordHeader->m_dataSize);
+            m_offsets.remove(entry);
+            m_dirty++;
+            continue;
+        }
+        operation->m_journalEntry = entry;
+        result.append(operation);
+    }
+    m_recovered.clear();
+    if(m_dirty) {
+        m_commitWait.wakeOne();
+    }
+    return result;
+}
+
+qint64 OperationJournal::append(AbstractOperation* aOperation) {
+    QByteArray type = aOperation->journalType();
+    QByteArray data = aOperation->serialize();
+    if(type.size() > 0xFFFF) {
+        CRITICAL("journal type too long, operation" << aOperation->id() << "not journaled");
+        return -1;
+    }
+    QMutexLocker locker(&m_mutex);
+    qint64 size = recordSize(sizeof(RecordHeader), type.size() + data.size());
+    if(!m_map || !ensureCapacity(m_end + size)) {
+        return -1;
+    }
+    RecordHeader* recordHeader = record(m_end);
+    uchar* payload = reinterpret_cast<uchar*>(recordHeader + 1);
+    memcpy(payload, type.constData(), type.size());
+    memcpy(payload + type.size(), data.constData(), data.size());
+    recordHeader->m_generation = header()->m_generation;
+    recordHeader->m_typeSize = type.size();
+    recordHeader->m_reserved = 0;
+    recordHeader->m_dataSize = data.size();
+    recordHeader->m_checksum = checksum(recordHeader, payload);
+    // last: until then this is the end of the journal
+    recordHeader->m_state = RecordPending;
+    qint64 entry = m_nextEntry++;
+    m_offsets.insert(entry, m_end);
+    m_end += size;
+    m_pending++;
+    m_liveBytes += size;
+    if(++m_dirty == 1 || m_dirty >= m_commitBatch) {
+        m_commitWait.wakeOne();
+    }
+    return entry;
+}
+
+void OperationJournal::complete(qint64 aEntry) {
+    QMutexLocker locker(&m_mutex);
+    QMap<qint64, qint64>::iterator offset = m_offsets.find(aEntry);
+    if(!m_map || offset == m_offsets.end()) {
+        return;
+    }
+    RecordHeader* recordHeader = record(offset.value());
+    m_offsets.erase(offset);
+    recordHeader->m_state = RecordDone;
+    m_pending--;
+    m_liveBytes -= recordSize(sizeof(RecordHeader), recordHeader->m_typeSize + recordHeader->m_dataSize);
+    // not urgent: at worst the operation is replayed once more
+    if(++m_dirty == 1 || m_dirty >= m_commitBatch) {
+        m_commitWait.wakeOne();
+    }
+    if(m_end <= m_mapSize / 2) {
+        return;
+    }
+    if(m_pending == 0) {
+        rewind();
+    } else if(!m_compactRequested && !m_compactFailed &&
+            m_liveBytes * KJournalCompactRatio < m_end - (qint64)sizeof(FileHeader)) {
+        m_compactRequested = true;
+        m_commitWait.wakeOne();
+    }
+}
+
+void OperationJournal::commit() {
+    {
+        QMutexLocker locker(&m_mutex);
+        m_dirty = 0;
+    }
+    syncMapping();
+}
+
+int OperationJournal::pendingCount() {
+    QMutexLocker locker(&m_mutex);
+    return m_pending;
+}
+
+bool OperationJournal::ensureCapacity(qint64 aSize) {
+    if(aSize <= m_mapSize) {
+        return true;
+    }
+    qint64 size = qMax<qint64>(m_mapSize, KDefaultJournalSize);
+    while(size < aSize) {
+        size *= 2;
+    }
+    DEBUG("growing to" << size << "bytes");
+    return remap(size);
+}
+
+void OperationJournal::recover() {
+    m_recovered.clear();
+    m_offsets.clear();
+    m_pending = 0;
+    m_liveBytes = 0;
+    quint32 generation = header()->m_generation;
+    qint64 offset = sizeof(FileHeader);
+    while(offset + (qint64)sizeof(RecordHeader) <= m_mapSize) {
+        RecordHeader* recordHeader = record(offset);
+        if((recordHeader->m_state != RecordPending && recordHeader->m_state != RecordDone) ||
+                recordHeader->m_generation != generation) {
+            break;
+        }
+        // the sizes are checked by the checksum, but only once they are known to be in the file
+        qint64 size = recordSize(sizeof(RecordHeader), (qint64)recordHeader->m_typeSize + recordHeader->m_dataSize);
+        if(offset + size > m_mapSize ||
+                checksum(recordHeader, reinterpret_cast<const uchar*>(recordHeader + 1)) != recordHeader->m_checksum) {
+            // written only in part when the process died, it was never acknowledged as durable
+            WARNING("torn record at" << offset << ", the journal ends there");
+            break;
+        }
+        if(recordHeader->m_state == RecordPending) {
+            qint64 entry = m_nextEntry++;
+            m_offsets.insert(entry, offset);
+            m_recovered.append(entry);
+            m_pending++;
+            m_liveBytes += size;
+        }
+        offset += size;
+    }
+    m_end = offset;
+    if(m_pending == 0) {
+        rewind();
+    }
+}
+
+void OperationJournal::rewind() {
+    header()->m_generation++;
+    m_end = sizeof(FileHeader);
+    // left to the commit thread: whatever gets on disk first, a record of the new generation
+    // is ignored under the old header and the old records (all done) under the new one
+    if(++m_dirty == 1 || m_dirty >= m_commitBatch) {
+        m_commitWait.wakeOne();
+    }
+}
+
+void OperationJournal::compact(QMutexLocker& aLocker) {
+    QString compactName = m_fileName + KCompactSuffix;
+    DEBUG("compacting" << m_pending << "pending entries," << m_liveBytes << "of" << m_end << "bytes");
+    // the new file as it will be, from the records pending now: copying them is quick,
+    // the writing is done with the mutex released
+    quint32 generation = header()->m_generation;
+    qint64 snapshotEntry = m_nextEntry;
+    // the same size: it is only half used, and no growing while compacting
+    qint64 mapSize = m_mapSize;
+    QMap<qint64, qint64> offsets;
+    QByteArray image(int(sizeof(FileHeader) + m_liveBytes), 0);
+    uchar* target = reinterpret_cast<uchar*>(image.data());
+    FileHeader* fileHeader = reinterpret_cast<FileHeader*>(target);
+    fileHeader->m_magic = KJournalMagic;
+    fileHeader->m_version = KJournalVersion;
+    fileHeader->m_generation = generation + 1;
+    fileHeader->m_reserved = 0;
+    qint64 end = sizeof(FileHeader);
+    QMap<qint64, qint64>::const_iterator entry = m_offsets.constBegin();
+    for(; entry != m_offsets.constEnd(); ++entry) {
+        offsets.insert(entry.key(), end);
+        end += copyRecord(record(entry.value()), generation + 1, target + end);
+    }
+
+    aLocker.unlock();
+    QFile* compacted = new QFile(compactName);
+    uchar* compactedMap = 0;
+    // the zero filled tail ends the journal
+    if(compacted->open(QIODevice::ReadWrite | QIODevice::Truncate) &&
+            compacted->write(image) == image.size() && compacted->flush() &&
+            compacted->resize(mapSize) && syncFile(*compacted)) {
+        compactedMap = compacted->map(0, mapSize);
+    }
+    aLocker.relock();
+
+    bool replaced = false;
+    if(!compactedMap) {
+        CRITICAL("can not write" << compactName << ":" << compacted->errorString());
+        m_compactFailed = true;
+    } else if(m_map && header()->m_generation == generation) {
+        // what happened meanwhile: completions...
+        QMap<qint64, qint64>::iterator copied = offsets.begin();
+        while(copied != offsets.end()) {
+            if(m_offsets.contains(copied.key())) {
+                ++copied;
+            } else {
+                reinterpret_cast<RecordHeader*>(compactedMap + copied.value())->m_state = RecordDone;
+                copied = offsets.erase(copied);
+            }
+        }
+        // ...and appends, there is room for them unless the journal grew
+        bool fits = true;
+        for(entry = m_offsets.lowerBound(snapshotEntry); fits && entry != m_offsets.constEnd(); ++entry) {
+            const RecordHeader* source = record(entry.value());
+            qint64 size = recordSize(sizeof(RecordHeader), (qint64)source->m_typeSize + source->m_dataSize);
+            fits = end + size <= mapSize;
+            if(fits) {
+                offsets.insert(entry.key(), end);
+                end += copyRecord(source, generation + 1, compactedMap + end);
+            }
+        }
+        if(fits) {
+            // they may have been committed already, they must not go away with the old file
+            syncRange(compactedMap, end);
+            // the commit point: until the rename the old journal is the one a crash leaves behind
+            replaced = replaceFile(compactName, m_fileName);
+            if(!replaced) {
+                CRITICAL("can not replace" << m_fileName << "with" << compactName);
+                m_compactFailed = true;
+            }
+        }
+    }
+    // else rewound or closed meanwhile: nothing to compact any more
+
+    if(replaced) {
+        {
+            QMutexLocker mapLocker(&m_mapMutex);
+            m_file->unmap(m_map);
+            m_map = compactedMap;
+        }
+        delete m_file;
+        m_file = compacted;
+        m_offsets = offsets;
+        m_end = end;
+        // all on disk already
+        m_dirty = 0;
+        DEBUG("compacted to" << m_end << "bytes");
+        return;
+    }
+    // the journal goes on with the old file
+    if(compactedMap) {
+        compacted->unmap(compactedMap);
+    }
+    delete compacted;
+    QFile::remove(compactName);
+}
+
+OperationJournal::FileHeader* OperationJournal::header() {
+    return reinterpret_cast<FileHeader*>(m_map);
+}
+
+OperationJournal::RecordHeader* OperationJournal::record(qint64 aOffset) {
+    return reinterpret_cast<RecordHeader*>(m_map + aOffset);
+}
+
+qint64 OperationJournal::copyRecord(const RecordHeader* aSource, quint32 aGeneration, uchar* aTarget) {
+    const uchar* payload = reinterpret_cast<const uchar*>(aSource + 1);
+    qint64 payloadSize = (qint64)aSource->m_typeSize + aSource->m_dataSize;
+    qint64 size = recordSize(sizeof(RecordHeader), payloadSize);
+    RecordHeader* copy = reinterpret_cast<RecordHeader*>(aTarget);
+    *copy = *aSource;
+    copy->m_generation = aGeneration;
+    memcpy(copy + 1, payload, payloadSize);
+    memset(aTarget + sizeof(RecordHeader) + payloadSize, 0, size - sizeof(RecordHeader) - payloadSize);
+    copy->m_checksum = checksum(copy, payload);
+    return size;
+}
+
+quint32 OperationJournal::checksum(const RecordHeader* aHeader, const uchar* aPayload) {
+    // from m_generation on: a torn header with wrong sizes is detected as well,
+    // m_state is left out since it changes when the record is done
+    const uchar* fields = reinterpret_cast<const uchar*>(&aHeader->m_generation);
+    qint64 fieldsSize = sizeof(RecordHeader) - (fields - reinterpret_cast<const uchar*>(aHeader));
+    quint32 crc = crc32(0, fields, fieldsSize);
+    return crc32(crc, aPayload, (qint64)aHeader->m_typeSize + aHeader->m_dataSize);
+}
+
+bool OperationJournal::remap(qint64 aSize) {
+    QMutexLocker mapLocker(&m_mapMutex);
+    if(m_map) {
+        syncRange(m_map, m_mapSize);
+        m_file->unmap(m_map);
+        m_map = 0;
+        m_mapSize = 0;
+    }
+    if(m_file->size() < aSize && !m_file->resize(aSize)) {
+        CRITICAL("can not resize the journal to" << aSize << "bytes:" << m_file->errorString());
+        return false;
+    }
+    m_map = m_file->map(0, aSize);
+    if(!m_map) {
+        CRITICAL("can not map the journal:" << m_file->errorString());
+        return false;
+    }
+    m_mapSize = aSize;
+    return true;
+}
+
+void OperationJournal::syncMapping() {
+    QMutexLocker mapLocker(&m_mapMutex);
+    if(m_map) {
+        syncRange(m_map, m_mapSize);
+    }
+}
+
+void OperationJournal::commitLoop() {
+    QMutexLocker locker(&m_mutex);
+    while(!m_closing) {
+        if(m_compactRequested) {
+            m_compactRequested = false;
+            if(m_map) {
+                compact(locker);
+            }
+            continue;
+        }
+        if(m_dirty == 0) {
+            m_commitWait.wait(&m_mutex);
+            continue;
+        }
+        if(m_dirty < m_commitBatch) {
+            // let more appends join this commit
+            m_commitWait.wait(&m_mutex, m_commitInterval);
+        }
+        VERBOSE("committing" << m_dirty << "changes");
+        m_dirty = 0;
+        locker.unlock();
+        syncMapping();
+        locker.relock();
+    }
+}
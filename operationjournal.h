@@ -0,0 +1,162 @@
+#ifndef OPERATIONJOURNAL_H
+#define OPERATIONJOURNAL_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QMutex>
+#include <QString>
+#include <QWaitCondition>
+
+class AbstractOperation;
+class QObject;
+class JournalCommitThread;
+
+// initial size of the journal file, it doubles when full
+const int KDefaultJournalSize = 1024 * 1024;
+// an append is on disk at most this many msecs later...
+const int KDefaultJournalCommitInterval = 20;
+// ...or as soon as this many appends are waiting for it
+const int KDefaultJournalCommitBatch = 64;
+
+/**
+  * Rebuilds an operation from what its AbstractOperation::serialize() returned.
+  */
+typedef AbstractOperation* (*OperationFactory)(const QByteArray& aData, QObject* aObserver, const char* aSlot);
+
+/**
+  * Durable record of the operations not over yet, so that they survive a crash or a restart.
+  * The QueueHandlers it is set to (see QueueHandler::setJournal()) append the operations with
+  * a journal type (see AbstractOperation::journalType()) when they are added, and mark them
+  * done when they are given back to their observer. Operations cancelled because their thread
+  * is terminating are not done: they are replayed at the next start.
+  *
+  * The file is memory mapped: an append is a copy, no system call. The mapping is synced by
+  * a commit thread, in groups (see setCommitPolicy()); commit() syncs right away.
+  * Once nothing is pending the journal starts over from the beginning of the file. When the
+  * file is mostly done records but some stay pending (e.g. under steady load), the commit
+  * thread compacts it: the pending records are copied to a new file, which replaces it.
+  * Thread safe.
+  */
+class OperationJournal
+{
+public:
+    OperationJournal();
+    ~OperationJournal();
+public:
+    /**
+      * Open (or create) @aFileName and recover the entries still pending in it.
+      * Returns false if the file could not be opened or mapped.
+      */
+    bool open(const QString& aFileName);
+    /**
+      * Commit and close the file, what is still pending stays in it.
+      */
+    void close();
+    bool isOpen();
+    /**
+      * Sync at most @aInterval msecs after an append, or when @aBatch appends are waiting.
+      */
+    void setCommitPolicy(int aInterval, int aBatch);
+    /**
+      * Operations of type @aType are rebuilt by @aFactory. Register them before replay().
+      */
+    void registerType(const QByteArray& aType, OperationFactory aFactory);
+    /**
+      * The operations recovered by open(), rebuilt with @aObserver and @aSlot and ready to be
+      * added again (they keep their entry: they are not appended twice). Each one is returned
+      * once; entries whose type has no factory are discarded.
+      */
+    QList<AbstractOperation*> replay(QObject* aObserver = 0, const char* aSlot = 0);
+    /**
+      * Add @aOperation to the journal, returns its entry or -1 if it could not be written.
+      * Entries stay valid across compactions.
+      */
+    qint64 append(AbstractOperation* aOperation);
+    /**
+      * The operation of @aEntry is over.
+      */
+    void complete(qint64 aEntry);
+    /**
+      * Sync now whatever has been written so far.
+      */
+    void commit();
+    /**
+      * Entries neither completed nor discarded.
+      */
+    int pendingCount();
+private:
+    struct FileHeader {
+        quint32 m_magic;
+        quint32 m_version;
+        // incremented each time the journal starts over, older records are stale
+        quint32 m_generation;
+        quint32 m_reserved;
+    };
+    struct RecordHeader {
+        // RecordPending or RecordDone, anything else ends the journal
+        quint32 m_state;
+        // CRC-32 of the fields below and of the payload
+        quint32 m_checksum;
+        quint32 m_generation;
+        quint16 m_typeSize;
+        quint16 m_reserved;
+        quint32 m_dataSize;
+    };
+    enum RecordState
+    {
+        RecordPending = 0x50454E44,
+        RecordDone = 0x444F4E45
+    };
+    // with m_mutex locked
+    bool ensureCapacity(qint64 aSize);
+    void recover();
+    void rewind();
+    // copy the pending records to a new file which replaces the journal, by the commit thread
+    // (@aLocker holds m_mutex, released while writing the file)
+    void compact(QMutexLocker& aLocker);
+    // @aSource and its payload at @aTarget, as a record of @aGeneration; returns its size
+    static qint64 copyRecord(const RecordHeader* aSource, quint32 aGeneration, uchar* aTarget);
+    FileHeader* header();
+    RecordHeader* record(qint64 aOffset);
+    static quint32 checksum(const RecordHeader* aHeader, const uchar* aPayload);
+    // with m_mutex locked, it takes m_mapMutex
+    bool remap(qint64 aSize);
+    void syncMapping();
+    friend class JournalCommitThread;
+    void commitLoop();
+private:
+    // protects everything but the mapping while it is being synced
+    QMutex m_mutex;
+    // held while syncing or changing the mapping
+    QMutex m_mapMutex;
+    QWaitCondition m_commitWait;
+    QString m_fileName;
+    // replaced by a compaction
+    QFile* m_file;
+    uchar* m_map;
+    qint64 m_mapSize;
+    // where the next record goes
+    qint64 m_end;
+    int m_pending;
+    // bytes of the pending records
+    qint64 m_liveBytes;
+    // file offset of each pending entry, entries are numbered in append order
+    QMap<qint64, qint64> m_offsets;
+    qint64 m_nextEntry;
+    // recovered by open(), not yet replayed
+    QList<qint64> m_recovered;
+    QHash<QByteArray, OperationFactory> m_factories;
+    int m_dirty;
+    int m_commitInterval;
+    int m_commitBatch;
+    bool m_closing;
+    bool m_compactRequested;
+    // do not try again until the next open()
+    bool m_compactFailed;
+    JournalCommitThread* m_commitThread;
+};
+
+#endif // OPERATIONJOURNAL_H
@@ -0,0 +1,337 @@
+#include "operationsqueue.h"
+#include "abstractoperation.h"
+
+#include <QPair>
+#include <QtAlgorithms>
+
+namespace {
+    // removed entries tolerated before a queue is compacted
+    const int KCompactSlack = 64;
+}
+
+OperationsQueue::OperationsQueue() :
+        m_nextSequence(0),
+        m_fairShare(false)
+{
+}
+
+int OperationsQueue::head() {
+    skipRemoved(m_queue);
+    return m_queue.isEmpty() ? -1 : m_queue.head().m_id;
+}
+
+void OperationsQueue::enqueue(int aId, AbstractOperation* aOperation) {
+    Item item;
+    item.m_operation = aOperation;
+    item.m_sequence = m_nextSequence++;
+    item.m_tenant = m_fairShare ? aOperation->tenantKey() : 0;
+    item.m_rateLimitKey = aOperation->rateLimitKey();
+    item.m_batchKey = aOperation->batchKey();
+    item.m_groups = aOperation->groupTags();
+    m_items.insert(aId, item);
+    if(!item.m_batchKey.isEmpty()) {
+        m_batchCounts[item.m_batchKey]++;
+    }
+    foreach(const QByteArray& tag, item.m_groups) {
+        m_groups[tag].insert(aId);
+    }
+
+    Entry entry;
+    entry.m_id = aId;
+    entry.m_sequence = item.m_sequence;
+    m_queue.enqueue(entry);
+
+    if(m_fairShare) {
+        Tenant& tenant = m_tenants[item.m_tenant];
+        tenant.m_queue.enqueue(entry);
+        tenant.m_queued++;
+        Throughput& counters = throughput(item.m_tenant);
+        counters.m_enqueued++;
+        counters.m_lastActive = m_nextSequence;
+        if(!tenant.m_active) {
+            tenant.m_active = true;
+            m_activeTenants.enqueue(item.m_tenant);
+        }
+    }
+}
+
+AbstractOperation* OperationsQueue::remove(int aId) {
+    QHash<int, Item>::iterator found = m_items.find(aId);
+    if(found == m_items.end()) {
+        return 0;
+    }
+    Item item = take(found);
+    if(m_fairShare && m_tenants.value(item.m_tenant).m_queued == 0) {
+        m_activeTenants.removeOne(item.m_tenant);
+        retireTenant(item.m_tenant);
+    }
+    return item.m_operation;
+}
+
+AbstractOperation* OperationsQueue::dequeue(OperationFilter* aFilter) {
+    if(m_items.isEmpty()) {
+        return 0;
+    }
+    if(m_fairShare) {
+        return dequeueFairShare(aFilter);
+    }
+    return takeFirst(m_queue, aFilter);
+}
+
+QList<AbstractOperation*> OperationsQueue::dequeueBatch(const QByteArray& aKey, int aMax, OperationFilter* aFilter) {
+    QList<AbstractOperation*> result;
+    if(aKey.isEmpty()) {
+        return result;
+    }
+    // a copy: taking an operation may compact m_queue
+    const QQueue<Entry> queue = m_queue;
+    for(int i = 0; i < queue.count() && result.count() < aMax && batchCount(aKey) > 0; ++i) {
+        QHash<int, Item>::iterator found = m_items.find(queue.at(i).m_id);
+        if(found == m_items.end() || found->m_sequence != queue.at(i).m_sequence ||
+                found->m_batchKey != aKey) {
+            continue;
+        }
+        if(aFilter && !aFilter->accept(found->m_operation, found->m_rateLimitKey, found->m_batchKey)) {
+            continue;
+        }
+        Item item = take(found);
+        result.append(item.m_operation);
+        if(m_fairShare) {
+            // it uses up a turn of its tenant, the next ones of the tenant come later
+            Tenant& tenant = m_tenants[item.m_tenant];
+            throughput(item.m_tenant).m_dequeued++;
+            tenant.m_deficit--;
+            if(tenant.m_queued == 0) {
+                m_activeTenants.removeOne(item.m_tenant);
+                retireTenant(item.m_tenant);
+            }
+        }
+    }
+    skipRemoved(m_queue);
+    return result;
+}
+
+QList<AbstractOperation*> OperationsQueue::takeAll() {
+    QList<AbstractOperation*> result;
+    for(int i = 0; i < m_queue.count(); ++i) {
+        if(isLive(m_queue.at(i))) {
+            result.append(m_items.value(m_queue.at(i).m_id).m_operation);
+        }
+    }
+    m_queue.clear();
+    m_items.clear();
+    m_batchCounts.clear();
+    m_groups.clear();
+    // nothing is queued, it only resets the tenants
+    rebuildTenants();
+    return result;
+}
+
+void OperationsQueue::setFairShare(bool aFairShare) {
+    if(m_fairShare != aFairShare) {
+        m_fairShare = aFairShare;
+        m_throughput.clear();
+        rebuildTenants();
+    }
+}
+
+bool OperationsQueue::isFairShare() const {
+    return m_fairShare;
+}
+
+void OperationsQueue::setTenantWeight(quintptr aTenant, int aWeight) {
+    Tenant& tenant = m_tenants[aTenant];
+    tenant.m_weight = qMax(1, aWeight);
+    if(!tenant.m_active) {
+        retireTenant(aTenant);
+    }
+}
+
+QHash<quintptr, TenantStats> OperationsQueue::tenantStats() const {
+    QHash<quintptr, TenantStats> result;
+    QHash<quintptr, Throughput>::const_iterator counters = m_throughput.constBegin();
+    for(; counters != m_throughput.constEnd(); ++counters) {
+        TenantStats& stats = result[counters.key()];
+        stats.m_enqueued = counters->m_enqueued;
+        stats.m_dequeued = counters->m_dequeued;
+    }
+    QHash<quintptr, Tenant>::const_iterator tenant = m_tenants.constBegin();
+    for(; tenant != m_tenants.constEnd(); ++tenant) {
+        result[tenant.key()].m_queued = tenant->m_queued;
+    }
+    return result;
+}
+
+void OperationsQueue::skipRemoved(QQueue<Entry>& aQueue) {
+    while(!aQueue.isEmpty() && !isLive(aQueue.head())) {
+        aQueue.dequeue();
+    }
+}
+
+AbstractOperation* OperationsQueue::takeFirst(QQueue<Entry>& aQueue, OperationFilter* aFilter) {
+    skipRemoved(aQueue);
+    for(int i = 0; i < aQueue.count(); ++i) {
+        const Entry entry = aQueue.at(i);
+        if(!isLive(entry)) {
+            continue;
+        }
+        const Item& item = m_items[entry.m_id];
+        AbstractOperation* operation = item.m_operation;
+        if(aFilter && !aFilter->accept(operation, item.m_rateLimitKey, item.m_batchKey)) {
+            continue;
+        }
+        // leaves a removed entry behind, no need to shift the queue;
+        // the tenant, if any, is the caller's business
+        take(m_items.find(entry.m_id));
+        skipRemoved(aQueue);
+        return operation;
+    }
+    return 0;
+}
+
+AbstractOperation* OperationsQueue::dequeueFairShare(OperationFilter* aFilter) {
+    // the active tenants all have queued operations, remove() retires the others
+    int tenantsToVisit = m_activeTenants.count();
+    while(tenantsToVisit > 0) {
+        quintptr key = m_activeTenants.head();
+        Tenant& tenant = m_tenants[key];
+        if(tenant.m_deficit <= 0) {
+            // its turn begins
+            tenant.m_deficit += tenant.m_weight;
+        }
+        if(AbstractOperation* operation = takeFirst(tenant.m_queue, aFilter)) {
+            throughput(key).m_dequeued++;
+            tenant.m_deficit--;
+            if(tenant.m_queued == 0) {
+                m_activeTenants.dequeue();
+                retireTenant(key);
+            } else if(tenant.m_deficit <= 0) {
+                m_activeTenants.enqueue(m_activeTenants.dequeue());
+            }
+            return operation;
+        }
+        // nothing it can run now: its turn is over
+        tenant.m_deficit = 0;
+        m_activeTenants.enqueue(m_activeTenants.dequeue());
+        --tenantsToVisit;
+    }
+    return 0;
+}
+
+OperationsQueue::Item OperationsQueue::take(QHash<int, Item>::iterator aItem) {
+    int id = aItem.key();
+    Item item = aItem.value();
+    m_items.erase(aItem);
+    if(!item.m_batchKey.isEmpty()) {
+        QHash<QByteArray, int>::iterator batch = m_batchCounts.find(item.m_batchKey);
+        if(--batch.value() == 0) {
+            m_batchCounts.erase(batch);
+        }
+    }
+    foreach(const QByteArray& tag, item.m_groups) {
+        QHash<QByteArray, QSet<int> >::iterator group = m_groups.find(tag);
+        group->remove(id);
+        if(group->isEmpty()) {
+            m_groups.erase(group);
+        }
+    }
+    if(m_queue.count() > 2 * m_items.count() + KCompactSlack) {
+        compact(m_queue);
+    }
+    if(m_fairShare) {
+        Tenant& tenant = m_tenants[item.m_tenant];
+        tenant.m_queued--;
+        if(tenant.m_queue.count() > 2 * tenant.m_queued + KCompactSlack) {
+            compact(tenant.m_queue);
+        }
+    }
+    return item;
+}
+
+void OperationsQueue::retireTenant(quintptr aTenant) {
+    QHash<quintptr, Tenant>::iterator tenant = m_tenants.find(aTenant);
+    if(tenant == m_tenants.end()) {
+        return;
+    }
+    if(tenant->m_weight == 1) {
+        // no turns worth keeping (its throughput stays in m_throughput)
+        m_tenants.erase(tenant);
+        return;
+    }
+    tenant->m_queue.clear();
+    tenant->m_deficit = 0;
+    tenant->m_active = false;
+}
+
+void OperationsQueue::compact(QQueue<Entry>& aQueue) {
+    QQueue<Entry> live;
+    for(int i = 0; i < aQueue.count(); ++i) {
+        if(isLive(aQueue.at(i))) {
+            live.enqueue(aQueue.at(i));
+        }
+    }
+    aQueue = live;
+}
+
+void OperationsQueue::rebuildTenants() {
+    m_activeTenants.clear();
+    QHash<quintptr, Tenant>::iterator tenant = m_tenants.begin();
+    while(tenant != m_tenants.end()) {
+        if(tenant->m_weight == 1) {
+            tenant = m_tenants.erase(tenant);
+            continue;
+        }
+        tenant->m_queue.clear();
+        tenant->m_deficit = 0;
+        tenant->m_active = false;
+        tenant->m_queued = 0;
+        ++tenant;
+    }
+    if(!m_fairShare) {
+        return;
+    }
+    skipRemoved(m_queue);
+    for(int i = 0; i < m_queue.count(); ++i) {
+        const Entry& entry = m_queue.at(i);
+        if(!isLive(entry)) {
+            continue;
+        }
+        Item& item = m_items[entry.m_id];
+        item.m_tenant = item.m_operation->tenantKey();
+        Tenant& owner = m_tenants[item.m_tenant];
+        owner.m_queue.enqueue(entry);
+        owner.m_queued++;
+        if(!owner.m_active) {
+            owner.m_active = true;
+            m_activeTenants.enqueue(item.m_tenant);
+        }
+    }
+}
+
+OperationsQueue::Throughput& OperationsQueue::throughput(quintptr aTenant) {
+    QHash<quintptr, Throughput>::iterator found = m_throughput.find(aTenant);
+    if(found != m_throughput.end()) {
+        return found.value();
+    }
+    if(m_throughput.count() >= KMaxTenantHistory) {
+        forgetIdleTenants();
+    }
+    return m_throughput[aTenant];
+}
+
+void OperationsQueue::forgetIdleTenants() {
+    // a quarter at a time, not on each new tenant; its key (e.g. an observer address)
+    // may also have been reused by another one meanwhile
+    QList< QPair<quint64, quintptr> > idle;
+    QHash<quintptr, Throughput>::const_iterator counters = m_throughput.constBegin();
+    for(; counters != m_throughput.constEnd(); ++counters) {
+        if(m_tenants.value(counters.key()).m_queued == 0) {
+            idle.append(qMakePair(counters->m_lastActive, counters.key()));
+        }
+    }
+    qSort(idle);
+    int excess = m_throughput.count() - KMaxTenantHistory * 3 / 4;
+    for(int i = 0; i < idle.count() && i < excess; ++i) {
+        m_throughput.remove(idle.at(i).second);
+    }
+}
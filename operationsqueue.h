@@ -0,0 +1,174 @@
+#ifndef OPERATIONSQUEUE_H
+#define OPERATIONSQUEUE_H
+
+#include <QQueue>
+#include <QHash>
+#include <QByteArray>
+#include <QList>
+#include <QSet>
+
+class AbstractOperation;
+
+// tenants whose throughput is remembered, beyond that the least recently active
+// ones with nothing queued are forgotten
+const int KMaxTenantHistory = 1024;
+
+/**
+  * Tells whether an operation can be dequeued now (e.g. its rate limit allows it).
+  * @aRateLimitKey and @aBatchKey are the AbstractOperation::rateLimitKey() and batchKey()
+  * the operation had when it was queued.
+  */
+class OperationFilter
+{
+public:
+    virtual ~OperationFilter() {}
+    virtual bool accept(AbstractOperation* aOperation, const QByteArray& aRateLimitKey,
+                        const QByteArray& aBatchKey) = 0;
+};
+
+/**
+  * Depth and throughput of a tenant (see AbstractOperation::tenantKey()).
+  */
+struct TenantStats {
+    TenantStats() : m_queued(0), m_enqueued(0), m_dequeued(0) {}
+    // operations waiting now
+    int m_queued;
+    // operations added and taken out for execution since fair share was enabled
+    // (see KMaxTenantHistory)
+    quint64 m_enqueued;
+    quint64 m_dequeued;
+};
+
+/**
+  * The queue of a priority level.
+  * Operations are kept in FIFO order; in fair share mode they are also split in a
+  * sub-queue per tenant and dequeued by deficit weighted round robin among tenants.
+  * Removal is O(1): removed entries are left behind and skipped lazily.
+  * Not thread safe, the QueueHandler uses it under its queue mutex.
+  */
+class OperationsQueue
+{
+public:
+    OperationsQueue();
+public:
+    inline bool contains(int aId) const {
+        return m_items.contains(aId);
+    }
+    inline int count() const {
+        return m_items.count();
+    }
+    inline AbstractOperation* operation(int aId) const {
+        return m_items.value(aId).m_operation;
+    }
+    /**
+      * Number of queued operations with batch key @aKey (see AbstractOperation::batchKey()).
+      */
+    inline int batchCount(const QByteArray& aKey) const {
+        return m_batchCounts.value(aKey);
+    }
+    /**
+      * Ids of the queued operations tagged with @aTag (see AbstractOperation::addGroupTag()).
+      */
+    inline QList<int> group(const QByteArray& aTag) const {
+        return m_groups.value(aTag).toList();
+    }
+    /**
+      * Id of the oldest operation in the queue (whatever the mode).
+      */
+    int head();
+    void enqueue(int aId, AbstractOperation* aOperation);
+    /**
+      * Remove the operation @aId, returns it or 0 if it was not queued.
+      */
+    AbstractOperation* remove(int aId);
+    /**
+      * Take the next operation accepted by @aFilter (all of them if 0):
+      * the oldest one, or in fair share mode the one of the tenant whose turn it is.
+      */
+    AbstractOperation* dequeue(OperationFilter* aFilter = 0);
+    /**
+      * Take up to @aMax operations with batch key @aKey accepted by @aFilter (all of them if 0),
+      * oldest first, in a single pass. In fair share mode they are charged to their tenants
+      * as if they had been dequeued in their turn.
+      */
+    QList<AbstractOperation*> dequeueBatch(const QByteArray& aKey, int aMax, OperationFilter* aFilter = 0);
+    /**
+      * Empty the queue, returns what it contained in arrival order.
+      */
+    QList<AbstractOperation*> takeAll();
+public:
+    void setFairShare(bool aFairShare);
+    bool isFairShare() const;
+    /**
+      * A tenant with weight N gets N operations for each one of a tenant with weight 1.
+      * The turns of tenants with the default weight (1) are forgotten as soon as they have
+      * nothing queued, their throughput is kept.
+      */
+    void setTenantWeight(quintptr aTenant, int aWeight);
+    QHash<quintptr, TenantStats> tenantStats() const;
+private:
+    struct Entry {
+        int m_id;
+        quint64 m_sequence;
+    };
+    struct Item {
+        Item() : m_operation(0), m_sequence(0), m_tenant(0) {}
+        AbstractOperation* m_operation;
+        quint64 m_sequence;
+        quintptr m_tenant;
+        QByteArray m_rateLimitKey;
+        QByteArray m_batchKey;
+        QList<QByteArray> m_groups;
+    };
+    // scheduling state, transient for tenants with the default weight
+    struct Tenant {
+        Tenant() : m_weight(1), m_deficit(0), m_active(false), m_queued(0) {}
+        QQueue<Entry> m_queue;
+        int m_weight;
+        int m_deficit;
+        bool m_active;
+        int m_queued;
+    };
+    struct Throughput {
+        Throughput() : m_enqueued(0), m_dequeued(0), m_lastActive(0) {}
+        quint64 m_enqueued;
+        quint64 m_dequeued;
+        // m_nextSequence when it last had an operation queued
+        quint64 m_lastActive;
+    };
+    inline bool isLive(const Entry& aEntry) const {
+        QHash<int, Item>::const_iterator item = m_items.constFind(aEntry.m_id);
+        return item != m_items.constEnd() && item->m_sequence == aEntry.m_sequence;
+    }
+    // remove the operation @aId from the bookkeeping, its entries are left in the queues
+    Item take(QHash<int, Item>::iterator aItem);
+    // drop the removed entries from the front of @aQueue
+    void skipRemoved(QQueue<Entry>& aQueue);
+    // take the first live entry of @aQueue accepted by @aFilter
+    AbstractOperation* takeFirst(QQueue<Entry>& aQueue, OperationFilter* aFilter);
+    AbstractOperation* dequeueFairShare(OperationFilter* aFilter);
+    // @aTenant has nothing queued any more (and is not in m_activeTenants)
+    void retireTenant(quintptr aTenant);
+    void compact(QQueue<Entry>& aQueue);
+    void rebuildTenants();
+    // the throughput of @aTenant, made room for if it is new
+    Throughput& throughput(quintptr aTenant);
+    void forgetIdleTenants();
+private:
+    // every operation in arrival order (with the removed ones not skipped yet)
+    QQueue<Entry> m_queue;
+    QHash<int, Item> m_items;
+    quint64 m_nextSequence;
+    // queued operations by batch key, the empty key is not counted
+    QHash<QByteArray, int> m_batchCounts;
+    // queued operations by group tag
+    QHash<QByteArray, QSet<int> > m_groups;
+
+    bool m_fairShare;
+    QHash<quintptr, Tenant> m_tenants;
+    // tenants with queued operations, in round robin order
+    QQueue<quintptr> m_activeTenants;
+    QHash<quintptr, Throughput> m_throughput;
+};
+
+#endif // OPERATIONSQUEUE_H
@@ -0,0 +1,146 @@
+#include "operationtracer.h"
+
+#include <QCoreApplication>
+#include <QIODevice>
+
+#include "activelogs.h"
+#ifdef OPERATION_TRACER
+    #define ENABLE_LOG_MACROS
+#endif
+#include "workerlog.h"
+WORKER_LOG_CATEGORY("OperationTracer");
+
+namespace {
+    const char* eventName(int aType) {
+        switch(aType) {
+        case OperationTracer::EventEnqueued:
+        case OperationTracer::EventDequeued:
+            return "queued";
+        case OperationTracer::EventStarted:
+        case OperationTracer::EventFinished:
+        case OperationTracer::EventPaused:
+            return "execute";
+        case OperationTracer::EventTimedOut:
+            return "timeout";
+        case OperationTracer::EventCancelled:
+            return "cancel";
+        case OperationTracer::EventDelivered:
+            return "delivered";
+        default:
+            return "unknown";
+        }
+    }
+
+    const char* eventPhase(int aType) {
+        switch(aType) {
+        case OperationTracer::EventEnqueued:
+            return "b";
+        case OperationTracer::EventDequeued:
+            return "e";
+        case OperationTracer::EventStarted:
+            return "B";
+        case OperationTracer::EventFinished:
+        case OperationTracer::EventPaused:
+            return "E";
+        default:
+            return "i";
+        }
+    }
+}
+
+OperationTracer::OperationTracer(int aCapacity) :
+        m_slots(0),
+        m_mask(0),
+        m_writeIndex(0),
+        m_full(0)
+{
+    int capacity = 1;
+    while(capacity < aCapacity) {
+        capacity <<= 1;
+    }
+    m_slots = new Slot[capacity];
+    m_mask = capacity - 1;
+    m_clock.start();
+}
+
+OperationTracer::~OperationTracer() {
+    delete[] m_slots;
+}
+
+void OperationTracer::record(EventType aType, int aWorkerId, int aOperationId) {
+    uint index = m_writeIndex.fetchAndAddRelaxed(1);
+    if(index + 1 == 0) {
+        // its sequence would read as "being written": skip it
+        index = m_writeIndex.fetchAndAddRelaxed(1);
+    }
+    if(index == (uint)m_mask) {
+        m_full.fetchAndStoreRelease(1);
+    }
+    Slot& slot = m_slots[index & m_mask];
+    // ordered: the readers must see the slot as being written before any of the new data
+    slot.m_sequence.fetchAndStoreOrdered(0);
+    slot.m_event.m_timestamp = m_clock.nsecsElapsed() / 1000;
+    slot.m_event.m_type = aType;
+    slot.m_event.m_workerId = aWorkerId;
+    slot.m_event.m_operationId = aOperationId;
+    slot.m_sequence.fetchAndStoreRelease(index + 1);
+}
+
+QVector<OperationTracer::Event> OperationTracer::events() const {
+    QVector<Event> result;
+    uint end = const_cast<QAtomicInt&>(m_writeIndex).fetchAndAddAcquire(0);
+    uint capacity = m_mask + 1;
+    // unsigned arithmetic: correct across the wrap around of the index
+    uint count = const_cast<QAtomicInt&>(m_full).fetchAndAddAcquire(0) ? capacity : qMin(end, capacity);
+    result.reserve(count);
+    for(uint index = end - count; index != end; ++index) {
+        Slot& slot = m_slots[index & m_mask];
+        if((uint)slot.m_sequence.fetchAndAddAcquire(0) != index + 1) {
+            // still being written or already overwritten
+            continue;
+        }
+        Event event = slot.m_event;
+        // ordered: the copy above must be complete before the sequence is checked again
+        if((uint)slot.m_sequence.fetchAndAddOrdered(0) == index + 1) {
+            result.append(event);
+        }
+    }
+    return result;
+}
+
+QByteArray OperationTracer::toChromeTraceJson() const {
+    QVector<Event> snapshot = events();
+    QByteArray pid = QByteArray::number(QCoreApplication::applicationPid());
+    QByteArray json("{\"traceEvents\":[");
+    for(int i = 0; i < snapshot.count(); ++i) {
+        const Event& event = snapshot.at(i);
+        QByteArray id = "\"0x" + QByteArray::number((uint)event.m_operationId, 16) + "\"";
+        if(i > 0) {
+            json.append(",");
+        }
+        json.append("\n{\"name\":\"").append(eventName(event.m_type));
+        json.append("\",\"cat\":\"").append(event.m_type <= EventDequeued ? "queue" : "operation");
+        json.append("\",\"ph\":\"").append(eventPhase(event.m_type));
+        json.append("\",\"ts\":").append(QByteArray::number(event.m_timestamp));
+        json.append(",\"pid\":").append(pid);
+        json.append(",\"tid\":").append(QByteArray::number(event.m_workerId));
+        if(event.m_type <= EventDequeued) {
+            // async events are matched by id
+            json.append(",\"id\":").append(id);
+        } else if(*eventPhase(event.m_type) == 'i') {
+            json.append(",\"s\":\"t\"");
+        }
+        json.append(",\"args\":{\"operation\":").append(id).append("}}");
+    }
+    json.append("\n],\"displayTimeUnit\":\"ms\"}\n");
+    return json;
+}
+
+bool OperationTracer::dumpChromeTrace(QIODevice* aDevice) const {
+    if(!aDevice || !aDevice->isWritable()) {
+        WARNING("cannot dump the trace, device not writable");
+        return false;
+    }
+    QByteArray json = toChromeTraceJson();
+    return aDevice->write(json) == json.size();
+}
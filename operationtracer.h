@@ -0,0 +1,80 @@
+#ifndef OPERATIONTRACER_H
+#define OPERATIONTRACER_H
+
+#include <QAtomicInt>
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QVector>
+
+class QIODevice;
+
+const int KDefaultTraceCapacity = 64 * 1024;
+
+/**
+  * Records the life cycle of the operations handled by one or more QueueHandlers.
+  * Events are written in a lock-free ring buffer (the oldest ones get overwritten)
+  * and can be exported as Chrome trace JSON to be loaded in chrome://tracing or Perfetto.
+  */
+class OperationTracer
+{
+public:
+    enum EventType
+    {
+        EventEnqueued = 0,
+        EventDequeued,
+        EventStarted,
+        EventFinished,
+        EventTimedOut,
+        EventCancelled,
+        EventDelivered,
+        // an idle priority operation preempted: its execution ends, it starts again when resumed
+        EventPaused
+    };
+    struct Event {
+        // microseconds since the tracer has been created
+        qint64 m_timestamp;
+        int m_type;
+        int m_workerId;
+        int m_operationId;
+    };
+public:
+    /**
+      * @aCapacity is rounded up to the next power of two.
+      */
+    explicit OperationTracer(int aCapacity = KDefaultTraceCapacity);
+    ~OperationTracer();
+public:
+    /**
+      * Record an event, can be called from any thread.
+      */
+    void record(EventType aType, int aWorkerId, int aOperationId);
+    /**
+      * Snapshot of the events currently in the ring, oldest first.
+      * Events being written while taking the snapshot are skipped.
+      */
+    QVector<Event> events() const;
+    /**
+      * The events in the Chrome trace event format.
+      */
+    QByteArray toChromeTraceJson() const;
+    /**
+      * Write the Chrome trace JSON to @aDevice (which must be already open).
+      */
+    bool dumpChromeTrace(QIODevice* aDevice) const;
+private:
+    Q_DISABLE_COPY(OperationTracer)
+    struct Slot {
+        // index + 1 of the event stored in the slot, 0 while the slot is being written
+        QAtomicInt m_sequence;
+        Event m_event;
+    };
+    Slot* m_slots;
+    int m_mask;
+    // index of the next event, read as unsigned: it wraps around after 2^32 events
+    QAtomicInt m_writeIndex;
+    // set once every slot has been written at least once
+    QAtomicInt m_full;
+    QElapsedTimer m_clock;
+};
+
+#endif // OPERATIONTRACER_H
@@ -0,0 +1,214 @@
+#include "paralleloperation.h"
+
+#include <QElapsedTimer>
+#include <QMutexLocker>
+
+#include "activelogs.h"
+#ifdef PARALLEL_OPERATION
+    #define ENABLE_LOG_MACROS
+#endif
+#include "workerlog.h"
+WORKER_LOG_CATEGORY("ParallelOperation");
+
+/**
+  * Runs chunks of a ParallelOperation in another worker of the pool.
+  * It has no observer: it deletes itself when done.
+  */
+class ParallelHelperOperation : public AbstractOperation
+{
+public:
+    ParallelHelperOperation(const QSharedPointer<ParallelState>& aState, ParallelOperation* aLeader,
+                            int aParticipant, int aTimeout) :
+            m_state(aState),
+            m_leader(aLeader),
+            m_participant(aParticipant),
+            m_timeout(aTimeout)
+    {
+    }
+public: // from AbstractOperation
+    void execute() {
+        started(m_timeout);
+        QElapsedTimer elapsed;
+        elapsed.start();
+        int chunks = 0;
+        // a helper which can not go on just leaves the rest to the others, the leader never gives up
+        while(canContinue() && elapsed.elapsed() < m_timeout) {
+            m_state->enter();
+            int begin = 0;
+            int end = 0;
+            if(!m_state->claim(begin, end)) {
+                m_state->leave();
+                break;
+            }
+            // the leader waits for us before going away
+            m_leader->runChunk(begin, end, m_participant);
+            m_state->leave();
+            ++chunks;
+        }
+        VERBOSE_TAG("ParallelOperation", "helper" << m_participant << "ran" << chunks << "chunks");
+        success();
+        finished();
+    }
+private:
+    QSharedPointer<ParallelState> m_state;
+    // only valid while a chunk is claimed
+    ParallelOperation* m_leader;
+    int m_participant;
+    int m_timeout;
+};
+
+ParallelState::ParallelState(int aBegin, int aEnd, int aGrain) :
+        m_end(aEnd),
+        m_grain(qMax(1, aGrain)),
+        m_participants(1),
+        m_next(aBegin),
+        m_inFlight(0),
+        m_stopped(0)
+{
+}
+
+bool ParallelState::claim(int& aBegin, int& aEnd) {
+    forever {
+        if(isStopped()) {
+            return false;
+        }
+        int next = m_next.fetchAndAddAcquire(0);
+        int remaining = m_end - next;
+        if(remaining <= 0) {
+            return false;
+        }
+        int size = qMin(remaining, qMax(m_grain, remaining / (2 * m_participants)));
+        if(m_next.testAndSetOrdered(next, next + size)) {
+            aBegin = next;
+            aEnd = next + size;
+            return true;
+        }
+    }
+}
+
+void ParallelState::setParticipants(int aParticipants) {
+    m_participants = qMax(1, aParticipants);
+}
+
+void ParallelState::enter() {
+    m_inFlight.ref();
+}
+
+void ParallelState::leave() {
+    if(!m_inFlight.deref()) {
+        QMutexLocker locker(&m_mutex);
+        m_idle.wakeAll();
+    }
+}
+
+void ParallelState::waitIdle() {
+    QMutexLocker locker(&m_mutex);
+    while(m_inFlight.fetchAndAddAcquire(0) != 0) {
+        m_idle.wait(&m_mutex);
+    }
+}
+
+void ParallelState::stop() {
+    m_stopped.fetchAndStoreOrdered(1);
+}
+
+bool ParallelState::isStopped() {
+    return m_stopped.fetchAndAddAcquire(0) != 0;
+}
+
+ParallelOperation::ParallelOperation(WorkerPool* aPool, int aBegin, int aEnd, int aGrain,
+                                     QObject* aObserver, const char* aSlot) :
+        AbstractOperation(aObserver, aSlot),
+        m_pool(aPool),
+        m_begin(aBegin),
+        m_end(aEnd),
+        m_grain(aGrain),
+        m_timeout(KDefaultTimeoutOperation),
+        m_maxHelpers(-1)
+{
+}
+
+ParallelOperation::~ParallelOperation() {
+}
+
+void ParallelOperation::setTimeout(int aTimeout) {
+    m_timeout = aTimeout;
+}
+
+void ParallelOperation::setMaxHelpers(int aMaxHelpers) {
+    m_maxHelpers = aMaxHelpers;
+}
+
+void ParallelOperation::prepare(int /*aParticipants*/) {
+}
+
+void ParallelOperation::complete() {
+}
+
+void ParallelOperation::execute() {
+    DEBUG_ENTER_FN();
+    started(m_timeout);
+    QElapsedTimer elapsed;
+    elapsed.start();
+    // a fresh range for each execution (a retry, or the operation added again); the helpers
+    // of a previous one keep the old state, stopped or used up
+    m_state = QSharedPointer<ParallelState>(new ParallelState(m_begin, m_end, m_grain));
+
+    int helpers = m_pool ? m_pool->workerCount() - 1 : 0;
+    if(m_maxHelpers >= 0) {
+        helpers = qMin(helpers, m_maxHelpers);
+    }
+    helpers = qMax(0, helpers);
+    m_state->setParticipants(helpers + 1);
+    prepare(helpers + 1);
+    if(helpers > 0) {
+        QList<AbstractOperation*> helperOperations;
+        for(int helper = 1; helper <= helpers; ++helper) {
+            helperOperations.append(new ParallelHelperOperation(m_state, this, helper, m_timeout));
+        }
+        // one per other worker, high priority: they are useless once the leader has done everything
+        QList<AbstractOperation*> unused = m_pool->spreadHighPriorityOperations(helperOperations);
+        if(!unused.isEmpty()) {
+            // the pool shrank in the meanwhile: the others do the work
+            VERBOSE("no worker for" << unused.count() << "helpers");
+            qDeleteAll(unused);
+        }
+    }
+
+    bool cancelled = false;
+    bool timedOut = false;
+    forever {
+        if(!canContinue()) {
+            cancelled = true;
+            break;
+        }
+        if(elapsed.elapsed() >= m_timeout) {
+            timedOut = true;
+            break;
+        }
+        int begin = 0;
+        int end = 0;
+        if(!m_state->claim(begin, end)) {
+            break;
+        }
+        runChunk(begin, end, 0);
+    }
+    if(cancelled || timedOut) {
+        m_state->stop();
+    }
+    // only the helpers in the middle of a chunk, the others will find nothing left
+    m_state->waitIdle();
+
+    if(timedOut) {
+        // the queue handler timer is already due: it will time the operation out
+        WARNING("parallel operation" << id() << "timed out");
+    } else if(cancelled) {
+        setStatus(OperationCancelled);
+        finished();
+    } else {
+        complete();
+        success();
+        finished();
+    }
+    DEBUG_EXIT_FN();
+}
@@ -0,0 +1,223 @@
+#ifndef PARALLELOPERATION_H
+#define PARALLELOPERATION_H
+
+#include <QAtomicInt>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QSharedPointer>
+#include <QVector>
+
+#include "abstractoperation.h"
+#include "workerpool.h"
+
+class ParallelHelperOperation;
+
+/**
+  * The index range of a parallel operation, shared by the leader and its helpers.
+  * Chunks are claimed with a single atomic: each one is a fraction of what is left
+  * (guided scheduling, never smaller than the grain), so the first chunks are big
+  * and the last ones small enough to balance the load.
+  */
+class ParallelState
+{
+public:
+    ParallelState(int aBegin, int aEnd, int aGrain);
+public:
+    /**
+      * Claim the next chunk [@aBegin, @aEnd), returns false if none is left or the operation stopped.
+      */
+    bool claim(int& aBegin, int& aEnd);
+    void setParticipants(int aParticipants);
+    /**
+      * Around each claim() and the chunk which follows it.
+      */
+    void enter();
+    void leave();
+    /**
+      * Wait until nobody is between enter() and leave().
+      */
+    void waitIdle();
+    void stop();
+    bool isStopped();
+private:
+    int m_end;
+    int m_grain;
+    int m_participants;
+    QAtomicInt m_next;
+    QAtomicInt m_inFlight;
+    QAtomicInt m_stopped;
+    QMutex m_mutex;
+    QWaitCondition m_idle;
+};
+
+/**
+  * Base of the data parallel operations: add it to a WorkerPool and, while it runs, it
+  * posts a helper operation to the other workers of the pool; they all take chunks of
+  * the range until it is over. The observer gets a single callback when the whole range
+  * has been processed (or the operation was cancelled or timed out).
+  * The chunks run synchronously, canContinue() and the timeout are checked between them.
+  */
+class ParallelOperation : public AbstractOperation
+{
+public:
+    ParallelOperation(WorkerPool* aPool, int aBegin, int aEnd, int aGrain,
+                      QObject* aObserver = 0, const char* aSlot = 0);
+    ~ParallelOperation();
+public:
+    /**
+      * Timeout of the whole operation, KDefaultTimeoutOperation by default.
+      */
+    void setTimeout(int aTimeout);
+    /**
+      * Use at most @aMaxHelpers helpers (by default one per other worker of the pool).
+      */
+    void setMaxHelpers(int aMaxHelpers);
+public: // from AbstractOperation
+    void execute();
+protected:
+    /**
+      * Process [@aBegin, @aEnd). @aParticipant is 0 for the leader and 1...participants-1 for the helpers,
+      * chunks of the same participant never run concurrently.
+      */
+    virtual void runChunk(int aBegin, int aEnd, int aParticipant) = 0;
+    /**
+      * Called before any chunk runs.
+      */
+    virtual void prepare(int aParticipants);
+    /**
+      * Called when every chunk has run, before the observer gets the operation.
+      */
+    virtual void complete();
+private:
+    friend class ParallelHelperOperation;
+    WorkerPool* m_pool;
+    int m_begin;
+    int m_end;
+    int m_grain;
+    // of the current execution, its helpers keep it alive
+    QSharedPointer<ParallelState> m_state;
+    int m_timeout;
+    int m_maxHelpers;
+};
+
+/**
+  * Runs @Function(index) for each index of the range.
+  */
+template <typename Function>
+class ParallelForOperation : public ParallelOperation
+{
+public:
+    ParallelForOperation(WorkerPool* aPool, int aBegin, int aEnd, int aGrain, Function aFunction,
+                         QObject* aObserver = 0, const char* aSlot = 0) :
+            ParallelOperation(aPool, aBegin, aEnd, aGrain, aObserver, aSlot),
+            m_function(aFunction)
+    {
+    }
+protected:
+    void runChunk(int aBegin, int aEnd, int /*aParticipant*/) {
+        for(int index = aBegin; index < aEnd; ++index) {
+            m_function(index);
+        }
+    }
+private:
+    Function m_function;
+};
+
+/**
+  * What the observer of a parallelReduce() casts the operation to.
+  */
+template <typename T>
+class ParallelReduceResult : public ParallelOperation
+{
+public:
+    ParallelReduceResult(WorkerPool* aPool, int aBegin, int aEnd, int aGrain,
+                         QObject* aObserver, const char* aSlot) :
+            ParallelOperation(aPool, aBegin, aEnd, aGrain, aObserver, aSlot)
+    {
+    }
+    /**
+      * Valid when the operation ended with OperationSuccess.
+      */
+    T result() const {
+        return m_result;
+    }
+protected:
+    T m_result;
+};
+
+/**
+  * Combines @MapFunction(index) of each index of the range with @CombineFunction(T, T),
+  * which must be associative: each participant reduces its own chunks and the partial
+  * results are combined at the end, in participant order.
+  */
+template <typename T, typename MapFunction, typename CombineFunction>
+class ParallelReduceOperation : public ParallelReduceResult<T>
+{
+public:
+    ParallelReduceOperation(WorkerPool* aPool, int aBegin, int aEnd, int aGrain, const T& aIdentity,
+                            MapFunction aMap, CombineFunction aCombine,
+                            QObject* aObserver = 0, const char* aSlot = 0) :
+            ParallelReduceResult<T>(aPool, aBegin, aEnd, aGrain, aObserver, aSlot),
+            m_identity(aIdentity),
+            m_map(aMap),
+            m_combine(aCombine),
+            m_partialData(0)
+    {
+        this->m_result = aIdentity;
+    }
+protected:
+    void prepare(int aParticipants) {
+        m_partials = QVector<T>(aParticipants, m_identity);
+        // each participant writes its own slot, never going through the (detaching) QVector API
+        m_partialData = m_partials.data();
+    }
+    void runChunk(int aBegin, int aEnd, int aParticipant) {
+        T partial = m_partialData[aParticipant];
+        for(int index = aBegin; index < aEnd; ++index) {
+            partial = m_combine(partial, m_map(index));
+        }
+        m_partialData[aParticipant] = partial;
+    }
+    void complete() {
+        T result = m_identity;
+        for(int participant = 0; participant < m_partials.count(); ++participant) {
+            result = m_combine(result, m_partials.at(participant));
+        }
+        this->m_result = result;
+    }
+private:
+    T m_identity;
+    MapFunction m_map;
+    CombineFunction m_combine;
+    QVector<T> m_partials;
+    T* m_partialData;
+};
+
+/**
+  * Call @aFunction(index) for every index in [@aBegin, @aEnd) using the workers of @aPool,
+  * in chunks of at least @aGrain indexes. Returns the operation, already added to @aPool.
+  */
+template <typename Function>
+ParallelForOperation<Function>* parallelFor(WorkerPool* aPool, int aBegin, int aEnd, int aGrain, Function aFunction,
+                                            QObject* aObserver = 0, const char* aSlot = 0) {
+    ParallelForOperation<Function>* operation =
+            new ParallelForOperation<Function>(aPool, aBegin, aEnd, aGrain, aFunction, aObserver, aSlot);
+    aPool->addOperation(operation);
+    return operation;
+}
+
+/**
+  * Reduce [@aBegin, @aEnd) with @aCombine(@aIdentity, @aMap(index)...) using the workers of @aPool.
+  * The observer gets a ParallelReduceResult<T> with the result.
+  */
+template <typename T, typename MapFunction, typename CombineFunction>
+ParallelReduceResult<T>* parallelReduce(WorkerPool* aPool, int aBegin, int aEnd, int aGrain, const T& aIdentity,
+                                        MapFunction aMap, CombineFunction aCombine,
+                                        QObject* aObserver = 0, const char* aSlot = 0) {
+    ParallelReduceResult<T>* operation = new ParallelReduceOperation<T, MapFunction, CombineFunction>(
+            aPool, aBegin, aEnd, aGrain, aIdentity, aMap, aCombine, aObserver, aSlot);
+    aPool->addOperation(operation);
+    return operation;
+}
+
+#endif // PARALLELOPERATION_H
@@ -0,0 +1,51 @@
+#include "processchannel.h"
+
+#include <QLocalSocket>
+#include <QtEndian>
+
+#include "activelogs.h"
+#ifdef PROCESS_CHANNEL
+    #define ENABLE_LOG_MACROS
+#endif
+#include "workerlog.h"
+WORKER_LOG_CATEGORY("ProcessChannel");
+
+namespace {
+    const int KLengthSize = sizeof(quint32);
+}
+
+ProcessChannel::ProcessChannel(QLocalSocket* aSocket, QObject* aParent) :
+        QObject(aParent),
+        m_socket(aSocket)
+{
+    m_socket->setParent(this);
+    connect(m_socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+    connect(m_socket, SIGNAL(disconnected()), this, SIGNAL(disconnected()));
+}
+
+ProcessChannel::~ProcessChannel() {
+    m_socket->disconnect(this);
+    m_socket->abort();
+}
+
+void ProcessChannel::send(const QByteArray& aMessage) {
+    uchar length[KLengthSize];
+    qToBigEndian<quint32>(aMessage.size(), length);
+    m_socket->write(reinterpret_cast<const char*>(length), KLengthSize);
+    m_socket->write(aMessage);
+    m_socket->flush();
+}
+
+void ProcessChannel::onReadyRead() {
+    m_buffer.append(m_socket->readAll());
+    while(m_buffer.size() >= KLengthSize) {
+        quint32 length = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(m_buffer.constData()));
+        if((quint32)m_buffer.size() - KLengthSize < length) {
+            break;
+        }
+        QByteArray message = m_buffer.mid(KLengthSize, length);
+        m_buffer.remove(0, KLengthSize + length);
+        VERBOSE("received a message of" << length << "bytes");
+        emit messageReceived(message);
+    }
+}
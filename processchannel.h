@@ -0,0 +1,51 @@
+#ifndef PROCESSCHANNEL_H
+#define PROCESSCHANNEL_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QDataStream>
+
+class QLocalSocket;
+
+// version of the QDataStreams exchanged over a ProcessChannel
+const int KProcessChannelStreamVersion = QDataStream::Qt_4_6;
+// environment variable giving a helper the token to present to its handler
+const char* const KProcessHelperTokenVariable = "WORKERTHREAD_HELPER_TOKEN";
+
+/**
+  * Length prefixed messages over a QLocalSocket (a Unix domain socket, a named pipe on
+  * Windows), between a ProcessQueueHandler and the ProcessHelper of its helper process.
+  */
+class ProcessChannel : public QObject
+{
+    Q_OBJECT
+public:
+    enum MessageType
+    {
+        // handler -> helper: run an operation
+        MessageExecute = 1,
+        // helper -> handler: how it went
+        MessageResult,
+        // helper -> handler, first: the token it has been started with
+        MessageHello
+    };
+public:
+    /**
+      * Takes the ownership of the connected @aSocket.
+      */
+    explicit ProcessChannel(QLocalSocket* aSocket, QObject* aParent = 0);
+    ~ProcessChannel();
+public:
+    void send(const QByteArray& aMessage);
+signals:
+    void messageReceived(const QByteArray& aMessage);
+    void disconnected();
+private slots:
+    void onReadyRead();
+private:
+    QLocalSocket* m_socket;
+    // what has been received of the next messages
+    QByteArray m_buffer;
+};
+
+#endif // PROCESSCHANNEL_H
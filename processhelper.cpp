@@ -0,0 +1,130 @@
+#include "processhelper.h"
+#include "processchannel.h"
+#include "abstractoperation.h"
+#include "workerthread.h"
+
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QLocalSocket>
+#include <QSharedMemory>
+#include <QVariant>
+
+#include "activelogs.h"
+#ifdef PROCESS_HELPER
+    #define ENABLE_LOG_MACROS
+#endif
+#include "workerlog.h"
+WORKER_LOG_CATEGORY("ProcessHelper");
+
+namespace {
+    const int KHelperConnectTimeout = 5000;
+}
+
+ProcessHelper::ProcessHelper(QObject* aParent) :
+        QObject(aParent),
+        m_channel(0),
+        m_worker(0)
+{
+}
+
+ProcessHelper::~ProcessHelper() {
+    if(m_worker) {
+        m_worker->terminateThread();
+        delete m_worker;
+    }
+    qDeleteAll(m_payloads);
+}
+
+void ProcessHelper::registerType(const QByteArray& aType, OperationFactory aFactory) {
+    m_factories.insert(aType, aFactory);
+}
+
+bool ProcessHelper::connectToHandler(const QString& aServerName) {
+    DEBUG_ENTER_FN();
+    QLocalSocket* socket = new QLocalSocket();
+    socket->connectToServer(aServerName);
+    if(!socket->waitForConnected(KHelperConnectTimeout)) {
+        CRITICAL("can not connect to" << aServerName << ":" << socket->errorString());
+        delete socket;
+        return false;
+    }
+    m_channel = new ProcessChannel(socket, this);
+    connect(m_channel, SIGNAL(messageReceived(QByteArray)), this, SLOT(onMessage(QByteArray)));
+    connect(m_channel, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
+    // the handler talks only to the process it has started
+    QByteArray message;
+    QDataStream stream(&message, QIODevice::WriteOnly);
+    stream.setVersion(KProcessChannelStreamVersion);
+    stream << (quint8)ProcessChannel::MessageHello << qgetenv(KProcessHelperTokenVariable);
+    m_channel->send(message);
+    m_worker = new WorkerThread();
+    m_worker->startThread();
+    DEBUG_EXIT_FN();
+    return true;
+}
+
+void ProcessHelper::onMessage(const QByteArray& aMessage) {
+    QDataStream stream(aMessage);
+    stream.setVersion(KProcessChannelStreamVersion);
+    quint8 type = 0;
+    quint32 requestId = 0;
+    QByteArray operationType;
+    QString key;
+    quint32 size = 0;
+    QByteArray data;
+    stream >> type >> requestId >> operationType >> key >> size >> data;
+    if(type != ProcessChannel::MessageExecute || stream.status() != QDataStream::Ok) {
+        CRITICAL("malformed message from the handler");
+        return;
+    }
+    QSharedMemory* payload = 0;
+    if(!key.isEmpty()) {
+        payload = new QSharedMemory(key, this);
+        if(!payload->attach(QSharedMemory::ReadOnly) || payload->size() < (int)size) {
+            CRITICAL("can not attach the data of request" << requestId << ":" << payload->errorString());
+            delete payload;
+            sendResult(requestId, AbstractOperation::OperationFailed, QVariant());
+            return;
+        }
+        // no copy: the handler does not touch it until the result is back
+        data = QByteArray::fromRawData(static_cast<const char*>(payload->constData()), size);
+    }
+    OperationFactory factory = m_factories.value(operationType);
+    AbstractOperation* operation = factory ? factory(data, this, SLOT(operationDone(void*))) : 0;
+    if(!operation) {
+        CRITICAL("can not rebuild an operation of type" << operationType);
+        delete payload;
+        sendResult(requestId, AbstractOperation::OperationFailed, QVariant());
+        return;
+    }
+    m_requests.insert(operation, requestId);
+    if(payload) {
+        m_payloads.insert(operation, payload);
+    }
+    m_worker->addOperation(operation);
+}
+
+void ProcessHelper::onDisconnected() {
+    DEBUG("handler gone, quitting");
+    QCoreApplication::quit();
+}
+
+void ProcessHelper::operationDone(void* aOperation) {
+    AbstractOperation* operation = reinterpret_cast<AbstractOperation*>(aOperation);
+    quint32 requestId = m_requests.take(operation);
+    sendResult(requestId, operation->status() | operation->customCode(),
+               operation->status() == AbstractOperation::OperationSuccess ? operation->resultForCache() : QVariant());
+    delete m_payloads.take(operation);
+    delete operation;
+}
+
+void ProcessHelper::sendResult(quint32 aRequestId, int aStatus, const QVariant& aResult) {
+    if(!m_channel) {
+        return;
+    }
+    QByteArray message;
+    QDataStream stream(&message, QIODevice::WriteOnly);
+    stream.setVersion(KProcessChannelStreamVersion);
+    stream << (quint8)ProcessChannel::MessageResult << aRequestId << (qint32)aStatus << aResult;
+    m_channel->send(message);
+}
@@ -0,0 +1,63 @@
+#ifndef PROCESSHELPER_H
+#define PROCESSHELPER_H
+
+#include <QObject>
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+
+#include "operationjournal.h"
+
+class WorkerThread;
+class ProcessChannel;
+class QSharedMemory;
+
+/**
+  * The helper process side of a ProcessQueueHandler: it receives the operations, rebuilds
+  * them with the factory registered for their type, runs them in a WorkerThread of its own
+  * and sends back how they went. A helper program typically is:
+  *
+  *     QCoreApplication app(argc, argv);
+  *     ProcessHelper helper;
+  *     helper.registerType("resize", &ResizeOperation::create);
+  *     if(!helper.connectToHandler(app.arguments().last())) return 1;
+  *     return app.exec();
+  *
+  * The helper presents the token its handler put in its environment when it connects.
+  * Large operations arrive through shared memory: the data given to the factory is valid
+  * only until the operation is over, it must be copied if the operation keeps it longer.
+  * The application quits when the handler goes away.
+  */
+class ProcessHelper : public QObject
+{
+    Q_OBJECT
+public:
+    explicit ProcessHelper(QObject* aParent = 0);
+    ~ProcessHelper();
+public:
+    /**
+      * Operations of type @aType are rebuilt by @aFactory. Register them before connecting.
+      */
+    void registerType(const QByteArray& aType, OperationFactory aFactory);
+    /**
+      * Connect to the handler listening on @aServerName and start the worker.
+      * Returns false if the connection failed.
+      */
+    bool connectToHandler(const QString& aServerName);
+private slots:
+    void onMessage(const QByteArray& aMessage);
+    void onDisconnected();
+    void operationDone(void* aOperation);
+private:
+    void sendResult(quint32 aRequestId, int aStatus, const QVariant& aResult);
+private:
+    QHash<QByteArray, OperationFactory> m_factories;
+    ProcessChannel* m_channel;
+    WorkerThread* m_worker;
+    // requests of the operations being run
+    QHash<AbstractOperation*, quint32> m_requests;
+    // shared memory holding their data, if any
+    QHash<AbstractOperation*, QSharedMemory*> m_payloads;
+};
+
+#endif // PROCESSHELPER_H
@@ -0,0 +1,300 @@
+#include "processqueuehandler.h"
+#include "processchannel.h"
+#include "abstractoperation.h"
+
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QProcessEnvironment>
+#include <QSharedMemory>
+#include <QTimer>
+#include <QUuid>
+#include <QVariant>
+#include <cstring>
+
+#include "activelogs.h"
+#ifdef PROCESS_QUEUE_HANDLER
+    #define ENABLE_LOG_MACROS
+#endif
+#include "workerlog.h"
+WORKER_LOG_CATEGORY("ProcessQueueHandler");
+
+ProcessQueueHandler::ProcessQueueHandler(const QString& aHelperProgram, const QStringList& aHelperArguments,
+                                         QSemaphore& aSemaphore, QThread* aMainThread, QThread* aWorkerThread) :
+        QueueHandler(aSemaphore, aMainThread, aWorkerThread),
+        m_helperProgram(aHelperProgram),
+        m_helperArguments(aHelperArguments),
+        m_server(new QLocalServer(this)),
+        m_process(new QProcess(this)),
+        m_channel(0),
+        m_inFlight(0),
+        m_requestId(0),
+        m_requestSent(false),
+        m_helperInstance(0),
+        m_requestInstance(0),
+        m_payload(0),
+        m_sharedMemoryThreshold(KDefaultSharedMemoryThreshold),
+        m_restarts(0),
+        m_restartNow(false)
+{
+    m_process->setProcessChannelMode(QProcess::ForwardedChannels);
+    connect(m_server, SIGNAL(newConnection()), this, SLOT(onHelperConnected()));
+    connect(m_process, SIGNAL(finished(int, QProcess::ExitStatus)), this, SLOT(onHelperFinished(int, QProcess::ExitStatus)));
+    connect(m_process, SIGNAL(error(QProcess::ProcessError)), this, SLOT(onHelperError(QProcess::ProcessError)));
+
+    QString serverName = QString("workerthread-%1-%2").arg(QCoreApplication::applicationPid()).arg(workerId());
+    // a stale one left by a crashed run with the same pid
+    QLocalServer::removeServer(serverName);
+    if(!m_server->listen(serverName)) {
+        CRITICAL("can not listen on" << serverName << ":" << m_server->errorString());
+    }
+    startHelper();
+}
+
+ProcessQueueHandler::~ProcessQueueHandler() {
+    DEBUG_ENTER_FN();
+    // no more restarts
+    m_process->disconnect(this);
+    // closing the connection tells the helper to quit
+    delete m_channel;
+    m_channel = 0;
+    if(m_process->state() != QProcess::NotRunning && !m_process->waitForFinished(KHelperStopTimeout)) {
+        WARNING("helper did not quit, killing it");
+        m_process->kill();
+        m_process->waitForFinished(KHelperStopTimeout);
+    }
+    releasePayload();
+    DEBUG_EXIT_FN();
+}
+
+void ProcessQueueHandler::setSharedMemoryThreshold(int aThreshold) {
+    m_sharedMemoryThreshold = aThreshold;
+}
+
+int ProcessQueueHandler::helperRestarts() const {
+    return m_restarts;
+}
+
+void ProcessQueueHandler::executeOperation(AbstractOperation* aOperation) {
+    if(aOperation->journalType().isEmpty()) {
+        // not serializable: it runs here
+        QueueHandler::executeOperation(aOperation);
+        return;
+    }
+    m_inFlight = aOperation;
+    m_requestId++;
+    m_requestSent = false;
+    if(m_channel) {
+        sendRequest();
+    } else {
+        DEBUG("operation" << aOperation->id() << "waits for the helper to connect");
+    }
+}
+
+void ProcessQueueHandler::abortOperation(AbstractOperation* aOperation) {
+    if(aOperation != m_inFlight) {
+        QueueHandler::abortOperation(aOperation);
+        return;
+    }
+    // it may be stuck: stopping the helper is the only way to stop it
+    WARNING("stopping the helper running operation" << aOperation->id());
+    m_inFlight = 0;
+    releasePayload();
+    // the next operation may be dispatched before the helper is gone: it waits for the new one
+    if(m_channel) {
+        m_channel->disconnect(this);
+        m_channel->deleteLater();
+        m_channel = 0;
+    }
+    if(m_process->state() != QProcess::NotRunning) {
+        m_restartNow = true;
+        m_process->kill();
+    }
+}
+
+void ProcessQueueHandler::startHelper() {
+    if(getTerminateThread() || m_process->state() != QProcess::NotRunning) {
+        return;
+    }
+    DEBUG("starting" << m_helperProgram);
+    m_helperInstance++;
+    // anyone can connect to the server: the helper proves it is ours with this, a new one
+    // each time so that a connection left by an earlier helper is not taken for it
+    // (in the environment, which unlike the command line other users can not read)
+    m_helperToken = QUuid::createUuid().toString().toLatin1() + QUuid::createUuid().toString().toLatin1();
+    QProcessEnvironment environment = QProcessEnvironment::systemEnvironment();
+    environment.insert(KProcessHelperTokenVariable, QString::fromLatin1(m_helperToken));
+    m_process->setProcessEnvironment(environment);
+    m_process->start(m_helperProgram, QStringList(m_helperArguments) << m_server->fullServerName());
+}
+
+void ProcessQueueHandler::onHelperConnected() {
+    QLocalSocket* socket = m_server->nextPendingConnection();
+    if(!socket) {
+        return;
+    }
+    // not the helper until it says so
+    ProcessChannel* channel = new ProcessChannel(socket, this);
+    connect(channel, SIGNAL(messageReceived(QByteArray)), this, SLOT(onHelperHello(QByteArray)));
+    connect(channel, SIGNAL(disconnected()), channel, SLOT(deleteLater()));
+}
+
+void ProcessQueueHandler::onHelperHello(const QByteArray& aMessage) {
+    ProcessChannel* channel = qobject_cast<ProcessChannel*>(sender());
+    if(!channel) {
+        return;
+    }
+    QDataStream stream(aMessage);
+    stream.setVersion(KProcessChannelStreamVersion);
+    quint8 type = 0;
+    QByteArray token;
+    stream >> type >> token;
+    channel->disconnect();
+    if(type != ProcessChannel::MessageHello || stream.status() != QDataStream::Ok ||
+            m_helperToken.isEmpty() || token != m_helperToken || m_channel) {
+        WARNING("a connection which is not from our helper, rejected");
+        channel->deleteLater();
+        return;
+    }
+    DEBUG("helper connected");
+    // one connection per helper
+    m_helperToken.clear();
+    m_channel = channel;
+    connect(m_channel, SIGNAL(messageReceived(QByteArray)), this, SLOT(onMessage(QByteArray)));
+    connect(m_channel, SIGNAL(disconnected()), this, SLOT(onHelperDisconnected()));
+    if(m_inFlight && !m_requestSent) {
+        sendRequest();
+    }
+}
+
+void ProcessQueueHandler::onHelperDisconnected() {
+    if(sender() != m_channel) {
+        return;
+    }
+    WARNING("the helper closed its connection");
+    // as in abortOperation(): nothing more is sent to it
+    m_channel->disconnect(this);
+    m_channel->deleteLater();
+    m_channel = 0;
+    // of no use even if it is still alive; its finished() fails what it was running
+    // and starts the next one
+    if(m_process->state() != QProcess::NotRunning) {
+        m_restartNow = true;
+        m_process->kill();
+    }
+}
+
+void ProcessQueueHandler::onHelperFinished(int aExitCode, QProcess::ExitStatus aExitStatus) {
+    if(!m_restartNow) {
+        WARNING("helper ended, exit code" << aExitCode << (aExitStatus == QProcess::CrashExit ? "(crashed)" : ""));
+    }
+    helperDied(m_restartNow || m_inFlight);
+}
+
+void ProcessQueueHandler::onHelperError(QProcess::ProcessError aError) {
+    // the other errors are followed by finished()
+    if(aError == QProcess::FailedToStart) {
+        CRITICAL("can not start" << m_helperProgram << ":" << m_process->errorString());
+        helperDied(false);
+    }
+}
+
+void ProcessQueueHandler::onMessage(const QByteArray& aMessage) {
+    QDataStream stream(aMessage);
+    stream.setVersion(KProcessChannelStreamVersion);
+    quint8 type = 0;
+    quint32 requestId = 0;
+    qint32 status = 0;
+    QVariant result;
+    stream >> type >> requestId >> status >> result;
+    if(type != ProcessChannel::MessageResult || stream.status() != QDataStream::Ok) {
+        CRITICAL("malformed message from the helper");
+        return;
+    }
+    if(!m_inFlight || requestId != m_requestId) {
+        // the operation has already been given up (timed out)
+        DEBUG("late result of request" << requestId);
+        return;
+    }
+    AbstractOperation* operation = m_inFlight;
+    m_inFlight = 0;
+    releasePayload();
+    // a cancelled operation stays cancelled
+    if(operation->status() != AbstractOperation::OperationCancelled) {
+        operation->m_status = status;
+        if(operation->status() == AbstractOperation::OperationSuccess) {
+            operation->setResultFromCache(result);
+        }
+    }
+    if(isCurrentOperation(operation)) {
+        operationFinished();
+    }
+}
+
+void ProcessQueueHandler::sendRequest() {
+    QByteArray data = m_inFlight->serialize();
+    QString key;
+    QByteArray inlineData;
+    if(data.size() > m_sharedMemoryThreshold) {
+        key = QString("%1-%2").arg(m_server->serverName()).arg(m_requestId);
+        m_payload = new QSharedMemory(key, this);
+        if(m_payload->create(data.size())) {
+            m_payload->lock();
+            memcpy(m_payload->data(), data.constData(), data.size());
+            m_payload->unlock();
+        } else {
+            WARNING("no shared memory (" << m_payload->errorString() << "), sending over the socket");
+            releasePayload();
+            key.clear();
+        }
+    }
+    if(key.isEmpty()) {
+        inlineData = data;
+    }
+    QByteArray message;
+    QDataStream stream(&message, QIODevice::WriteOnly);
+    stream.setVersion(KProcessChannelStreamVersion);
+    stream << (quint8)ProcessChannel::MessageExecute << m_requestId << m_inFlight->journalType()
+            << key << (quint32)data.size() << inlineData;
+    m_channel->send(message);
+    m_requestSent = true;
+    m_requestInstance = m_helperInstance;
+    VERBOSE("sent request" << m_requestId << "for operation" << m_inFlight->id());
+}
+
+void ProcessQueueHandler::helperDied(bool aRestartNow) {
+    m_restartNow = false;
+    if(m_channel) {
+        m_channel->deleteLater();
+        m_channel = 0;
+    }
+    // an operation not sent yet, or sent to an earlier helper, did not run in this one: it waits for the next
+    if(m_inFlight && m_requestSent && m_requestInstance == m_helperInstance) {
+        AbstractOperation* operation = m_inFlight;
+        m_inFlight = 0;
+        releasePayload();
+        WARNING("operation" << operation->id() << "failed with its helper");
+        if(operation->status() != AbstractOperation::OperationCancelled) {
+            operation->setStatus(AbstractOperation::OperationFailed);
+        }
+        if(isCurrentOperation(operation)) {
+            operationFinished();
+        }
+    }
+    if(getTerminateThread()) {
+        return;
+    }
+    m_restarts++;
+    if(aRestartNow) {
+        startHelper();
+    } else {
+        QTimer::singleShot(KHelperRestartDelay, this, SLOT(startHelper()));
+    }
+}
+
+void ProcessQueueHandler::releasePayload() {
+    // the helper has its own attachment, if it is still alive
+    delete m_payload;
+    m_payload = 0;
+}
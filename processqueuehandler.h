@@ -0,0 +1,93 @@
+#ifndef PROCESSQUEUEHANDLER_H
+#define PROCESSQUEUEHANDLER_H
+
+#include <QByteArray>
+#include <QProcess>
+#include <QString>
+#include <QStringList>
+
+#include "queuehandler.h"
+
+class QLocalServer;
+class QSharedMemory;
+class ProcessChannel;
+
+// serialized operations bigger than this (bytes) go through shared memory instead of the socket
+const int KDefaultSharedMemoryThreshold = 64 * 1024;
+// wait (msecs) before restarting a helper which died while running nothing (e.g. it can not start)
+const int KHelperRestartDelay = 1000;
+// how long (msecs) a helper has to quit when its handler goes away
+const int KHelperStopTimeout = 1000;
+
+/**
+  * A QueueHandler which runs the operations with a journal type (see AbstractOperation::journalType())
+  * in a helper process, so that a crash in their execute() does not take the application down.
+  * The helper program is started with the name of the local server to connect to as its last
+  * argument and runs a ProcessHelper, knowing the same operation types.
+  *
+  * The operation is serialized (AbstractOperation::serialize()) and sent over a local socket,
+  * through shared memory when it is large; its status and AbstractOperation::resultForCache()
+  * come back and the observer is called as usual. The timeout is the default one of the handler.
+  * If the helper dies while running an operation, the operation fails (OperationFailed, its
+  * retry policy applies) and the helper is restarted; the same if it closes its connection.
+  * A timed out operation, or a running one when all the operations are cancelled, is stopped
+  * by restarting the helper. The first connection presenting the token the helper has been
+  * given in its environment is the helper, the others are rejected.
+  * The other operations, batches included, run in the worker thread as usual.
+  */
+class ProcessQueueHandler : public QueueHandler
+{
+    Q_OBJECT
+public:
+    ProcessQueueHandler(const QString& aHelperProgram, const QStringList& aHelperArguments,
+                        QSemaphore& aSemaphore, QThread* aMainThread, QThread* aWorkerThread);
+    ~ProcessQueueHandler();
+public:
+    void setSharedMemoryThreshold(int aThreshold);
+    /**
+      * How many times the helper has been restarted.
+      */
+    int helperRestarts() const;
+protected: // from QueueHandler
+    void executeOperation(AbstractOperation* aOperation);
+    void abortOperation(AbstractOperation* aOperation);
+private slots:
+    void startHelper();
+    void onHelperConnected();
+    void onHelperHello(const QByteArray& aMessage);
+    void onHelperDisconnected();
+    void onHelperFinished(int aExitCode, QProcess::ExitStatus aExitStatus);
+    void onHelperError(QProcess::ProcessError aError);
+    void onMessage(const QByteArray& aMessage);
+private:
+    void sendRequest();
+    /**
+      * The helper is gone: fail the operation it was running, if any, and start another one.
+      */
+    void helperDied(bool aRestartNow);
+    void releasePayload();
+private:
+    QString m_helperProgram;
+    QStringList m_helperArguments;
+    QLocalServer* m_server;
+    QProcess* m_process;
+    // 0 while the helper is not connected
+    ProcessChannel* m_channel;
+    // the helper being started must present it, empty once it has connected
+    QByteArray m_helperToken;
+    // the operation the helper runs (or will run as soon as it is connected), 0 if none
+    AbstractOperation* m_inFlight;
+    quint32 m_requestId;
+    bool m_requestSent;
+    // the helper process started last and the one m_inFlight has been sent to, counted from the first one
+    int m_helperInstance;
+    int m_requestInstance;
+    // shared memory of the request being run, if any
+    QSharedMemory* m_payload;
+    int m_sharedMemoryThreshold;
+    int m_restarts;
+    // the helper has been killed on purpose: start the next one right away
+    bool m_restartNow;
+};
+
+#endif // PROCESSQUEUEHANDLER_H
@@ -0,0 +1,14 @@
+#include "processworkerpool.h"
+#include "processworkerthread.h"
+
+ProcessWorkerPool::ProcessWorkerPool(const QString& aHelperProgram, const QStringList& aHelperArguments,
+                                     int aWorkerCount, QObject* aParent) :
+        WorkerPool(aWorkerCount, aParent),
+        m_helperProgram(aHelperProgram),
+        m_helperArguments(aHelperArguments)
+{
+}
+
+WorkerThread* ProcessWorkerPool::createWorker() {
+    return new ProcessWorkerThread(m_helperProgram, m_helperArguments);
+}
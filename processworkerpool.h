@@ -0,0 +1,26 @@
+#ifndef PROCESSWORKERPOOL_H
+#define PROCESSWORKERPOOL_H
+
+#include <QString>
+#include <QStringList>
+
+#include "workerpool.h"
+
+/**
+  * A WorkerPool of ProcessWorkerThreads: each worker has its own helper process,
+  * so a pool of N workers runs up to N operations out of process at once.
+  */
+class ProcessWorkerPool : public WorkerPool
+{
+    Q_OBJECT
+public:
+    ProcessWorkerPool(const QString& aHelperProgram, const QStringList& aHelperArguments = QStringList(),
+                      int aWorkerCount = QThread::idealThreadCount(), QObject* aParent = 0);
+protected: // from WorkerPool
+    WorkerThread* createWorker();
+private:
+    QString m_helperProgram;
+    QStringList m_helperArguments;
+};
+
+#endif // PROCESSWORKERPOOL_H
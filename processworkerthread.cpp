@@ -0,0 +1,14 @@
+#include "processworkerthread.h"
+#include "processqueuehandler.h"
+
+ProcessWorkerThread::ProcessWorkerThread(const QString& aHelperProgram, const QStringList& aHelperArguments,
+                                         QObject* aParent) :
+        WorkerThread(aParent),
+        m_helperProgram(aHelperProgram),
+        m_helperArguments(aHelperArguments)
+{
+}
+
+QueueHandler* ProcessWorkerThread::createQueueHandler() {
+    return new ProcessQueueHandler(m_helperProgram, m_helperArguments, m_semaphore, m_mainThread, this);
+}
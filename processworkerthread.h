@@ -0,0 +1,26 @@
+#ifndef PROCESSWORKERTHREAD_H
+#define PROCESSWORKERTHREAD_H
+
+#include <QString>
+#include <QStringList>
+
+#include "workerthread.h"
+
+/**
+  * A WorkerThread running its serializable operations in a helper process,
+  * see ProcessQueueHandler.
+  */
+class ProcessWorkerThread : public WorkerThread
+{
+    Q_OBJECT
+public:
+    ProcessWorkerThread(const QString& aHelperProgram, const QStringList& aHelperArguments = QStringList(),
+                        QObject* aParent = 0);
+protected: // from WorkerThread
+    QueueHandler* createQueueHandler();
+private:
+    QString m_helperProgram;
+    QStringList m_helperArguments;
+};
+
+#endif // PROCESSWORKERTHREAD_H
@@ -2,8 +2,12 @@
 #include "workerthread.h"
 #include "abstractoperation.h"
 #include "abstractoperationobserver.h"
-#include "sentineloperation.h"
+#include "workerclock.h"
+#include "callbackdispatcher.h"
+#include "resultcache.h"
+#include "operationjournal.h"
 
+#include <QElapsedTimer>
 #include <QMutexLocker>
 #include <QTimer>
 #include <QTimerEvent>
@@ -19,10 +23,93 @@
 #ifdef WORKER_THREAD_QUEUE_HANDLER
 #define ENABLE_LOG_MACROS
 #endif
-#include "logmacros.h"
+#include "workerlog.h"
+WORKER_LOG_CATEGORY("QueueHandler");
 
-#include <QStateMachine>
-#include <QFinalState>
+namespace {
+    QAtomicInt s_lastWorkerId(0);
+
+    class RateLimitFilter : public OperationFilter
+    {
+    public:
+        RateLimitFilter(RateLimiter& aRateLimiter, qint64 aNow) :
+                m_rateLimiter(aRateLimiter),
+                m_now(aNow),
+                m_waitTime(-1)
+        {
+        }
+        bool accept(AbstractOperation* aOperation, const QByteArray& aRateLimitKey, const QByteArray& aBatchKey) {
+            Q_UNUSED(aOperation);
+            Q_UNUSED(aBatchKey);
+            if(m_throttled.contains(aRateLimitKey)) {
+                // no token can come back during this pass
+                return false;
+            }
+            if(m_rateLimiter.tryAcquire(aRateLimitKey, m_now)) {
+                return true;
+            }
+            m_throttled.insert(aRateLimitKey);
+            qint64 waitTime = m_rateLimiter.waitTime(aRateLimitKey, m_now);
+            if(m_waitTime < 0 || waitTime < m_waitTime) {
+                m_waitTime = waitTime;
+            }
+            return false;
+        }
+        // msecs until the first rejected operation can start, -1 if none was rejected
+        qint64 waitTime() const {
+            return m_waitTime;
+        }
+    private:
+        RateLimiter& m_rateLimiter;
+        qint64 m_now;
+        qint64 m_waitTime;
+        // keys found without a token in this pass
+        QSet<QByteArray> m_throttled;
+    };
+
+    // holds back the first operation of a batch until the batch is full or has lingered enough
+    class BatchLingerFilter : public OperationFilter
+    {
+    public:
+        BatchLingerFilter(OperationsQueue& aQueue, int aMaxBatchSize, int aLinger, qint64 aNow,
+                RateLimitFilter* aRateLimitFilter) :
+                m_queue(aQueue),
+                m_maxBatchSize(aMaxBatchSize),
+                m_linger(aLinger),
+                m_now(aNow),
+                m_rateLimitFilter(aRateLimitFilter),
+                m_waitTime(-1)
+        {
+        }
+        bool accept(AbstractOperation* aOperation, const QByteArray& aRateLimitKey, const QByteArray& aBatchKey) {
+            if(!aBatchKey.isEmpty() && m_queue.batchCount(aBatchKey) < m_maxBatchSize) {
+                qint64 ready = aOperation->enqueueTime() + m_linger;
+                if(ready > m_now) {
+                    if(m_waitTime < 0 || ready - m_now < m_waitTime) {
+                        m_waitTime = ready - m_now;
+                    }
+                    return false;
+                }
+            }
+            return !m_rateLimitFilter || m_rateLimitFilter->accept(aOperation, aRateLimitKey, aBatchKey);
+        }
+        // msecs until the first rejected operation can start, -1 if none was rejected
+        qint64 waitTime() const {
+            qint64 rateLimitWait = m_rateLimitFilter ? m_rateLimitFilter->waitTime() : -1;
+            if(m_waitTime < 0 || (rateLimitWait >= 0 && rateLimitWait < m_waitTime)) {
+                return rateLimitWait;
+            }
+            return m_waitTime;
+        }
+    private:
+        OperationsQueue& m_queue;
+        int m_maxBatchSize;
+        int m_linger;
+        qint64 m_now;
+        RateLimitFilter* m_rateLimitFilter;
+        qint64 m_waitTime;
+    };
+}
 
 QueueHandler::QueueHandler(QSemaphore& aSemaphore, QThread* aMainThread, QThread* aWorkerThread) :
         QObject(0),
@@ -30,103 +117,426 @@ QueueHandler::QueueHandler(QSemaphore& aSemaphore, QThread* aMainThread, QThread
         m_workerThread(aWorkerThread),
         m_semaphore(aSemaphore),
         m_exitThread(false),
-        m_cancelAllOperations(false),
-        m_currentOperation(0)
+        m_currentOperation(0),
+        m_timerId(0),
+        m_epoch(0),
+        m_tracer(0),
+        m_workerId(s_lastWorkerId.fetchAndAddRelaxed(1) + 1),
+        m_clock(WorkerClock::systemClock()),
+        m_lastActivity(m_clock->now()),
+        m_state(StateWaiting),
+        m_dispatchScheduled(false),
+        m_dispatching(false),
+        m_dispatchTimeBudget(KDefaultDispatchTimeBudget),
+        m_defaultTimeout(KDefaultTimeoutOperation),
+        m_manualDispatch(false),
+        m_deadline(-1),
+        m_executionStart(0),
+        m_callbackDispatcher(0),
+        m_callbackPool(0),
+        m_resultCache(0),
+        m_journal(0),
+        m_maxBatchSize(KDefaultMaxBatchSize),
+        m_batchLinger(0),
+        m_waitingInEventLoop(0),
+        m_wakeupTimerId(0),
+        m_wakeupAt(-1),
+        // a shared qrand() sequence would give the same jitter to every worker
+        m_randomState((quint32)m_clock->now() ^ ((quint32)m_workerId * 2654435761u))
 {
-    QStateMachine* s_machine = new QStateMachine(this);
-    QState* waiting = new QState(s_machine);
-    QState* processing = new QState(s_machine);
-    QState* exiting = new QState(s_machine);
-    QFinalState* exit = new QFinalState(s_machine);
-
-    s_machine->setInitialState(waiting);
-    waiting->addTransition(this, SIGNAL(operationNeeded()), waiting);
-    waiting->addTransition(this, SIGNAL(operationRetrieved()), processing);
-    waiting->addTransition(this, SIGNAL(cleanUpAndExit()), exiting);
-    connect(waiting, SIGNAL(entered()), this, SLOT(onWaiting()));
-
-
-    processing->addTransition(this, SIGNAL(operationNeeded()), waiting);
-    connect(processing, SIGNAL(entered()), this, SLOT(onProcessing()));
-
-    connect(exiting, SIGNAL(entered()), this, SLOT(onExiting()));
-    exiting->addTransition(this, SIGNAL(exit()), exit);
-
-    connect(s_machine, SIGNAL(finished()), this, SLOT(deleteLater()));
-
-    s_machine->start();
+    scheduleDispatch();
 }
 
 QueueHandler::~QueueHandler() {
     DEBUG_ENTER_FN();
+    if(m_callbackDispatcher) {
+        // after the callbacks already queued to it
+        m_callbackDispatcher->deleteLater();
+    }
+    if(m_resultCache) {
+        m_resultCache->detach(this);
+    }
+    flushDirectDeliveries();
     m_semaphore.release(1);
     DEBUG_EXIT_FN();
 }
 
 void QueueHandler::addOperation(AbstractOperation* aNewOperation) {
     DEBUG_ENTER_FN();
-    {
-        QMutexLocker locker(&m_queueMutex);
-        addOperationToQueue(aNewOperation, m_normalPriorityQueue);
-        m_operationWait.release(1);
-    }
+    enqueue(aNewOperation, AbstractOperation::PriorityNormal);
     DEBUG_EXIT_FN();
 }
 
 void QueueHandler::addHighPriorityOperation(AbstractOperation* aNewOperation) {
     DEBUG_ENTER_FN();
+    enqueue(aNewOperation, AbstractOperation::PriorityHigh);
+    DEBUG_EXIT_FN();
+}
+
+void QueueHandler::addIdleOperation(AbstractOperation* aNewOperation) {
+    DEBUG_ENTER_FN();
+    enqueue(aNewOperation, AbstractOperation::PriorityIdle);
+    DEBUG_EXIT_FN();
+}
+
+void QueueHandler::enqueue(AbstractOperation* aNewOperation, AbstractOperation::PriorityClass aPriority) {
+    aNewOperation->m_attempts = 0;
+    if(m_resultCache && !aNewOperation->cacheKey().isEmpty()) {
+        // before the lookup: once joined, the operation may be completed by another worker
+        aNewOperation->setQueueHandler(this);
+        aNewOperation->m_priority = aPriority;
+        switch(m_resultCache->lookup(aNewOperation, this)) {
+        case ResultCache::LookupHit:
+            DEBUG_TAG( CLASS_TAG(), "cached result for operation id:" << aNewOperation->id());
+            // it may be a replayed one
+            unjournalOperation(aNewOperation);
+            if(!aNewOperation->observer()) {
+                // nobody to give it to
+                aNewOperation->cleanThreadSpecificResources();
+            } else if(aNewOperation->deliveryPolicy() == AbstractOperation::DeliverToObserverThread) {
+                // never from within addOperation(), even when called by the observer thread
+                trace(OperationTracer::EventDelivered, aNewOperation);
+                CallbackDispatcher::invokeCallback(aNewOperation, Qt::QueuedConnection);
+            } else {
+                endOperation(aNewOperation);
+                // not from within addOperation() either: the caller may hold mutexes of its own
+                if(postDirectDeliveries()) {
+                    releaseForDelivery();
+                }
+            }
+            return;
+        case ResultCache::LookupJoined:
+            DEBUG_TAG( CLASS_TAG(), "operation id:" << aNewOperation->id() << "waits for the same key to be computed");
+            journalOperation(aNewOperation);
+            return;
+        default:
+            break;
+        }
+    }
+    journalOperation(aNewOperation);
     {
         QMutexLocker locker(&m_queueMutex);
-        addOperationToQueue(aNewOperation, m_highPriorityQueue);
+        addOperationToQueue(aNewOperation, queueFor(aPriority));
         m_operationWait.release(1);
+        operationAdded();
     }
+    // a previous instance of it may have been cancelled (the permit above wakes the worker)
+    postDirectDeliveries();
+}
+
+void QueueHandler::completeOperation(AbstractOperation* aOperation) {
+    if(m_resultCache && !aOperation->cacheKey().isEmpty()) {
+        // before the clean up, which may delete it; the joined operations go back to their own handlers
+        m_resultCache->complete(aOperation);
+    }
+    unjournalOperation(aOperation);
+    aOperation->cleanThreadSpecificResources();
+    endOperation(aOperation);
+}
+
+void QueueHandler::handBackJoined(AbstractOperation* aOperation, bool aResultReady) {
+    {
+        QMutexLocker locker(&m_deliveryMutex);
+        m_joinedOperations.append(qMakePair(aOperation, aResultReady));
+    }
+    QMetaObject::invokeMethod(this, "deliverJoinedOperations", Qt::QueuedConnection);
+    releaseForDelivery();
+}
+
+void QueueHandler::deliverJoinedOperations() {
+    DEBUG_ENTER_FN();
+    QList< QPair<AbstractOperation*, bool> > joined;
+    {
+        QMutexLocker locker(&m_deliveryMutex);
+        joined.swap(m_joinedOperations);
+    }
+    for(int i = 0; i < joined.count(); ++i) {
+        AbstractOperation* operation = joined.at(i).first;
+        if(joined.at(i).second) {
+            // it never ran itself
+            trace(OperationTracer::EventDelivered, operation);
+            unjournalOperation(operation);
+            operation->cleanThreadSpecificResources();
+            endOperation(operation);
+        } else if(getTerminateThread()) {
+            cancelDelayedOperation(operation);
+        } else {
+            // nobody cancelled it: it has to run on its own
+            enqueue(operation, operation->m_priority);
+        }
+    }
+    flushDirectDeliveries();
     DEBUG_EXIT_FN();
 }
 
+void QueueHandler::journalOperation(AbstractOperation* aOperation) {
+    if(m_journal && aOperation->m_journalEntry < 0 && !aOperation->journalType().isEmpty()) {
+        aOperation->m_journalEntry = m_journal->append(aOperation);
+    }
+}
+
+void QueueHandler::unjournalOperation(AbstractOperation* aOperation) {
+    if(m_journal && aOperation->m_journalEntry >= 0 &&
+            !(getTerminateThread() && aOperation->status() == AbstractOperation::OperationCancelled)) {
+        m_journal->complete(aOperation->m_journalEntry);
+        aOperation->m_journalEntry = -1;
+    }
+}
+
+void QueueHandler::operationAdded() {
+    // the worker may be sitting in its event loop, not on m_operationWait
+    if(m_waitingInEventLoop.testAndSetOrdered(1, 0)) {
+        QMetaObject::invokeMethod(this, "wakeUp", Qt::QueuedConnection);
+    }
+}
+
+void QueueHandler::setRateLimit(const QByteArray& aKey, double aPerSecond, int aBurst) {
+    QMutexLocker locker(&m_queueMutex);
+    m_rateLimiter.setRate(aKey, aPerSecond, aBurst, m_clock->now());
+    // the new rate may let a queued operation start
+    operationAdded();
+}
+
+void QueueHandler::removeRateLimit(const QByteArray& aKey) {
+    QMutexLocker locker(&m_queueMutex);
+    m_rateLimiter.removeRate(aKey);
+    operationAdded();
+}
+
+void QueueHandler::setFairShare(bool aFairShare) {
+    QMutexLocker locker(&m_queueMutex);
+    m_normalPriorityQueue.setFairShare(aFairShare);
+    m_highPriorityQueue.setFairShare(aFairShare);
+    m_idlePriorityQueue.setFairShare(aFairShare);
+}
+
+void QueueHandler::setTenantWeight(quintptr aTenant, int aWeight) {
+    QMutexLocker locker(&m_queueMutex);
+    m_normalPriorityQueue.setTenantWeight(aTenant, aWeight);
+    m_highPriorityQueue.setTenantWeight(aTenant, aWeight);
+    m_idlePriorityQueue.setTenantWeight(aTenant, aWeight);
+}
+
+void QueueHandler::setBatching(int aMaxBatchSize, int aLinger) {
+    QMutexLocker locker(&m_queueMutex);
+    m_maxBatchSize = qMax(1, aMaxBatchSize);
+    m_batchLinger = qMax(0, aLinger);
+    // lingering operations may be able to start now
+    operationAdded();
+}
+
+void QueueHandler::setCallbackThread(QThread* aThread) {
+    if(m_callbackDispatcher) {
+        m_callbackDispatcher->deleteLater();
+        m_callbackDispatcher = 0;
+    }
+    if(aThread) {
+        m_callbackDispatcher = new CallbackDispatcher();
+        m_callbackDispatcher->moveToThread(aThread);
+    }
+}
+
+void QueueHandler::setCallbackPool(QThreadPool* aPool) {
+    m_callbackPool = aPool;
+}
+
+void QueueHandler::setResultCache(ResultCache* aCache) {
+    if(m_resultCache) {
+        m_resultCache->detach(this);
+    }
+    m_resultCache = aCache;
+    if(m_resultCache) {
+        m_resultCache->attach(this);
+    }
+}
+
+ResultCache* QueueHandler::resultCache() const {
+    return m_resultCache;
+}
+
+void QueueHandler::setJournal(OperationJournal* aJournal) {
+    m_journal = aJournal;
+}
+
+OperationJournal* QueueHandler::journal() const {
+    return m_journal;
+}
+
+QHash<quintptr, TenantStats> QueueHandler::tenantStats() {
+    QMutexLocker locker(&m_queueMutex);
+    QHash<quintptr, TenantStats> result = m_normalPriorityQueue.tenantStats();
+    QList< QHash<quintptr, TenantStats> > others;
+    others << m_highPriorityQueue.tenantStats() << m_idlePriorityQueue.tenantStats();
+    for(int i = 0; i < others.count(); ++i) {
+        QHash<quintptr, TenantStats>::const_iterator tenant = others.at(i).constBegin();
+        for(; tenant != others.at(i).constEnd(); ++tenant) {
+            TenantStats& stats = result[tenant.key()];
+            stats.m_queued += tenant->m_queued;
+            stats.m_enqueued += tenant->m_enqueued;
+            stats.m_dequeued += tenant->m_dequeued;
+        }
+    }
+    return result;
+}
 
 void QueueHandler::addOperationToQueue(AbstractOperation* aOperation, OperationsQueue& aOperationQueue) {
     VERBOSE_ENTER_FN();
     // get rid of a previous istance of the operation if it is in the queue
     removeOperationFromQueue(aOperation->id(), aOperationQueue);
+    if(!m_retries.isEmpty()) {
+        cancelRetry(aOperation->id());
+    }
     // add request to the queue
     aOperationQueue.enqueue(aOperation->id(), aOperation);
+    if(&aOperationQueue == &m_highPriorityQueue) {
+        aOperation->m_priority = AbstractOperation::PriorityHigh;
+    } else if(&aOperationQueue == &m_idlePriorityQueue) {
+        aOperation->m_priority = AbstractOperation::PriorityIdle;
+    } else {
+        aOperation->m_priority = AbstractOperation::PriorityNormal;
+    }
     aOperation->setQueueHandler(this);
     aOperation->setStatus(AbstractOperation::OperationNotStarted);
+    aOperation->m_enqueueTime = m_clock->now();
+    m_lastActivity = aOperation->m_enqueueTime;
+    trace(OperationTracer::EventEnqueued, aOperation);
     VERBOSE_EXIT_FN();
 }
 
+OperationsQueue& QueueHandler::queueFor(AbstractOperation::PriorityClass aPriority) {
+    switch(aPriority) {
+    case AbstractOperation::PriorityHigh:
+        return m_highPriorityQueue;
+    case AbstractOperation::PriorityIdle:
+        return m_idlePriorityQueue;
+    default:
+        return m_normalPriorityQueue;
+    }
+}
+
 void QueueHandler::removeOperationFromQueue(int aId, OperationsQueue& aOperationQueue) {
     VERBOSE_ENTER_FN();
     // get rid of a previous istance of the operation if it is in the queue
     if(AbstractOperation* operation = aOperationQueue.remove(aId)) {
+        trace(OperationTracer::EventDequeued, operation);
+        trace(OperationTracer::EventCancelled, operation);
         operation->setStatus(AbstractOperation::OperationCancelled);
-        operation->cleanThreadSpecificResources();
-        endOperation(operation);
-        m_operationWait.acquire(1);
+        completeOperation(operation);
+        // if the worker has already taken its permit it will just find nothing to dequeue
+        m_operationWait.tryAcquire(1);
     }
     VERBOSE_EXIT_FN();
 }
 
 void QueueHandler::cancelAllOperations() {
     DEBUG_ENTER_FN();
+    int epoch = -1;
     {
         QMutexLocker locker(&m_mutex_currentOperation);
-        {
-            QMutexLocker locker(&m_queueMutex);
+        QMutexLocker queueLocker(&m_queueMutex);
+        epoch = takeAllOperations();
+        releaseForDelivery();
+    }
+    QMetaObject::invokeMethod(this, "doCancelAllOperations", Qt::QueuedConnection, Q_ARG(int, epoch));
+    DEBUG_EXIT_FN();
+}
 
-            // not use addOperation and addHighPriorityOperation because they will lock m_queueMutex
-            // and we need to put those two operation together in both queues.
-            // otherwise the queue will be likely left in a inconsistent state.
-            addOperationToQueue(new SentinelOperation(), m_normalPriorityQueue);
-            addOperationToQueue(new SentinelOperation(), m_highPriorityQueue);
-            m_operationWait.release(2);
+void QueueHandler::cancelGroup(const QByteArray& aTag) {
+    DEBUG_ENTER_FN();
+    {
+        QMutexLocker locker(&m_mutex_currentOperation);
+        QMutexLocker queueLocker(&m_queueMutex);
+        OperationsQueue* queues[] = { &m_highPriorityQueue, &m_normalPriorityQueue, &m_idlePriorityQueue };
+        for(int i = 0; i < 3; ++i) {
+            foreach(int id, queues[i]->group(aTag)) {
+                cancelLater(queues[i]->remove(id));
+                m_operationWait.tryAcquire(1);
+            }
         }
-        // we need to set both variables at the same time or the first two if in onWaiting
-        // won't work.
-        setCurrentOperationCanContinue(false);
-        setCancelAllOperations(true);
+        QMultiMap<qint64, AbstractOperation*>::iterator retry = m_retries.begin();
+        while(retry != m_retries.end()) {
+            if(retry.value()->hasGroupTag(aTag)) {
+                cancelLater(retry.value());
+                retry = m_retries.erase(retry);
+            } else {
+                ++retry;
+            }
+        }
+        if(m_resultCache) {
+            foreach(AbstractOperation* operation, m_resultCache->takeJoined(this, aTag)) {
+                cancelLater(operation);
+            }
+        }
+        if(m_currentOperation && m_currentOperation->hasGroupTag(aTag)) {
+            trace(OperationTracer::EventCancelled, m_currentOperation);
+            m_currentOperation->setStatus(AbstractOperation::OperationCancelled);
+            setCurrentOperationCanContinue(false);
+        }
+        foreach(AbstractOperation* member, m_currentBatch) {
+            if(member != m_currentOperation && member->hasGroupTag(aTag)) {
+                trace(OperationTracer::EventCancelled, member);
+                member->setStatus(AbstractOperation::OperationCancelled);
+            }
+        }
+        releaseForDelivery();
     }
-    QTimer::singleShot(0, this, SLOT(doCancelAllOperations()));
+    QMetaObject::invokeMethod(this, "deliverCancelledOperations", Qt::QueuedConnection);
+    DEBUG_EXIT_FN();
+}
+
+int QueueHandler::takeAllOperations() {
+    foreach(AbstractOperation* operation, m_highPriorityQueue.takeAll()) {
+        cancelLater(operation);
+        m_operationWait.tryAcquire(1);
+    }
+    foreach(AbstractOperation* operation, m_normalPriorityQueue.takeAll()) {
+        cancelLater(operation);
+        m_operationWait.tryAcquire(1);
+    }
+    foreach(AbstractOperation* operation, m_idlePriorityQueue.takeAll()) {
+        cancelLater(operation);
+        m_operationWait.tryAcquire(1);
+    }
+    foreach(AbstractOperation* operation, m_retries) {
+        cancelLater(operation);
+    }
+    m_retries.clear();
+    if(m_resultCache) {
+        foreach(AbstractOperation* operation, m_resultCache->takeJoined(this)) {
+            cancelLater(operation);
+        }
+    }
+    if(!m_currentOperation) {
+        return -1;
+    }
+    setCurrentOperationCanContinue(false);
+    return m_epoch;
+}
+
+void QueueHandler::releaseForDelivery() {
+    // a dispatch posted before our delivery may block on m_operationWait with nothing left to
+    // take: it gets this permit, finds nothing to dequeue and goes back to the event loop,
+    // where the delivery is next (a spare permit only costs an empty dispatch)
+    m_operationWait.release(1);
+}
+
+void QueueHandler::cancelLater(AbstractOperation* aOperation) {
+    trace(OperationTracer::EventCancelled, aOperation);
+    aOperation->setStatus(AbstractOperation::OperationCancelled);
+    m_cancelledOperations.append(aOperation);
+}
+
+void QueueHandler::deliverCancelledOperations() {
+    DEBUG_ENTER_FN();
+    QList<AbstractOperation*> cancelled;
+    {
+        QMutexLocker locker(&m_queueMutex);
+        cancelled.swap(m_cancelledOperations);
+    }
+    foreach(AbstractOperation* operation, cancelled) {
+        completeOperation(operation);
+    }
+    flushDirectDeliveries();
     DEBUG_EXIT_FN();
 }
 
@@ -138,15 +548,33 @@ void QueueHandler::doCancelOperation(int aOperationId) {
             QMutexLocker locker(&m_queueMutex);
             removeOperationFromQueue(aOperationId, m_normalPriorityQueue);
             removeOperationFromQueue(aOperationId, m_highPriorityQueue);
+            removeOperationFromQueue(aOperationId, m_idlePriorityQueue);
+            cancelRetry(aOperationId);
+            if(m_resultCache) {
+                if(AbstractOperation* joined = m_resultCache->takeJoined(aOperationId, this)) {
+                    cancelDelayedOperation(joined);
+                }
+            }
         }
 
         AbstractOperation* operation = m_currentOperation;
         if(operation &&
                 operation->id() == aOperationId) {
+            trace(OperationTracer::EventCancelled, operation);
             operation->setStatus(AbstractOperation::OperationCancelled);
             m_currentOperationCanContinue = false;
+        } else {
+            // the rest of the batch goes on, executeBatch() leaves it cancelled
+            foreach(AbstractOperation* member, m_currentBatch) {
+                if(member->id() == aOperationId) {
+                    trace(OperationTracer::EventCancelled, member);
+                    member->setStatus(AbstractOperation::OperationCancelled);
+                }
+            }
         }
     }
+    // WorkerThread::cancelOperation() calls us directly from the worker thread, its mutex locked
+    postDirectDeliveries();
 
     DEBUG_EXIT_FN();
 }
@@ -157,6 +585,8 @@ void QueueHandler::operationFinished() {
     {
         QMutexLocker locker(&m_mutex_currentOperation);
         if( AbstractOperation* operation = m_currentOperation ) {
+            QList<AbstractOperation*> batch = m_currentBatch;
+            m_currentBatch.clear();
             m_currentOperation = 0;
             DEBUG_TAG( CLASS_TAG(), "operationFinished, ptr:" << HEX(operation) << "id:" <<operation->id());
             if(m_timerId != 0) {
@@ -164,79 +594,249 @@ void QueueHandler::operationFinished() {
                 VERBOSE_TAG( CLASS_TAG(), "its timer id was" << m_timerId);
                 m_timerId = 0;            
             }
-            operation->cleanThreadSpecificResources();
-            endOperation(operation);
-        }
-
-        {
-            QMutexLocker locker(&m_queueMutex);
-            if( 0 == m_normalPriorityQueue.count() &&
-                    0 == m_highPriorityQueue.count()) {
-                emit emptyQueue();
+            m_deadline = -1;
+            if(batch.isEmpty()) {
+                finishOperation(operation);
+            } else {
+                foreach(AbstractOperation* member, batch) {
+                    finishOperation(member);
+                }
             }
         }
+
+        checkEmptyQueue();
     }
-    emit operationNeeded();
+    flushDirectDeliveries();
+    backToWaiting();
     DEBUG_EXIT_FN();
 }
 
-void QueueHandler::onWaiting() {
+void QueueHandler::operationPaused() {
     DEBUG_ENTER_FN();
     Q_ASSERT(workerThreadCheck());
-
-    m_operationWait.acquire(1);
     {
         QMutexLocker locker(&m_mutex_currentOperation);
-        if(getCancelAllOperations()) {
-            // we enter this ONLY if doCancelAllOperations() has not been called yet.
-            // this happens when there was no current operation when cancelAllOperations() was called
-            // we need to release then the semaphore we just acquired
-            fixCancelAllSemaphore();
-            //just wait here doCancelAllOperations() will be called eventually
+        AbstractOperation* operation = m_currentOperation;
+        // a cancelled (or terminated) operation can not continue for real: it is just over
+        bool preempted = operation &&
+                operation->m_priority == AbstractOperation::PriorityIdle &&
+                m_currentBatch.isEmpty() &&
+                m_currentOperationCanContinue &&
+                !getTerminateThread();
+        if(preempted) {
+            m_currentOperation = 0;
+            DEBUG_TAG( CLASS_TAG(), "operationPaused, ptr:" << HEX(operation) << "id:" <<operation->id());
+            trace(OperationTracer::EventPaused, operation);
+            if(m_timerId != 0) {
+                killTimer(m_timerId);
+                m_timerId = 0;
+            }
+            m_deadline = -1;
+            // resuming is not a new attempt
+            operation->m_attempts--;
+            QMutexLocker queueLocker(&m_queueMutex);
+            addOperationToQueue(operation, m_idlePriorityQueue);
+            m_operationWait.release(1);
+        } else {
+            locker.unlock();
+            operationFinished();
+            DEBUG_EXIT_FN();
             return;
         }
-        if(getTerminateThread()) {
-            // we enter this ONLY after a call to terminateThread()
-            emit cleanUpAndExit();
-            return;
+    }
+    flushDirectDeliveries();
+    backToWaiting();
+    DEBUG_EXIT_FN();
+}
+
+void QueueHandler::backToWaiting() {
+    if(m_state == StateProcessing) {
+        m_state = StateWaiting;
+    }
+    // when called from within dispatch() the loop itself goes on with the next operation
+    if(m_state == StateWaiting && !m_dispatching) {
+        scheduleDispatch();
+    }
+}
+
+void QueueHandler::checkEmptyQueue() {
+    QMutexLocker locker(&m_queueMutex);
+    m_lastActivity = m_clock->now();
+    if( 0 == m_normalPriorityQueue.count() &&
+            0 == m_highPriorityQueue.count() &&
+            m_retries.isEmpty()) {
+        emit emptyQueue();
+    }
+}
+
+void QueueHandler::finishOperation(AbstractOperation* aOperation) {
+    trace(OperationTracer::EventFinished, aOperation);
+    if(shouldRetry(aOperation)) {
+        // the observer hears only about the last attempt
+        scheduleRetry(aOperation);
+    } else {
+        completeOperation(aOperation);
+    }
+}
+
+void QueueHandler::setDispatchTimeBudget(int aBudget) {
+    m_dispatchTimeBudget = aBudget;
+}
+
+void QueueHandler::setDefaultTimeout(int aTimeout) {
+    m_defaultTimeout = aTimeout;
+}
+
+int QueueHandler::defaultTimeout() const {
+    return m_defaultTimeout;
+}
+
+void QueueHandler::setManualDispatch(bool aManual) {
+    m_manualDispatch = aManual;
+}
+
+void QueueHandler::scheduleDispatch() {
+    if(!m_dispatchScheduled) {
+        m_dispatchScheduled = true;
+        if(!m_manualDispatch) {
+            QMetaObject::invokeMethod(this, "dispatch", Qt::QueuedConnection);
         }
+    }
+}
 
+void QueueHandler::dispatch() {
+    DEBUG_ENTER_FN();
+    Q_ASSERT(workerThreadCheck());
+    m_dispatchScheduled = false;
+    if(m_dispatching || m_state != StateWaiting) {
+        // an operation is still running (e.g. it spun a nested event loop)
+        return;
+    }
+    QElapsedTimer elapsed;
+    m_dispatching = true;
+    bool firstOperation = true;
+    while(m_state == StateWaiting) {
+        // wait only for the first operation, the following ones must be already there
+        // (never wait when driven manually, it would block the only thread, nor when
+        // a wake up is pending, its timer could not fire)
+        if(!onWaiting(firstOperation && !m_manualDispatch && m_wakeupAt < 0)) {
+            break;
+        }
+        if(firstOperation) {
+            // the time spent waiting for it is not spent running operations
+            elapsed.start();
+            firstOperation = false;
+        }
+        onProcessing();
+        // real time budgets are not deterministic, manual dispatch runs one operation per call
+        if(m_state == StateWaiting &&
+                (m_manualDispatch || elapsed.nsecsElapsed() / 1000 >= m_dispatchTimeBudget)) {
+            // the operation finished synchronously but we are out of time: yield to the event loop
+            scheduleDispatch();
+            break;
+        }
+    }
+    m_dispatching = false;
+    DEBUG_EXIT_FN();
+}
+
+bool QueueHandler::onWaiting(bool aBlock) {
+    DEBUG_ENTER_FN();
+    Q_ASSERT(workerThreadCheck());
+
+    if(aBlock) {
+        m_operationWait.acquire(1);
+    } else {
+        QMutexLocker locker(&m_queueMutex);
+        if(!m_operationWait.tryAcquire(1)) {
+            // nothing ready: go back to the event loop, operationAdded() or the
+            // wake up timer will call us back
+            m_waitingInEventLoop.fetchAndStoreOrdered(1);
+            return false;
+        }
+    }
+    if(getTerminateThread()) {
+        // we enter this ONLY after a call to terminateThread()
+        onExiting();
+        return false;
+    }
+    {
+        QMutexLocker locker(&m_mutex_currentOperation);
         AbstractOperation* nextOperation = 0;
+        qint64 throttledFor = -1;
         {
             QMutexLocker locker(&m_queueMutex);
-            nextOperation = dequeueOperation( m_highPriorityQueue );
+            nextOperation = dequeueOperation( m_highPriorityQueue, throttledFor );
             if(nextOperation == 0) {
                 // we haven't got a high priority operation
-                nextOperation = dequeueOperation( m_normalPriorityQueue );
-                if(nextOperation == 0) {
-                    // we haven't got a normal priority operation either!
-                    INCONSISTENT_STATE();
-                    emit operationNeeded();
-                }
+                nextOperation = dequeueOperation( m_normalPriorityQueue, throttledFor );
             }
+            if(nextOperation == 0 &&
+                    0 == m_normalPriorityQueue.count() &&
+                    0 == m_highPriorityQueue.count()) {
+                // nothing else to do
+                nextOperation = dequeueOperation( m_idlePriorityQueue, throttledFor );
+            }
+            if(nextOperation) {
+                dequeueBatch(nextOperation, m_currentBatch);
+            }
+            if(nextOperation == 0 && throttledFor >= 0) {
+                // everything queued is rate limited or waiting for its batch to fill up: give the
+                // permit back and sleep in the event loop, where the wake up timer and new arrivals can reach us
+                m_operationWait.release(1);
+                m_waitingInEventLoop.fetchAndStoreOrdered(1);
+            }
+        }
+        if(nextOperation == 0 && throttledFor >= 0) {
+            VERBOSE_TAG( CLASS_TAG(), "nothing can start yet, waking up in" << throttledFor << "msecs");
+            armWakeup(m_clock->now() + throttledFor);
+            return false;
+        }
+        if(nextOperation == 0) {
+            // the operation our permit was for has been cancelled in the meanwhile
+            DEBUG_TAG( CLASS_TAG(), "nothing to dequeue");
+            scheduleDispatch();
+            return false;
         }
         m_currentOperation = nextOperation;
+        m_epoch++;
         setCurrentOperationCanContinue(true);
-        emit operationRetrieved();
+        m_state = StateProcessing;
     }
     DEBUG_EXIT_FN();
+    return true;
 }
 
 void QueueHandler::onProcessing() {
     DEBUG_ENTER_FN();
     Q_ASSERT(workerThreadCheck());
     AbstractOperation* nextOperation = 0;
+    QList<AbstractOperation*> batch;
     {
         QMutexLocker locker(&m_mutex_currentOperation);
         nextOperation = m_currentOperation;
+        batch = m_currentBatch;
     }
-    if(nextOperation) {
+    m_executionStart = m_clock->now();
+    if(nextOperation && batch.isEmpty()) {
         DEBUG_TAG( CLASS_TAG(), "processing request ptr:" << HEX(nextOperation) << "id:" << nextOperation->id());
+        nextOperation->m_attempts++;
+        // once per execution, execute() calls started() again
+        trace(OperationTracer::EventStarted, nextOperation);
         nextOperation->started();
-        nextOperation->execute();
+        executeOperation(nextOperation);
+    } else if(nextOperation) {
+        DEBUG_TAG( CLASS_TAG(), "processing a batch of" << batch.count() << "requests, first ptr:" << HEX(nextOperation) << "id:" << nextOperation->id());
+        foreach(AbstractOperation* member, batch) {
+            member->m_attempts++;
+            member->setStatus(AbstractOperation::OperationRunning);
+            trace(OperationTracer::EventStarted, member);
+        }
+        nextOperation->started();
+        nextOperation->executeBatch(batch);
     } else {
         INCONSISTENT_STATE();
-        emit operationNeeded();
+        m_state = StateWaiting;
     }
     DEBUG_EXIT_FN();
 }
@@ -244,113 +844,309 @@ void QueueHandler::onProcessing() {
 void QueueHandler::onExiting() {
     DEBUG_ENTER_FN();
     Q_ASSERT(workerThreadCheck());
-    doCancelAllOperations();
-    emit exit();
+    m_state = StateExiting;
+    int epoch = -1;
+    {
+        QMutexLocker locker(&m_mutex_currentOperation);
+        QMutexLocker queueLocker(&m_queueMutex);
+        epoch = takeAllOperations();
+    }
+    doCancelAllOperations(epoch);
+    if(m_resultCache) {
+        // from now on the cache gives back the operations which joined from here itself
+        m_resultCache->detach(this);
+        deliverJoinedOperations();
+    }
+    m_state = StateExited;
+    deleteLater();
     DEBUG_EXIT_FN();
 }
 
-AbstractOperation* QueueHandler::dequeueOperation(OperationsQueue& aOperationQueue) {
+AbstractOperation* QueueHandler::dequeueOperation(OperationsQueue& aOperationQueue, qint64& aWaitTime) {
     AbstractOperation* result = 0;
     if( aOperationQueue.count() ) {
-        if( aOperationQueue.head() != KSENTINEL_OPERATION ) {
+        if( m_rateLimiter.isEmpty() && m_batchLinger == 0 ) {
             result = aOperationQueue.dequeue();
-            DEBUG_TAG( CLASS_TAG(), "dequeue a operation, ptr:" << HEX(result) << "id:" << result->id());
+        } else if( m_batchLinger == 0 ) {
+            RateLimitFilter filter(m_rateLimiter, m_clock->now());
+            result = aOperationQueue.dequeue(&filter);
+            if(!result && filter.waitTime() >= 0 &&
+                    (aWaitTime < 0 || filter.waitTime() < aWaitTime)) {
+                aWaitTime = filter.waitTime();
+            }
         } else {
-            INCONSISTENT_STATE();
+            qint64 now = m_clock->now();
+            RateLimitFilter rateLimitFilter(m_rateLimiter, now);
+            BatchLingerFilter filter(aOperationQueue, m_maxBatchSize, m_batchLinger, now,
+                                     m_rateLimiter.isEmpty() ? 0 : &rateLimitFilter);
+            result = aOperationQueue.dequeue(&filter);
+            if(!result && filter.waitTime() >= 0 &&
+                    (aWaitTime < 0 || filter.waitTime() < aWaitTime)) {
+                aWaitTime = filter.waitTime();
+            }
+        }
+        if(result) {
+            DEBUG_TAG( CLASS_TAG(), "dequeue a operation, ptr:" << HEX(result) << "id:" << result->id());
+            trace(OperationTracer::EventDequeued, result);
         }
     }
     return result;
 }
 
+void QueueHandler::dequeueBatch(AbstractOperation* aLeader, QList<AbstractOperation*>& aBatch) {
+    aBatch.clear();
+    QByteArray key = aLeader->batchKey();
+    if(key.isEmpty() || m_maxBatchSize < 2) {
+        return;
+    }
+    OperationsQueue& queue = queueFor(aLeader->m_priority);
+    RateLimitFilter rateLimitFilter(m_rateLimiter, m_clock->now());
+    QList<AbstractOperation*> members = queue.dequeueBatch(key, m_maxBatchSize - 1,
+                                                           m_rateLimiter.isEmpty() ? 0 : &rateLimitFilter);
+    aBatch.append(aLeader);
+    foreach(AbstractOperation* member, members) {
+        // every queued operation released a permit
+        m_operationWait.tryAcquire(1);
+        trace(OperationTracer::EventDequeued, member);
+        aBatch.append(member);
+    }
+    if(aBatch.count() == 1) {
+        aBatch.clear();
+    }
+}
+
+void QueueHandler::setCurrentStatus(AbstractOperation::OperationStatus aStatus, OperationTracer::EventType aEvent) {
+    if(m_currentBatch.isEmpty()) {
+        trace(aEvent, m_currentOperation);
+        m_currentOperation->setStatus(aStatus);
+    } else {
+        foreach(AbstractOperation* member, m_currentBatch) {
+            trace(aEvent, member);
+            member->setStatus(aStatus);
+        }
+    }
+}
+
+void QueueHandler::armWakeup(qint64 aTime) {
+    if(m_wakeupAt >= 0 && m_wakeupAt <= aTime) {
+        return;
+    }
+    if(m_wakeupTimerId != 0) {
+        killTimer(m_wakeupTimerId);
+        m_wakeupTimerId = 0;
+    }
+    m_wakeupAt = aTime;
+    if(!m_manualDispatch) {
+        m_wakeupTimerId = QObject::startTimer(qMax<int>(1, aTime - m_clock->now()));
+    }
+}
+
+void QueueHandler::wakeUp() {
+    VERBOSE_ENTER_FN();
+    Q_ASSERT(workerThreadCheck());
+    if(m_wakeupTimerId != 0) {
+        killTimer(m_wakeupTimerId);
+        m_wakeupTimerId = 0;
+    }
+    m_wakeupAt = -1;
+    qint64 nextRetry = requeueDueRetries();
+    // requeued operations replace their previous instances
+    flushDirectDeliveries();
+    m_waitingInEventLoop.fetchAndStoreOrdered(0);
+    if(nextRetry >= 0) {
+        armWakeup(nextRetry);
+    }
+    scheduleDispatch();
+    VERBOSE_EXIT_FN();
+}
+
+bool QueueHandler::shouldRetry(AbstractOperation* aOperation) {
+    const AbstractOperation::RetryPolicy& policy = aOperation->retryPolicy();
+    return !getTerminateThread() &&
+            aOperation->attemptCount() < policy.m_maxAttempts &&
+            policy.retriesOn(aOperation->status());
+}
+
+void QueueHandler::scheduleRetry(AbstractOperation* aOperation) {
+    int delay = aOperation->retryPolicy().backoff(aOperation->attemptCount(), randomSpread());
+    DEBUG_TAG( CLASS_TAG(), "attempt" << aOperation->attemptCount() << "of operation" << aOperation->id()
+               << "ended with status" << HEX(aOperation->status()) << ", retrying in" << delay << "msecs");
+    qint64 due = m_clock->now() + delay;
+    {
+        QMutexLocker locker(&m_queueMutex);
+        m_retries.insert(due, aOperation);
+    }
+    armWakeup(due);
+}
+
+double QueueHandler::randomSpread() {
+    // plain LCG, as the one of the SchedulingSimulator
+    m_randomState = m_randomState * 1103515245u + 12345u;
+    return 2.0 * ((m_randomState >> 16) & 0x7FFF) / 0x7FFF - 1.0;
+}
+
+qint64 QueueHandler::requeueDueRetries() {
+    QMutexLocker locker(&m_queueMutex);
+    qint64 now = m_clock->now();
+    while(!m_retries.isEmpty() && m_retries.begin().key() <= now) {
+        AbstractOperation* operation = m_retries.begin().value();
+        m_retries.erase(m_retries.begin());
+        addOperationToQueue(operation, queueFor(operation->m_priority));
+        m_operationWait.release(1);
+    }
+    return m_retries.isEmpty() ? -1 : m_retries.begin().key();
+}
+
+void QueueHandler::cancelRetry(int aId) {
+    QMultiMap<qint64, AbstractOperation*>::iterator retry = m_retries.begin();
+    while(retry != m_retries.end()) {
+        if(retry.value()->id() == aId) {
+            AbstractOperation* operation = retry.value();
+            m_retries.erase(retry);
+            cancelDelayedOperation(operation);
+            return;
+        }
+        ++retry;
+    }
+}
+
+void QueueHandler::cancelDelayedOperation(AbstractOperation* aOperation) {
+    trace(OperationTracer::EventCancelled, aOperation);
+    aOperation->setStatus(AbstractOperation::OperationCancelled);
+    completeOperation(aOperation);
+}
+
 
 void QueueHandler::startTimer(int aTimeoutInterval) {
     Q_ASSERT(workerThreadCheck());
     if(m_timerId != 0) {
         killTimer(m_timerId);
+        m_timerId = 0;
+    }
+    // started() again, e.g. by the leader of a batch after the other operations, does not
+    // push the deadline back
+    m_deadline = m_executionStart + aTimeoutInterval;
+    if(!m_manualDispatch) {
+        m_timerId = QObject::startTimer(qMax<qint64>(0, m_deadline - m_clock->now()));
     }
-    m_timerId = QObject::startTimer(aTimeoutInterval);
     VERBOSE_TAG( CLASS_TAG(), "started timer" << m_timerId << "with timeout" << aTimeoutInterval);
 }
 
 void QueueHandler::timerEvent(QTimerEvent * event) {
     Q_ASSERT(workerThreadCheck());
+    if(event && event->timerId() == m_wakeupTimerId) {
+        wakeUp();
+        return;
+    }
     WARNING_TAG( CLASS_TAG(), "timerEvent" << event->timerId());
     if(event &&
         (event->timerId() == m_timerId) &&
             m_currentOperation != 0) {
+        onTimeout();
+    }
+}
 
-        WARNING_TAG( CLASS_TAG(), "an operation timed out");
+void QueueHandler::onTimeout() {
+    WARNING_TAG( CLASS_TAG(), "an operation timed out");
+    if(m_timerId != 0) {
         killTimer(m_timerId);
-        // get rid of the operation which timeouted
-        {
-            QMutexLocker locker(&m_mutex_currentOperation);
-            if(AbstractOperation* operation = m_currentOperation) {
-                operation->setStatus(AbstractOperation::OperationTimedOut);
-                operation->cancel();
-            } else {
-                INCONSISTENT_STATE();
-            }
+        m_timerId = 0;
+    }
+    // get rid of the operation which timeouted
+    {
+        QMutexLocker locker(&m_mutex_currentOperation);
+        if(AbstractOperation* operation = m_currentOperation) {
+            setCurrentStatus(AbstractOperation::OperationTimedOut, OperationTracer::EventTimedOut);
+            abortOperation(operation);
+        } else {
+            INCONSISTENT_STATE();
         }
-        operationFinished();
     }
+    operationFinished();
 }
 
-void QueueHandler::fixCancelAllSemaphore() {
+//delivers the operations taken out of the queues by cancelAllOperations()
+//and stops the operation which was running then, if it still is
+void QueueHandler::doCancelAllOperations(int aEpoch) {
     DEBUG_ENTER_FN();
-    m_operationWait.release(1);
+    deliverCancelledOperations();
+
+    bool stopCurrent = false;
+    {
+        QMutexLocker locker(&m_mutex_currentOperation);
+        AbstractOperation* operation = m_currentOperation;
+        // an operation started after the cancellation has a newer epoch
+        if(operation && aEpoch >= 0 && m_epoch == aEpoch) {
+            setCurrentStatus(AbstractOperation::OperationCancelled, OperationTracer::EventCancelled);
+            abortOperation(operation);
+            stopCurrent = true;
+        }
+    }
+    if(stopCurrent) {
+        operationFinished();
+    } else {
+        checkEmptyQueue();
+    }
     DEBUG_EXIT_FN();
 }
 
-//deletes all operation and stops when a KSENTINEL_OPERATION is met
-//the sentinel operation is cancelled too
-void QueueHandler::doCancelAllOperations() {
+void QueueHandler::executeOperation(AbstractOperation* aOperation) {
+    aOperation->execute();
+}
+
+void QueueHandler::abortOperation(AbstractOperation* aOperation) {
+    aOperation->cancel();
+}
+
+void QueueHandler::endOperation(AbstractOperation* aOperation) {
     DEBUG_ENTER_FN();
-    {
-        QMutexLocker locker(&m_queueMutex);
-        while( (m_normalPriorityQueue.count() > 0) ) {
-            int opId = m_normalPriorityQueue.head();
-            removeOperationFromQueue( opId, m_normalPriorityQueue );
-            if(opId == KSENTINEL_OPERATION) {
+    if(aOperation && aOperation->observer()) {
+        trace(OperationTracer::EventDelivered, aOperation);
+        switch(aOperation->deliveryPolicy()) {
+        case AbstractOperation::DeliverDirect: {
+            // our mutexes may be locked now, and the observer may well call us back
+            QMutexLocker locker(&m_deliveryMutex);
+            m_directDeliveries.append(aOperation);
+            break;
+        }
+        case AbstractOperation::DeliverToCallbackThread:
+            if(m_callbackPool) {
+                CallbackDispatcher::deliverInPool(m_callbackPool, aOperation);
                 break;
             }
-        }
-        while( (m_highPriorityQueue.count() > 0) ) {
-            int opId = m_highPriorityQueue.head();
-            removeOperationFromQueue( opId, m_highPriorityQueue );
-            if(opId == KSENTINEL_OPERATION) {
+            if(m_callbackDispatcher) {
+                QMetaObject::invokeMethod(m_callbackDispatcher, "deliver", Qt::QueuedConnection, Q_ARG( void*, (void*) aOperation ));
                 break;
             }
+            // no callback thread: same as the observer thread
+        default:
+            CallbackDispatcher::invokeCallback(aOperation, Qt::AutoConnection);
+            break;
         }
     }
+    DEBUG_EXIT_FN();
+}
 
+void QueueHandler::flushDirectDeliveries() {
+    QList<AbstractOperation*> deliveries;
     {
-        QMutexLocker locker(&m_mutex_currentOperation);
-        AbstractOperation* operation = m_currentOperation;
-        if(operation) {
-            operation->setStatus(AbstractOperation::OperationCancelled);
-            operation->cancel();
-        }
-        setCancelAllOperations(false);
+        QMutexLocker locker(&m_deliveryMutex);
+        deliveries.swap(m_directDeliveries);
+    }
+    foreach(AbstractOperation* operation, deliveries) {
+        CallbackDispatcher::invokeCallback(operation, Qt::DirectConnection);
     }
-    operationFinished();
-    DEBUG_EXIT_FN();
 }
 
-void QueueHandler::endOperation(AbstractOperation* aOperation) {
-    DEBUG_ENTER_FN();
-    if(aOperation) {
-        QObject* observer = aOperation->observer();
-        QByteArray callbackMethodFullSig( aOperation->callbackMethod() );
-        int parenthesis = callbackMethodFullSig.indexOf("(");
-        QByteArray callbackMethod( callbackMethodFullSig.left(parenthesis) );
-
-        if(observer) {
-            if(false == QMetaObject::invokeMethod( observer, callbackMethod.data(), Qt::AutoConnection, Q_ARG( void*, (void*) aOperation ))) {
-                CRITICAL_TAG( CLASS_TAG(), "could not invoke" << callbackMethod.data() << "callback method for operation!");
-            }
+bool QueueHandler::postDirectDeliveries() {
+    {
+        QMutexLocker locker(&m_deliveryMutex);
+        if(m_directDeliveries.isEmpty()) {
+            return false;
         }
     }
-    DEBUG_EXIT_FN();
+    QMetaObject::invokeMethod(this, "flushDirectDeliveries", Qt::QueuedConnection);
+    return true;
 }
 
 bool QueueHandler::currentOperationCanContinue() {
@@ -359,6 +1155,13 @@ bool QueueHandler::currentOperationCanContinue() {
     {
         QMutexLocker locker(&m_mutex_currentOperation);
         result = m_currentOperationCanContinue;
+        if(result && m_currentOperation &&
+                m_currentOperation->m_priority == AbstractOperation::PriorityIdle) {
+            // make way as soon as there is real work
+            QMutexLocker queueLocker(&m_queueMutex);
+            result = 0 == m_normalPriorityQueue.count() &&
+                    0 == m_highPriorityQueue.count();
+        }
     }
     VERBOSE_EXIT_FN();
     return result;
@@ -370,16 +1173,19 @@ void QueueHandler::setCurrentOperationCanContinue(bool aCanContinue) {
     VERBOSE_EXIT_FN();
 }
 
-bool QueueHandler::getCancelAllOperations() {
-    VERBOSE_ENTER_FN();
-    VERBOSE_EXIT_FN();
-    return m_cancelAllOperations;
+bool QueueHandler::isCurrentOperation(AbstractOperation* aOperation) {
+    QMutexLocker locker(&m_mutex_currentOperation);
+    return m_currentOperation == aOperation;
 }
 
-void QueueHandler::setCancelAllOperations(bool aHasToCancelAll) {
-    DEBUG_ENTER_FN();
-    m_cancelAllOperations = aHasToCancelAll;
-    DEBUG_EXIT_FN();
+bool QueueHandler::isCurrentAttempt(AbstractOperation* aOperation, int aEpoch) {
+    QMutexLocker locker(&m_mutex_currentOperation);
+    return m_currentOperation == aOperation && (aEpoch < 0 || m_epoch == aEpoch);
+}
+
+int QueueHandler::currentEpoch() {
+    QMutexLocker locker(&m_mutex_currentOperation);
+    return m_epoch;
 }
 
 bool QueueHandler::workerThreadCheck() {
@@ -390,6 +1196,74 @@ bool QueueHandler::workerThreadCheck() {
     return result;
 }
 
+void QueueHandler::setTracer(OperationTracer* aTracer) {
+    m_tracer = aTracer;
+}
+
+OperationTracer* QueueHandler::tracer() const {
+    return m_tracer;
+}
+
+void QueueHandler::setClock(WorkerClock* aClock) {
+    m_clock = aClock ? aClock : WorkerClock::systemClock();
+    m_lastActivity = m_clock->now();
+}
+
+WorkerClock* QueueHandler::clock() const {
+    return m_clock;
+}
+
+int QueueHandler::workerId() const {
+    return m_workerId;
+}
+
+int QueueHandler::pendingOperationsCount() {
+    QMutexLocker locker(&m_queueMutex);
+    // the retries still waiting out their backoff can not run yet
+    qint64 now = m_clock->now();
+    int dueRetries = 0;
+    QMultiMap<qint64, AbstractOperation*>::const_iterator retry = m_retries.constBegin();
+    for(; retry != m_retries.constEnd() && retry.key() <= now; ++retry) {
+        dueRetries++;
+    }
+    return m_normalPriorityQueue.count() + m_highPriorityQueue.count() + dueRetries;
+}
+
+qint64 QueueHandler::oldestPendingWait() {
+    QMutexLocker locker(&m_queueMutex);
+    qint64 oldest = -1;
+    if(m_highPriorityQueue.count()) {
+        oldest = m_highPriorityQueue.operation(m_highPriorityQueue.head())->m_enqueueTime;
+    }
+    if(m_normalPriorityQueue.count()) {
+        qint64 normalOldest = m_normalPriorityQueue.operation(m_normalPriorityQueue.head())->m_enqueueTime;
+        if(oldest < 0 || normalOldest < oldest) {
+            oldest = normalOldest;
+        }
+    }
+    return oldest < 0 ? 0 : m_clock->now() - oldest;
+}
+
+qint64 QueueHandler::idleTime() {
+    QMutexLocker currentLocker(&m_mutex_currentOperation);
+    QMutexLocker queueLocker(&m_queueMutex);
+    if(m_currentOperation ||
+            m_normalPriorityQueue.count() ||
+            m_highPriorityQueue.count() ||
+            m_idlePriorityQueue.count() ||
+            !m_retries.isEmpty()) {
+        return -1;
+    }
+    return m_clock->now() - m_lastActivity;
+}
+
+inline void QueueHandler::trace(OperationTracer::EventType aType, AbstractOperation* aOperation) {
+    // the only cost when tracing is disabled
+    if(m_tracer && aOperation) {
+        m_tracer->record(aType, m_workerId, aOperation->id());
+    }
+}
+
 bool QueueHandler::getTerminateThread() {
     VERBOSE_ENTER_FN();
     VERBOSE_EXIT_FN();
@@ -411,6 +1285,8 @@ void QueueHandler::terminateThread() {
     }
     //fake an operation has come
     m_operationWait.release(1);
+    //a worker waiting in its event loop is not waiting on m_operationWait
+    QMetaObject::invokeMethod(this, "wakeUp", Qt::QueuedConnection);
     m_semaphore.acquire(1);
     DEBUG_EXIT_FN();
 }
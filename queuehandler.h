@@ -4,10 +4,26 @@
 #include <QObject>
 #include <QSemaphore>
 #include <QMutex>
-#include <QQueue>
 #include <QHash>
+#include <QMap>
+#include <QList>
+#include <QPair>
 
-class AbstractOperation;
+#include "operationsqueue.h"
+#include "operationtracer.h"
+#include "ratelimiter.h"
+#include "abstractoperation.h"
+
+class WorkerClock;
+class CallbackDispatcher;
+class ResultCache;
+class OperationJournal;
+class QThreadPool;
+
+// how long (in microseconds) the worker may run operations back to back before yielding
+const int KDefaultDispatchTimeBudget = 1000;
+// most operations executed by a single AbstractOperation::executeBatch() call
+const int KDefaultMaxBatchSize = 16;
 
 class QueueHandler : public QObject
 {
@@ -32,17 +48,33 @@ public:
       * Add a High Priority Request to the worker thread.
       */
     virtual void addHighPriorityOperation(AbstractOperation* aNewOperation);
+    /**
+      * Add an Idle Priority Request: it starts only when the other queues are empty
+      * and its canContinue() turns false as soon as they are not (see AbstractOperation::pause()).
+      */
+    virtual void addIdleOperation(AbstractOperation* aNewOperation);
 public:
     /**
-      * Cancels all the request which are currently in the queue.
+      * Cancels all the request which are currently in the queue (or waiting for a retry)
+      * and the one being executed. Operations added afterwards are not affected.
+      * Their callbacks are delivered from the worker thread.
       */
     void cancelAllOperations();
+    /**
+      * Cancel the queued operations tagged with @aTag (see AbstractOperation::addGroupTag()),
+      * in time proportional to their number, and tell the running one to stop if it is tagged.
+      */
+    void cancelGroup(const QByteArray& aTag);
     /**
       * Callback called from a AbstractOperation which just finished.
       * emits requestFinished().
       * aFinishedOperation is a pointer to the operation which just terminated.
       */
     void operationFinished();
+    /**
+      * Callback called from an idle priority AbstractOperation which made way for other work.
+      */
+    void operationPaused();
     /**
       * Tell the current operation to stop or not at the first occasion.
       */
@@ -65,91 +97,306 @@ public:
       */
     void terminateThread();
     /**
-      * Check whether we have to cancel all operations.
+      * Just a useful debug function to check whether we are in the worker thread.
       */
-    bool getCancelAllOperations();
+    bool workerThreadCheck();
     /**
-      * Tell to cancel all operations.
+      * Whether @aOperation is the one being executed.
       */
-    void setCancelAllOperations(bool aHasToCancelAll);
+    bool isCurrentOperation(AbstractOperation* aOperation);
     /**
-      * Just a useful debug function to check whether we are in the worker thread.
+      * Called by the ResultCache, from any thread, when the key @aOperation (added here) waited
+      * for is over: it has the outcome if @aResultReady, otherwise it has to run on its own.
       */
-    bool workerThreadCheck();
+    void handBackJoined(AbstractOperation* aOperation, bool aResultReady);
+    /**
+      * Whether @aOperation is being executed and that execution is the one of @aEpoch
+      * (see currentEpoch()), -1 matches any.
+      */
+    bool isCurrentAttempt(AbstractOperation* aOperation, int aEpoch);
+    /**
+      * Identifies the current execution, it changes each time an operation starts.
+      */
+    int currentEpoch();
+    /**
+      * Record the life cycle of the operations in @aTracer (not owned, it can be shared
+      * among several handlers). Pass 0 to disable tracing (the default).
+      * Set it before adding operations.
+      */
+    void setTracer(OperationTracer* aTracer);
+    OperationTracer* tracer() const;
+    /**
+      * Operations that finish within execute() are run back to back, without going
+      * through the event loop, until @aBudget microseconds have elapsed.
+      * 0 means one operation per event loop iteration.
+      */
+    void setDispatchTimeBudget(int aBudget);
+    /**
+      * Timeout (msecs) of the operations which do not pick one when they call started(),
+      * KDefaultTimeoutOperation by default.
+      */
+    void setDefaultTimeout(int aTimeout);
+    int defaultTimeout() const;
+    /**
+      * Let at most @aPerSecond operations with rate limit key @aKey start every second
+      * (with bursts of up to @aBurst). Operations over the limit stay queued and
+      * the ones behind them run in the meanwhile.
+      */
+    void setRateLimit(const QByteArray& aKey, double aPerSecond, int aBurst = 1);
+    void removeRateLimit(const QByteArray& aKey);
+    /**
+      * In fair share mode each tenant (see AbstractOperation::tenantKey()) gets its own
+      * sub-queue and the tenants take turns, so that one flooding the queue does not
+      * delay everybody else. Off by default (plain FIFO).
+      */
+    void setFairShare(bool aFairShare);
+    /**
+      * Give @aTenant @aWeight turns for each turn of a tenant with weight 1 (the default).
+      */
+    void setTenantWeight(quintptr aTenant, int aWeight);
+    /**
+      * Queue depth and throughput of each tenant (all priorities), fair share mode only.
+      */
+    QHash<quintptr, TenantStats> tenantStats();
+    /**
+      * Queued operations with the same batch key (see AbstractOperation::batchKey()) are
+      * executed together, up to @aMaxBatchSize at a time (1 disables batching).
+      * The oldest one of a batch which is not full waits up to @aLinger msecs for more
+      * to arrive before starting; 0 (the default) runs whatever is queued right away.
+      */
+    void setBatching(int aMaxBatchSize, int aLinger = 0);
+    /**
+      * Where the operations with the AbstractOperation::DeliverToCallbackThread policy get their
+      * callback: the thread @aThread or, if set, the pool @aPool (neither owned, 0 to unset).
+      * When neither is set they are delivered to the observer thread.
+      * Set them before adding operations.
+      */
+    void setCallbackThread(QThread* aThread);
+    void setCallbackPool(QThreadPool* aPool);
+    /**
+      * Look the operations with a cache key (see AbstractOperation::cacheKey()) up in @aCache
+      * (not owned, it can be shared among several handlers) when they are added: a hit is
+      * given back right away, without being queued, and an operation whose key is being
+      * computed waits for that execution. 0 (the default) disables caching.
+      * Set it before adding operations.
+      */
+    void setResultCache(ResultCache* aCache);
+    ResultCache* resultCache() const;
+    /**
+      * Keep the operations with a journal type (see AbstractOperation::journalType()) in
+      * @aJournal (not owned, it can be shared among several handlers) from when they are
+      * added until they are given back. 0 (the default) disables journaling.
+      * Set it before adding operations.
+      */
+    void setJournal(OperationJournal* aJournal);
+    OperationJournal* journal() const;
+    /**
+      * Time source for timeouts and waiting times (not owned), 0 restores the system clock.
+      * Set it before adding operations.
+      */
+    void setClock(WorkerClock* aClock);
+    WorkerClock* clock() const;
+    /**
+      * When manual, the handler never schedules itself nor waits for operations:
+      * someone else (see SchedulingSimulator) calls dispatch() and fires the timeouts.
+      */
+    void setManualDispatch(bool aManual);
+    /**
+      * A small number identifying this handler (and its worker) in the traces.
+      */
+    int workerId() const;
+    /**
+      * Number of operations waiting in the queues (or for a retry which is due), idle priority
+      * ones excluded.
+      */
+    int pendingOperationsCount();
+    /**
+      * How long (in msecs) the oldest operation in the queues has been waiting, 0 if none.
+      * Idle priority operations are not counted, they are expected to wait.
+      */
+    qint64 oldestPendingWait();
+    /**
+      * How long (in msecs) the handler has been without anything to do, -1 if it is busy.
+      */
+    qint64 idleTime();
 signals:
-    void operationRetrieved();
-    void operationNeeded();
-    void cleanUpAndExit();
-    void exit();
+    /**
+      * Nothing left but (possibly) idle priority operations.
+      */
     void emptyQueue();
 private slots:
     /**
-      * Function called when we enter the _waiting_ state.
+      * The worker loop: takes operations from the queues and executes them.
+      * Scheduled (queued) whenever the handler goes back to the _waiting_ state.
       */
-    void onWaiting();
+    void dispatch();
     /**
-      * Function called when we enter the _processing_ state.
+      * Stop waiting in the event loop: a rate limited operation may now start, a retry is due
+      * or a new operation arrived.
       */
-    void onProcessing();
+    void wakeUp();
     /**
-      * Function called when we enter the _exiting_ state.
+      * Deliver what cancelAllOperations() took out of the queues and stop the current
+      * operation if it is still the execution number @aEpoch.
       */
-    void onExiting();
+    void doCancelAllOperations(int aEpoch);
     /**
-      * Process the first item in the queue if
-      * - there isn't another operation currently being processed
-      * - there queue is not empty
+      * Give the operations cancelled by cancelGroup() back to their observers.
       */
-    void doCancelAllOperations();
+    void deliverCancelledOperations();
     /**
       * Cancel a Request if it has not started yet
       */
     void doCancelOperation(int aOperationId);
+    /**
+      * Deliver the operations handed back by handBackJoined(), or queue them if they have to run.
+      */
+    void deliverJoinedOperations();
 protected:
+    /**
+      * Run the current operation (not a batch), after it has been started(). By default execute().
+      * When it is done operationFinished() must be called, as AbstractOperation::finished() does.
+      */
+    virtual void executeOperation(AbstractOperation* aOperation);
+    /**
+      * The current operation timed out or all the operations have been cancelled:
+      * it must stop. By default AbstractOperation::cancel().
+      */
+    virtual void abortOperation(AbstractOperation* aOperation);
+    /**
+      * Give @aOperation to its observer as its delivery policy says. The DeliverDirect ones
+      * are held back until flushDirectDeliveries(), since our mutexes may be locked now.
+      */
     virtual void endOperation(AbstractOperation* aOperation);
+    /**
+      * Call the DeliverDirect callbacks held back by endOperation(), with no mutex of ours locked.
+      * Only from the worker thread, when nobody up the stack holds a mutex either.
+      */
+    Q_INVOKABLE void flushDirectDeliveries();
+    /**
+      * Have flushDirectDeliveries() called from the event loop of the worker thread, for
+      * callers which may run with mutexes of their own locked (e.g. WorkerThread::addOperation()).
+      * Returns false if there is nothing to deliver.
+      */
+    bool postDirectDeliveries();
 private:
-    struct OperationsQueue {
-        QQueue<int> m_queue;
-        QHash<int, AbstractOperation*> m_hash;
-
-        inline bool contains(int aId) {
-            return m_queue.contains(aId);
-        }
-
-        inline int count() {
-            return m_queue.count();
-        }
-
-        inline int head() {
-            return m_queue.head();
-        }
-
-        inline void add(int aId, AbstractOperation* aOp) {
-            m_queue.enqueue(aId);
-            m_hash.insert(aId, aOp);
-        }
-        inline AbstractOperation* remove(int aId) {
-            m_queue.removeOne(aId);
-            return m_hash.take(aId);
-        }
-        inline AbstractOperation* dequeue() {
-            AbstractOperation* result = 0;
-            if(!m_queue.isEmpty()) {
-                int headId = m_queue.dequeue();
-                return m_hash.take(headId);
-            }
-            return result;
-        }
-        inline void enqueue(int aId, AbstractOperation* aOp) {
-            m_queue.enqueue(aId);
-            m_hash.insert(aId, aOp);
-        }
-    };
+    /**
+      * Add @aNewOperation with @aPriority, unless the result cache takes care of it.
+      */
+    void enqueue(AbstractOperation* aNewOperation, AbstractOperation::PriorityClass aPriority);
+    /**
+      * Give @aOperation (and the ones which were waiting for its result) back to the observer.
+      */
+    void completeOperation(AbstractOperation* aOperation);
+    /**
+      * Journal @aOperation if it has a journal type and it is not journaled yet.
+      */
+    void journalOperation(AbstractOperation* aOperation);
+    /**
+      * @aOperation is over: remove it from the journal, unless it has been cancelled
+      * because the thread is terminating (it is replayed at the next start).
+      */
+    void unjournalOperation(AbstractOperation* aOperation);
     void addOperationToQueue(AbstractOperation* aNewOperation, OperationsQueue& aOperationQueue);
+    OperationsQueue& queueFor(AbstractOperation::PriorityClass aPriority);
     void removeOperationFromQueue(int aId, OperationsQueue& aOperationQueue);
-    AbstractOperation* dequeueOperation(OperationsQueue& aOperationQueue);
-    //bool checkForSentinelOperations();
-    void fixCancelAllSemaphore();
+    /**
+      * Dequeue the first operation allowed to run by the rate limits.
+      * If there are only rate limited ones, @aWaitTime is lowered to when the first could start.
+      */
+    AbstractOperation* dequeueOperation(OperationsQueue& aOperationQueue, qint64& aWaitTime);
+    /**
+      * Dequeue the operations to execute together with @aLeader, which is added first.
+      * @aBatch is left empty if there are none.
+      */
+    void dequeueBatch(AbstractOperation* aLeader, QList<AbstractOperation*>& aBatch);
+    /**
+      * Set the status of the current operation (of its whole batch), with m_mutex_currentOperation locked.
+      */
+    void setCurrentStatus(AbstractOperation::OperationStatus aStatus, OperationTracer::EventType aEvent);
+    /**
+      * Retry the operation or give it back to its observer.
+      */
+    void finishOperation(AbstractOperation* aOperation);
+    /**
+      * Have wakeUp() called at clock time @aTime (unless it is already due earlier).
+      */
+    void armWakeup(qint64 aTime);
+    /**
+      * Whether the operation which just finished has to run again (see AbstractOperation::RetryPolicy).
+      */
+    bool shouldRetry(AbstractOperation* aOperation);
+    /**
+      * Put the operation aside until its backoff delay is over.
+      */
+    void scheduleRetry(AbstractOperation* aOperation);
+    /**
+      * A random number in [-1, 1] for the jitter of the retries.
+      */
+    double randomSpread();
+    /**
+      * Queue again the operations whose backoff delay is over.
+      * Returns when the next one is due, -1 if none is left.
+      */
+    qint64 requeueDueRetries();
+    /**
+      * Cancel the operation @aId if it is waiting for its retry, with m_queueMutex locked.
+      */
+    void cancelRetry(int aId);
+    void cancelDelayedOperation(AbstractOperation* aOperation);
+    /**
+      * Take every queued operation (and retry) out and stop the current one.
+      * Returns the epoch of the current execution, -1 if there is none.
+      * Must be called with both mutexes locked.
+      */
+    int takeAllOperations();
+    /**
+      * Mark a removed operation as cancelled, it is delivered by deliverCancelledOperations().
+      * Must be called with m_queueMutex locked.
+      */
+    void cancelLater(AbstractOperation* aOperation);
+    /**
+      * Make sure the worker gets back to its event loop to run a delivery just posted to it.
+      */
+    void releaseForDelivery();
+    /**
+      * Emit emptyQueue() if there is nothing left to do.
+      */
+    void checkEmptyQueue();
+    /**
+      * The current operation is over: go back to the _waiting_ state.
+      */
+    void backToWaiting();
+    /**
+      * Called when an operation is added, with m_queueMutex locked.
+      */
+    void operationAdded();
+    enum DispatchState
+    {
+        StateWaiting,
+        StateProcessing,
+        StateExiting,
+        StateExited
+    };
+    void scheduleDispatch();
+    /**
+      * _waiting_ state: retrieve the next operation (blocking if @aBlock).
+      * Returns false if there is nothing to process now.
+      */
+    bool onWaiting(bool aBlock);
+    /**
+      * _processing_ state: start the current operation.
+      */
+    void onProcessing();
+    /**
+      * _exiting_ state: cancel everything and delete the handler.
+      */
+    void onExiting();
+    /**
+      * The current operation took too long: cancel it.
+      */
+    void onTimeout();
+    inline void trace(OperationTracer::EventType aType, AbstractOperation* aOperation);
 protected:
     QThread* m_mainThread;
     QThread* m_workerThread;
@@ -160,20 +407,78 @@ private:
     QSemaphore m_operationWait;
     // mutex to control access to the request queues
     QMutex m_queueMutex;
+    // protects m_directDeliveries and m_joinedOperations only, nothing else is locked while holding it
+    QMutex m_deliveryMutex;
+    // DeliverDirect operations waiting for the mutexes to be released
+    QList<AbstractOperation*> m_directDeliveries;
+    // operations handed back by the ResultCache, with whether they have their outcome
+    QList< QPair<AbstractOperation*, bool> > m_joinedOperations;
     // mutex to control access to the current operation
     QMutex m_mutex_currentOperation;
     bool m_currentOperationCanContinue;
     bool m_exitThread;
-    bool m_cancelAllOperations;
 
     //the operation queues
     OperationsQueue m_normalPriorityQueue;
     OperationsQueue m_highPriorityQueue;
+    OperationsQueue m_idlePriorityQueue;
 
     //the current operation being executed
     AbstractOperation* m_currentOperation;
+    //when executing a batch, all its operations (m_currentOperation first), empty otherwise
+    QList<AbstractOperation*> m_currentBatch;
     //the timer Id checking on the lifespan of the operation
     int m_timerId;
+    //incremented each time an operation starts, tells cancelAllOperations() whether
+    //the operation it has to stop is still the current one
+    int m_epoch;
+    //cancelled operations not yet delivered, protected by m_queueMutex
+    QList<AbstractOperation*> m_cancelledOperations;
+
+    OperationTracer* m_tracer;
+    int m_workerId;
+    WorkerClock* m_clock;
+    //last time an operation was added or finished, used to measure idleness
+    qint64 m_lastActivity;
+
+    //dispatch loop state, only used in the worker thread
+    DispatchState m_state;
+    bool m_dispatchScheduled;
+    bool m_dispatching;
+    int m_dispatchTimeBudget;
+    int m_defaultTimeout;
+    bool m_manualDispatch;
+    //when the current operation times out (clock time), -1 if none
+    qint64 m_deadline;
+    //when the current execution started (clock time), timeouts count from there
+    qint64 m_executionStart;
+
+    //delivery of the DeliverToCallbackThread operations, the dispatcher is owned
+    CallbackDispatcher* m_callbackDispatcher;
+    QThreadPool* m_callbackPool;
+    //not owned
+    ResultCache* m_resultCache;
+    //not owned
+    OperationJournal* m_journal;
+
+    //batching settings, protected by m_queueMutex
+    int m_maxBatchSize;
+    int m_batchLinger;
+
+    //token buckets of the rate limited operations, protected by m_queueMutex
+    RateLimiter m_rateLimiter;
+    //set (with m_queueMutex locked) when the worker waits in its event loop instead of
+    //on m_operationWait: nothing is queued but a wake up is pending, or everything is rate limited
+    QAtomicInt m_waitingInEventLoop;
+    int m_wakeupTimerId;
+    //when the handler wakes up (clock time), -1 if no wake up is pending
+    qint64 m_wakeupAt;
+    //operations waiting for their backoff delay, by due time, protected by m_queueMutex
+    QMultiMap<qint64, AbstractOperation*> m_retries;
+    //state of the retry jitter sequence, seeded per handler, only used in the worker thread
+    quint32 m_randomState;
+
+    friend class SchedulingSimulator;
 };
 
 #endif // QUEUEHANDLER_H
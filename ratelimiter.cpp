@@ -0,0 +1,53 @@
+#include "ratelimiter.h"
+
+#include <qmath.h>
+
+RateLimiter::RateLimiter()
+{
+}
+
+void RateLimiter::setRate(const QByteArray& aKey, double aRatePerSecond, int aBurst, qint64 aNow) {
+    TokenBucket bucket;
+    bucket.m_ratePerMsec = aRatePerSecond / 1000.0;
+    bucket.m_capacity = qMax(1, aBurst);
+    bucket.m_tokens = bucket.m_capacity;
+    bucket.m_lastRefill = aNow;
+    m_buckets.insert(aKey, bucket);
+}
+
+void RateLimiter::removeRate(const QByteArray& aKey) {
+    m_buckets.remove(aKey);
+}
+
+bool RateLimiter::isEmpty() const {
+    return m_buckets.isEmpty();
+}
+
+bool RateLimiter::tryAcquire(const QByteArray& aKey, qint64 aNow) {
+    QHash<QByteArray, TokenBucket>::iterator bucket = m_buckets.find(aKey);
+    if(bucket == m_buckets.end()) {
+        return true;
+    }
+    bucket->refill(aNow);
+    if(bucket->m_tokens >= 1.0) {
+        bucket->m_tokens -= 1.0;
+        return true;
+    }
+    return false;
+}
+
+qint64 RateLimiter::waitTime(const QByteArray& aKey, qint64 aNow) {
+    QHash<QByteArray, TokenBucket>::iterator bucket = m_buckets.find(aKey);
+    if(bucket == m_buckets.end()) {
+        return 0;
+    }
+    bucket->refill(aNow);
+    if(bucket->m_tokens >= 1.0) {
+        return 0;
+    }
+    if(bucket->m_ratePerMsec <= 0) {
+        // no refill at all: check again in a while
+        return 1000;
+    }
+    return qMax<qint64>(1, qCeil((1.0 - bucket->m_tokens) / bucket->m_ratePerMsec));
+}
@@ -0,0 +1,45 @@
+#ifndef RATELIMITER_H
+#define RATELIMITER_H
+
+#include <QByteArray>
+#include <QHash>
+
+/**
+  * A token bucket per key: @ratePerSecond tokens are added every second,
+  * up to @burst, and each operation with that key consumes one.
+  * Not thread safe, the QueueHandler uses it under its queue mutex.
+  */
+class RateLimiter
+{
+public:
+    RateLimiter();
+public:
+    void setRate(const QByteArray& aKey, double aRatePerSecond, int aBurst, qint64 aNow);
+    void removeRate(const QByteArray& aKey);
+    bool isEmpty() const;
+    /**
+      * Consume a token of @aKey if there is one. Keys without a rate never run out.
+      */
+    bool tryAcquire(const QByteArray& aKey, qint64 aNow);
+    /**
+      * Msecs until @aKey gets a token (0 if it has one already).
+      */
+    qint64 waitTime(const QByteArray& aKey, qint64 aNow);
+private:
+    struct TokenBucket {
+        double m_ratePerMsec;
+        double m_capacity;
+        double m_tokens;
+        qint64 m_lastRefill;
+
+        inline void refill(qint64 aNow) {
+            if(aNow > m_lastRefill) {
+                m_tokens = qMin(m_capacity, m_tokens + (aNow - m_lastRefill) * m_ratePerMsec);
+                m_lastRefill = aNow;
+            }
+        }
+    };
+    QHash<QByteArray, TokenBucket> m_buckets;
+};
+
+#endif // RATELIMITER_H
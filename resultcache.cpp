@@ -0,0 +1,188 @@
+#include "resultcache.h"
+#include "abstractoperation.h"
+#include "queuehandler.h"
+#include "callbackdispatcher.h"
+#include "workerclock.h"
+
+#include <QMutexLocker>
+
+#include "activelogs.h"
+#ifdef RESULT_CACHE
+    #define ENABLE_LOG_MACROS
+#endif
+#include "workerlog.h"
+WORKER_LOG_CATEGORY("ResultCache");
+
+ResultCache::ResultCache(int aMaxCost, int aTimeToLive) :
+        m_entries(aMaxCost),
+        m_timeToLive(aTimeToLive),
+        m_clock(WorkerClock::systemClock())
+{
+}
+
+ResultCache::~ResultCache() {
+    if(!m_running.isEmpty()) {
+        WARNING("deleted while" << m_running.count() << "keys are being computed");
+    }
+}
+
+void ResultCache::setMaxCost(int aMaxCost) {
+    QMutexLocker locker(&m_mutex);
+    m_entries.setMaxCost(aMaxCost);
+}
+
+int ResultCache::maxCost() {
+    QMutexLocker locker(&m_mutex);
+    return m_entries.maxCost();
+}
+
+void ResultCache::setTimeToLive(int aTimeToLive) {
+    QMutexLocker locker(&m_mutex);
+    m_timeToLive = aTimeToLive;
+}
+
+void ResultCache::setClock(WorkerClock* aClock) {
+    QMutexLocker locker(&m_mutex);
+    m_clock = aClock ? aClock : WorkerClock::systemClock();
+}
+
+void ResultCache::attach(QueueHandler* aHandler) {
+    QMutexLocker locker(&m_mutex);
+    m_handlers.insert(aHandler);
+}
+
+void ResultCache::detach(QueueHandler* aHandler) {
+    QMutexLocker locker(&m_mutex);
+    m_handlers.remove(aHandler);
+}
+
+ResultCache::LookupResult ResultCache::lookup(AbstractOperation* aOperation, QueueHandler* aHandler) {
+    QByteArray key = aOperation->cacheKey();
+    QMutexLocker locker(&m_mutex);
+    AbstractOperation* running = m_running.value(key);
+    if(running == aOperation) {
+        // added again while queued or running: it is just queued again, it can not wait for itself
+        DEBUG("operation" << aOperation->id() << "is already computing its key");
+        return LookupMiss;
+    }
+    if(Entry* entry = m_entries.object(key)) {
+        if(entry->m_expiresAt > m_clock->now()) {
+            DEBUG("hit, operation" << aOperation->id());
+            aOperation->setResultFromCache(entry->m_result);
+            aOperation->setStatus(AbstractOperation::OperationSuccess);
+            return LookupHit;
+        }
+        m_entries.remove(key);
+    }
+    if(running) {
+        DEBUG("operation" << aOperation->id() << "joins operation" << running->id());
+        m_joined[key].append(qMakePair(aOperation, aHandler));
+        return LookupJoined;
+    }
+    m_running.insert(key, aOperation);
+    return LookupMiss;
+}
+
+void ResultCache::complete(AbstractOperation* aOperation) {
+    QByteArray key = aOperation->cacheKey();
+    QMutexLocker locker(&m_mutex);
+    if(m_running.value(key) != aOperation) {
+        // it did not go through lookup() (e.g. the cache was set later)
+        return;
+    }
+    m_running.remove(key);
+    QList<JoinedOperation> joined = m_joined.take(key);
+    AbstractOperation::OperationStatus status = aOperation->status();
+    bool resultReady = status != AbstractOperation::OperationCancelled;
+    QVariant value;
+    if(status == AbstractOperation::OperationSuccess) {
+        value = aOperation->resultForCache();
+        Entry* entry = new Entry;
+        entry->m_result = value;
+        entry->m_expiresAt = m_clock->now() + m_timeToLive;
+        // QCache deletes the entry if it costs more than the whole cache
+        m_entries.insert(key, entry, aOperation->cacheCost());
+    }
+    foreach(const JoinedOperation& operation, joined) {
+        if(resultReady) {
+            if(status == AbstractOperation::OperationSuccess) {
+                operation.first->setResultFromCache(value);
+            }
+            // custom code included
+            operation.first->m_status = aOperation->m_status;
+        }
+        // under our mutex: a handler can not go away in the meanwhile
+        if(m_handlers.contains(operation.second)) {
+            operation.second->handBackJoined(operation.first, resultReady);
+        } else {
+            giveBack(operation.first, resultReady);
+        }
+    }
+}
+
+AbstractOperation* ResultCache::takeJoined(int aId, QueueHandler* aHandler) {
+    QMutexLocker locker(&m_mutex);
+    QHash<QByteArray, QList<JoinedOperation> >::iterator key = m_joined.begin();
+    for(; key != m_joined.end(); ++key) {
+        QList<JoinedOperation>& joined = key.value();
+        for(int i = 0; i < joined.count(); ++i) {
+            if(joined.at(i).second == aHandler && joined.at(i).first->id() == aId) {
+                AbstractOperation* operation = joined.takeAt(i).first;
+                if(joined.isEmpty()) {
+                    m_joined.erase(key);
+                }
+                return operation;
+            }
+        }
+    }
+    return 0;
+}
+
+QList<AbstractOperation*> ResultCache::takeJoined(QueueHandler* aHandler, const QByteArray& aTag) {
+    QList<AbstractOperation*> result;
+    QMutexLocker locker(&m_mutex);
+    QHash<QByteArray, QList<JoinedOperation> >::iterator key = m_joined.begin();
+    while(key != m_joined.end()) {
+        QList<JoinedOperation>& joined = key.value();
+        for(int i = joined.count() - 1; i >= 0; --i) {
+            if(joined.at(i).second == aHandler &&
+                    (aTag.isEmpty() || joined.at(i).first->hasGroupTag(aTag))) {
+                result.prepend(joined.takeAt(i).first);
+            }
+        }
+        if(joined.isEmpty()) {
+            key = m_joined.erase(key);
+        } else {
+            ++key;
+        }
+    }
+    return result;
+}
+
+void ResultCache::giveBack(AbstractOperation* aOperation, bool aResultReady) {
+    WARNING("the handler of operation" << aOperation->id() << "is gone");
+    if(!aResultReady) {
+        // nobody can run it any more
+        aOperation->setStatus(AbstractOperation::OperationCancelled);
+    }
+    if(aOperation->observer()) {
+        CallbackDispatcher::invokeCallback(aOperation, Qt::QueuedConnection);
+    } else {
+        aOperation->cleanThreadSpecificResources();
+    }
+}
+
+void ResultCache::invalidate(const QByteArray& aKey) {
+    QMutexLocker locker(&m_mutex);
+    m_entries.remove(aKey);
+}
+
+void ResultCache::clear() {
+    QMutexLocker locker(&m_mutex);
+    m_entries.clear();
+}
+
+int ResultCache::count() {
+    QMutexLocker locker(&m_mutex);
+    return m_entries.count();
+}
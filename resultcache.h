@@ -0,0 +1,108 @@
+#ifndef RESULTCACHE_H
+#define RESULTCACHE_H
+
+#include <QByteArray>
+#include <QCache>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QPair>
+#include <QSet>
+#include <QVariant>
+
+class AbstractOperation;
+class QueueHandler;
+class WorkerClock;
+
+// total cost of the results kept by default (see AbstractOperation::cacheCost())
+const int KDefaultResultCacheCost = 1000;
+// how long (in msecs) a result stays valid by default
+const int KDefaultResultCacheTimeToLive = 60 * 1000;
+
+/**
+  * Results of the operations with a cache key (see AbstractOperation::cacheKey()), shared by
+  * the QueueHandlers it is set to. The least recently used results are evicted when their
+  * total cost goes over the maximum, the others when they get older than the time to live.
+  * It also remembers which key is being computed: the operations asking for it in the
+  * meanwhile wait for that execution instead of running again.
+  * Thread safe.
+  */
+class ResultCache
+{
+public:
+    enum LookupResult
+    {
+        // not cached nor being computed: the operation must run (and it will complete())
+        LookupMiss,
+        // the cached result has been given to the operation, it is OperationSuccess
+        LookupHit,
+        // the same key is being computed: the operation is given back by complete()
+        LookupJoined
+    };
+public:
+    ResultCache(int aMaxCost = KDefaultResultCacheCost, int aTimeToLive = KDefaultResultCacheTimeToLive);
+    ~ResultCache();
+public:
+    void setMaxCost(int aMaxCost);
+    int maxCost();
+    /**
+      * Msecs a result is valid for, results already cached keep their expiry time.
+      */
+    void setTimeToLive(int aTimeToLive);
+    /**
+      * Time source of the expiry times (not owned), 0 restores the system clock.
+      */
+    void setClock(WorkerClock* aClock);
+    /**
+      * The handlers using the cache, set by QueueHandler::setResultCache(). A handler going away
+      * detaches itself, the operations which joined from it are then given back by the cache.
+      */
+    void attach(QueueHandler* aHandler);
+    void detach(QueueHandler* aHandler);
+    /**
+      * Look @aOperation up, @aHandler is where it has been added. The operation computing
+      * its key, added again while queued or running, gets LookupMiss.
+      */
+    LookupResult lookup(AbstractOperation* aOperation, QueueHandler* aHandler);
+    /**
+      * @aOperation, which got LookupMiss, is over: cache its result if it succeeded and give
+      * the operations which joined it the same outcome (unless it has been cancelled, then
+      * they are left as they are and must run on their own). Each of them is handed back to
+      * the handler it was added to (see QueueHandler::handBackJoined()); when that one is gone
+      * it is given to its observer from here, cancelled if it had to run.
+      */
+    void complete(AbstractOperation* aOperation);
+    /**
+      * Take back the joined operation @aId added to @aHandler, 0 if there is none.
+      */
+    AbstractOperation* takeJoined(int aId, QueueHandler* aHandler);
+    /**
+      * Take back the joined operations added to @aHandler (only the ones in the group @aTag, if not empty).
+      */
+    QList<AbstractOperation*> takeJoined(QueueHandler* aHandler, const QByteArray& aTag = QByteArray());
+    void invalidate(const QByteArray& aKey);
+    void clear();
+    /**
+      * Number of results cached, the expired ones not yet evicted included.
+      */
+    int count();
+private:
+    struct Entry {
+        QVariant m_result;
+        qint64 m_expiresAt;
+    };
+    typedef QPair<AbstractOperation*, QueueHandler*> JoinedOperation;
+    // a joined operation whose handler is gone, called with m_mutex locked
+    void giveBack(AbstractOperation* aOperation, bool aResultReady);
+
+    QMutex m_mutex;
+    QSet<QueueHandler*> m_handlers;
+    QCache<QByteArray, Entry> m_entries;
+    // the operation computing each key and the ones waiting for it
+    QHash<QByteArray, AbstractOperation*> m_running;
+    QHash<QByteArray, QList<JoinedOperation> > m_joined;
+    int m_timeToLive;
+    WorkerClock* m_clock;
+};
+
+#endif // RESULTCACHE_H
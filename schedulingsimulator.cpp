@@ -0,0 +1,457 @@
+#include "schedulingsimulator.h"
+#include "queuehandler.h"
+#include "abstractoperation.h"
+
+#include <QCoreApplication>
+#include <QEvent>
+#include <QThread>
+#include <QtAlgorithms>
+
+#include "activelogs.h"
+#ifdef SCHEDULING_SIMULATOR
+    #define ENABLE_LOG_MACROS
+#endif
+#include "workerlog.h"
+WORKER_LOG_CATEGORY("SchedulingSimulator");
+
+class SimulatedOperation : public AbstractOperation
+{
+public:
+    SimulatedOperation(QObject* aObserver, const SimulatedArrival& aArrival, WorkerClock& aClock) :
+            AbstractOperation(aObserver, SLOT(operationDone(void*))),
+            m_arrival(aArrival),
+            m_clock(aClock),
+            m_startedAt(-1)
+    {
+        if(!m_arrival.m_groupTag.isEmpty()) {
+            addGroupTag(m_arrival.m_groupTag);
+        }
+        if(m_arrival.m_maxAttempts > 1) {
+            RetryPolicy policy;
+            policy.m_maxAttempts = m_arrival.m_maxAttempts;
+            // deterministic delays
+            policy.m_jitter = 0;
+            setRetryPolicy(policy);
+        }
+    }
+public: // from AbstractOperation
+    void execute() {
+        m_batch.clear();
+        start();
+    }
+    QByteArray batchKey() const {
+        return m_arrival.m_batchKey;
+    }
+protected: // from AbstractOperation
+    void executeBatch(const QList<AbstractOperation*>& aBatch) {
+        m_batch = aBatch;
+        start();
+    }
+public:
+    void complete() {
+        if(!m_batch.isEmpty()) {
+            // the ones cancelled in the meanwhile keep their status
+            foreach(AbstractOperation* member, m_batch) {
+                if(member->status() == OperationRunning) {
+                    static_cast<SimulatedOperation*>(member)->conclude();
+                }
+            }
+        } else if(canContinue()) {
+            conclude();
+        } else if(priorityClass() == PriorityIdle) {
+            // other work arrived (or it has been cancelled, then it is the same as finished())
+            pause();
+            return;
+        }
+        // a cancelled operation keeps its status, as a well behaved one would
+        finished();
+    }
+    qint64 completesAt() const {
+        return m_startedAt + m_arrival.m_duration;
+    }
+    const SimulatedArrival& arrival() const {
+        return m_arrival;
+    }
+    qint64 startedAt() const {
+        return m_startedAt;
+    }
+private:
+    void start() {
+        m_startedAt = m_clock.now();
+        foreach(AbstractOperation* member, m_batch) {
+            static_cast<SimulatedOperation*>(member)->m_startedAt = m_startedAt;
+        }
+        if(m_arrival.m_timeout >= 0) {
+            started(m_arrival.m_timeout);
+        }
+        if(m_arrival.m_duration <= 0) {
+            complete();
+        }
+    }
+    void conclude() {
+        if(attemptCount() <= m_arrival.m_failures) {
+            failed();
+        } else {
+            success();
+        }
+    }
+private:
+    SimulatedArrival m_arrival;
+    WorkerClock& m_clock;
+    qint64 m_startedAt;
+    // when leading a batch, all its operations
+    QList<AbstractOperation*> m_batch;
+};
+
+namespace {
+    bool arrivalLessThan(const SimulatedArrival& aFirst, const SimulatedArrival& aSecond) {
+        return aFirst.m_time < aSecond.m_time;
+    }
+
+    const int KFuzzMaxDuration = 50;
+    const int KFuzzMaxTimeout = 60;
+    const int KFuzzMaxClockStep = 40;
+    const int KFuzzMaxFailures = 3;
+    const int KFuzzMaxAttempts = 3;
+    const int KFuzzBatchKeys = 2;
+    const int KFuzzGroups = 3;
+    const int KFuzzMaxBatchSize = 4;
+}
+
+SchedulingSimulator::SchedulingSimulator(QObject* aParent) :
+        QObject(aParent),
+        m_queueHandler(0),
+        m_randomState(1),
+        m_idleViolation(-1)
+{
+}
+
+SchedulingSimulator::~SchedulingSimulator() {
+    clear();
+}
+
+QueueHandler* SchedulingSimulator::queueHandler() {
+    ensureQueueHandler();
+    return m_queueHandler;
+}
+
+VirtualWorkerClock& SchedulingSimulator::clock() {
+    return m_clock;
+}
+
+QueueHandler* SchedulingSimulator::createQueueHandler() {
+    return new QueueHandler(m_semaphore, QThread::currentThread(), QThread::currentThread());
+}
+
+void SchedulingSimulator::ensureQueueHandler() {
+    if(!m_queueHandler) {
+        m_queueHandler = createQueueHandler();
+        m_queueHandler->setClock(&m_clock);
+        m_queueHandler->setManualDispatch(true);
+        // the same retry jitter on every run
+        m_queueHandler->m_randomState = 1;
+    }
+}
+
+void SchedulingSimulator::replay(const QList<SimulatedArrival>& aArrivals) {
+    DEBUG_ENTER_FN();
+    ensureQueueHandler();
+    QList<SimulatedArrival> arrivals = aArrivals;
+    qStableSort(arrivals.begin(), arrivals.end(), arrivalLessThan);
+    int next = 0;
+    settle();
+    forever {
+        qint64 nextTime = -1;
+        if(next < arrivals.count()) {
+            nextTime = qMax(m_clock.now(), arrivals.at(next).m_time);
+        }
+        if(!advanceRunning(nextTime)) {
+            if(nextTime < 0) {
+                // nothing running and nothing left to arrive
+                break;
+            }
+            m_clock.setTime(nextTime);
+        }
+        while(next < arrivals.count() && arrivals.at(next).m_time <= m_clock.now()) {
+            add(arrivals.at(next));
+            ++next;
+        }
+        settle();
+    }
+    DEBUG_EXIT_FN();
+}
+
+QList<SimulatedResult> SchedulingSimulator::results() const {
+    return m_results;
+}
+
+QList<qint64> SchedulingSimulator::latencies() const {
+    QList<qint64> result;
+    foreach(const SimulatedResult& simulated, m_results) {
+        result.append(simulated.m_end - simulated.m_arrival);
+    }
+    qSort(result);
+    return result;
+}
+
+bool SchedulingSimulator::fuzz(quint32 aSeed, int aSteps) {
+    DEBUG_ENTER_FN();
+    clear();
+    ensureQueueHandler();
+    m_randomState = aSeed ? aSeed : 1;
+    m_queueHandler->setBatching((random() % 2) ? KFuzzMaxBatchSize : 1);
+    for(int step = 0; step < aSteps; ++step) {
+        switch(random() % 9) {
+        case 0:
+        case 1:
+        case 2:
+        case 3: {
+            SimulatedArrival arrival;
+            arrival.m_time = m_clock.now();
+            arrival.m_duration = random() % KFuzzMaxDuration;
+            arrival.m_timeout = random() % KFuzzMaxTimeout;
+            int priority = random() % 8;
+            arrival.m_highPriority = priority < 2;
+            arrival.m_idlePriority = priority == 2;
+            arrival.m_failures = random() % KFuzzMaxFailures;
+            arrival.m_maxAttempts = 1 + random() % KFuzzMaxAttempts;
+            if(random() % 3 == 0) {
+                arrival.m_batchKey = "batch" + QByteArray::number(random() % KFuzzBatchKeys);
+            }
+            arrival.m_groupTag = "group" + QByteArray::number(random() % KFuzzGroups);
+            arrival.m_tag = step;
+            add(arrival);
+            } break;
+        case 4: {
+            if(!m_operations.isEmpty()) {
+                int index = random() % m_operations.count();
+                m_queueHandler->doCancelOperation(m_operations.at(index)->id());
+            }
+            } break;
+        case 5: {
+            m_queueHandler->cancelAllOperations();
+            } break;
+        case 6: {
+            m_queueHandler->cancelGroup("group" + QByteArray::number(random() % KFuzzGroups));
+            } break;
+        default: {
+            qint64 target = m_clock.now() + random() % KFuzzMaxClockStep;
+            while(advanceRunning(target) && m_clock.now() < target) {
+                settle();
+            }
+            if(m_clock.now() < target) {
+                m_clock.setTime(target);
+            }
+            } break;
+        }
+        settle();
+    }
+    // let everything still queued run to completion
+    replay(QList<SimulatedArrival>());
+
+    m_lastError.clear();
+    foreach(SimulatedOperation* operation, m_operations) {
+        int callbacks = m_callbacks.value(operation->id());
+        int maxAttempts = qMax(1, operation->arrival().m_maxAttempts);
+        if(callbacks != 1) {
+            m_lastError = QString("seed %1: operation %2 got %3 callbacks")
+                    .arg(aSeed).arg(operation->arrival().m_tag).arg(callbacks);
+        } else if(operation->attemptCount() > maxAttempts) {
+            m_lastError = QString("seed %1: operation %2 ran %3 times, %4 at most")
+                    .arg(aSeed).arg(operation->arrival().m_tag).arg(operation->attemptCount()).arg(maxAttempts);
+        } else if(operation->status() == AbstractOperation::OperationSuccess &&
+                operation->attemptCount() <= operation->arrival().m_failures) {
+            m_lastError = QString("seed %1: operation %2 succeeded at attempt %3")
+                    .arg(aSeed).arg(operation->arrival().m_tag).arg(operation->attemptCount());
+        } else if(operation->status() == AbstractOperation::OperationFailed &&
+                operation->attemptCount() > operation->arrival().m_failures) {
+            m_lastError = QString("seed %1: operation %2 failed at attempt %3")
+                    .arg(aSeed).arg(operation->arrival().m_tag).arg(operation->attemptCount());
+        } else if((operation->status() == AbstractOperation::OperationFailed ||
+                operation->status() == AbstractOperation::OperationTimedOut) &&
+                operation->attemptCount() != maxAttempts) {
+            // timed out attempts are retried as well
+            m_lastError = QString("seed %1: operation %2 gave up after %3 of %4 attempts")
+                    .arg(aSeed).arg(operation->arrival().m_tag).arg(operation->attemptCount()).arg(maxAttempts);
+        }
+        if(!m_lastError.isEmpty()) {
+            break;
+        }
+    }
+    if(m_lastError.isEmpty() && m_idleViolation >= 0) {
+        m_lastError = QString("seed %1: idle operation %2 started while other work was queued")
+                .arg(aSeed).arg(m_idleViolation);
+    }
+    // every queue, idle priority and retries included
+    int leftover = m_queueHandler->m_highPriorityQueue.count() +
+            m_queueHandler->m_normalPriorityQueue.count() +
+            m_queueHandler->m_idlePriorityQueue.count() +
+            m_queueHandler->m_retries.count();
+    if(m_lastError.isEmpty() && leftover != 0) {
+        m_lastError = QString("seed %1: %2 operations left in the queues")
+                .arg(aSeed).arg(leftover);
+    }
+    if(!m_lastError.isEmpty()) {
+        WARNING(m_lastError);
+    }
+    DEBUG_EXIT_FN();
+    return m_lastError.isEmpty();
+}
+
+QString SchedulingSimulator::lastError() const {
+    return m_lastError;
+}
+
+QList<SimulatedArrival> SchedulingSimulator::arrivalsFromTrace(const QVector<OperationTracer::Event>& aEvents) {
+    QList<SimulatedArrival> result;
+    // operation id -> index in result of its latest arrival
+    QHash<int, int> open;
+    QHash<int, qint64> startedAt;
+    // time run before being paused
+    QHash<int, qint64> ranFor;
+    qint64 origin = aEvents.isEmpty() ? 0 : aEvents.first().m_timestamp;
+    foreach(const OperationTracer::Event& event, aEvents) {
+        switch(event.m_type) {
+        case OperationTracer::EventEnqueued: {
+            SimulatedArrival arrival;
+            arrival.m_time = (event.m_timestamp - origin) / 1000;
+            arrival.m_tag = event.m_operationId;
+            open.insert(event.m_operationId, result.count());
+            startedAt.remove(event.m_operationId);
+            ranFor.remove(event.m_operationId);
+            result.append(arrival);
+            } break;
+        case OperationTracer::EventStarted:
+            startedAt.insert(event.m_operationId, event.m_timestamp);
+            break;
+        case OperationTracer::EventPaused:
+            if(startedAt.contains(event.m_operationId)) {
+                ranFor[event.m_operationId] += event.m_timestamp - startedAt.take(event.m_operationId);
+            }
+            break;
+        case OperationTracer::EventFinished: {
+            if(open.contains(event.m_operationId) && startedAt.contains(event.m_operationId)) {
+                qint64 duration = ranFor.take(event.m_operationId) + event.m_timestamp - startedAt.value(event.m_operationId);
+                result[open.take(event.m_operationId)].m_duration = duration / 1000;
+            }
+            } break;
+        default:
+            break;
+        }
+    }
+    return result;
+}
+
+void SchedulingSimulator::operationDone(void* aOperation) {
+    AbstractOperation* operation = reinterpret_cast<AbstractOperation*>(aOperation);
+    SimulatedOperation* simulated = static_cast<SimulatedOperation*>(operation);
+    m_callbacks[simulated->id()] += 1;
+
+    SimulatedResult result;
+    result.m_tag = simulated->arrival().m_tag;
+    result.m_arrival = simulated->arrival().m_time;
+    result.m_start = simulated->startedAt();
+    result.m_end = m_clock.now();
+    result.m_status = simulated->status();
+    result.m_attempts = simulated->attemptCount();
+    m_results.append(result);
+}
+
+void SchedulingSimulator::add(const SimulatedArrival& aArrival) {
+    SimulatedOperation* operation = new SimulatedOperation(this, aArrival, m_clock);
+    m_operations.append(operation);
+    if(aArrival.m_highPriority) {
+        m_queueHandler->addHighPriorityOperation(operation);
+    } else if(aArrival.m_idlePriority) {
+        m_queueHandler->addIdleOperation(operation);
+    } else {
+        m_queueHandler->addOperation(operation);
+    }
+}
+
+void SchedulingSimulator::settle() {
+    bool progress = true;
+    while(progress) {
+        progress = false;
+        // queued invocations (e.g. doCancelAllOperations) in posting order
+        QCoreApplication::sendPostedEvents(m_queueHandler, QEvent::MetaCall);
+        if(m_queueHandler->m_wakeupAt >= 0 && m_queueHandler->m_wakeupAt <= m_clock.now()) {
+            m_queueHandler->wakeUp();
+            progress = true;
+        }
+        if(m_queueHandler->m_dispatchScheduled) {
+            int epoch = m_queueHandler->m_epoch;
+            int permits = m_queueHandler->m_operationWait.available();
+            m_queueHandler->dispatch();
+            // a dispatch which neither started anything nor took a permit would just
+            // schedule itself again: that is no progress, waiting here would never end
+            if(m_queueHandler->m_epoch != epoch) {
+                progress = true;
+                checkIdleStart();
+            } else if(m_queueHandler->m_operationWait.available() != permits) {
+                progress = true;
+            }
+        }
+        if(AbstractOperation* current = m_queueHandler->m_currentOperation) {
+            SimulatedOperation* operation = static_cast<SimulatedOperation*>(current);
+            qint64 deadline = m_queueHandler->m_deadline;
+            if(deadline >= 0 && deadline <= m_clock.now() && deadline < operation->completesAt()) {
+                m_queueHandler->onTimeout();
+                progress = true;
+            } else if(operation->completesAt() <= m_clock.now()) {
+                operation->complete();
+                progress = true;
+            }
+        }
+    }
+}
+
+bool SchedulingSimulator::advanceRunning(qint64 aLimit) {
+    qint64 next = -1;
+    if(AbstractOperation* current = m_queueHandler->m_currentOperation) {
+        SimulatedOperation* operation = static_cast<SimulatedOperation*>(current);
+        next = operation->completesAt();
+        if(m_queueHandler->m_deadline >= 0 && m_queueHandler->m_deadline < next) {
+            next = m_queueHandler->m_deadline;
+        }
+    }
+    // a rate limited handler waiting for its tokens or an operation waiting for its retry
+    if(m_queueHandler->m_wakeupAt >= 0 && (next < 0 || m_queueHandler->m_wakeupAt < next)) {
+        next = m_queueHandler->m_wakeupAt;
+    }
+    if(next < 0) {
+        return false;
+    }
+    if(aLimit >= 0 && aLimit < next) {
+        next = aLimit;
+    }
+    if(next > m_clock.now()) {
+        m_clock.setTime(next);
+    }
+    return true;
+}
+
+quint32 SchedulingSimulator::random() {
+    // plain LCG: qrand() is shared with the rest of the application
+    m_randomState = m_randomState * 1103515245u + 12345u;
+    return (m_randomState >> 16) & 0x7FFF;
+}
+
+void SchedulingSimulator::clear() {
+    // the handler goes first, it still references the queued operations
+    delete m_queueHandler;
+    m_queueHandler = 0;
+    qDeleteAll(m_operations);
+    m_operations.clear();
+    m_callbacks.clear();
+    m_results.clear();
+    m_idleViolation = -1;
+}
+
+void SchedulingSimulator::checkIdleStart() {
+    AbstractOperation* current = m_queueHandler->m_currentOperation;
+    if(current && current->priorityClass() == AbstractOperation::PriorityIdle && m_idleViolation < 0 &&
+            (m_queueHandler->m_normalPriorityQueue.count() || m_queueHandler->m_highPriorityQueue.count())) {
+        m_idleViolation = static_cast<SimulatedOperation*>(current)->arrival().m_tag;
+    }
+}
@@ -0,0 +1,141 @@
+#ifndef SCHEDULINGSIMULATOR_H
+#define SCHEDULINGSIMULATOR_H
+
+#include <QObject>
+#include <QSemaphore>
+#include <QList>
+#include <QHash>
+#include <QVector>
+#include <QString>
+#include <QByteArray>
+
+#include "workerclock.h"
+#include "operationtracer.h"
+
+class QueueHandler;
+class SimulatedOperation;
+
+/**
+  * An operation arriving at the queue at a given (virtual) time.
+  */
+struct SimulatedArrival {
+    SimulatedArrival() : m_time(0), m_duration(0), m_timeout(-1), m_highPriority(false), m_idlePriority(false),
+            m_failures(0), m_maxAttempts(1), m_tag(0) {}
+    // when it is added to the queue
+    qint64 m_time;
+    // how long its execution lasts once started
+    int m_duration;
+    // timeout passed to started(), -1 for the default one
+    int m_timeout;
+    bool m_highPriority;
+    // added with addIdleOperation(), it pauses when it completes while other work is queued
+    bool m_idlePriority;
+    // executions which fail before one succeeds...
+    int m_failures;
+    // ...out of these many at most (retried without jitter, see AbstractOperation::RetryPolicy)
+    int m_maxAttempts;
+    // queued arrivals with the same non empty key run together (see QueueHandler::setBatching)
+    QByteArray m_batchKey;
+    // see QueueHandler::cancelGroup(), empty for none
+    QByteArray m_groupTag;
+    // free for the caller to match the results with the arrivals
+    int m_tag;
+};
+
+/**
+  * What happened to a SimulatedArrival.
+  */
+struct SimulatedResult {
+    SimulatedResult() : m_tag(0), m_arrival(0), m_start(-1), m_end(-1), m_status(0), m_attempts(0) {}
+    int m_tag;
+    qint64 m_arrival;
+    // -1 if it never started
+    qint64 m_start;
+    qint64 m_end;
+    // AbstractOperation::OperationStatus
+    int m_status;
+    int m_attempts;
+};
+
+/**
+  * Deterministic, single threaded execution of a QueueHandler on a virtual clock.
+  * Nothing really runs: each operation "executes" for its m_duration of virtual time.
+  * The same input always produces the same results, so scheduling policies and
+  * latency distributions can be compared offline and the races between adds,
+  * cancels and timeouts can be fuzzed.
+  */
+class SchedulingSimulator : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SchedulingSimulator(QObject* aParent = 0);
+    ~SchedulingSimulator();
+public:
+    /**
+      * The handler being simulated, configure it before replaying.
+      */
+    QueueHandler* queueHandler();
+    VirtualWorkerClock& clock();
+    /**
+      * Run @aArrivals (in any order) until every operation has completed.
+      * Results are appended to results().
+      */
+    void replay(const QList<SimulatedArrival>& aArrivals);
+    QList<SimulatedResult> results() const;
+    /**
+      * Completion minus arrival time of the results, sorted.
+      */
+    QList<qint64> latencies() const;
+    /**
+      * Random interleaving of additions (with retries, batch keys, idle priority and groups),
+      * cancellations, group cancellations, cancel all and timeouts driven by @aSeed.
+      * Returns false (see lastError()) if an operation got no callback, more than one,
+      * ran more times than its retry policy allows, ended with a status its attempts do not
+      * explain, if an idle priority one started while other work was queued or the handler
+      * was left with queued operations.
+      */
+    bool fuzz(quint32 aSeed, int aSteps);
+    QString lastError() const;
+    /**
+      * Rebuild the arrivals from the events recorded by an OperationTracer.
+      * Timeouts are not part of the trace, the default one is used.
+      */
+    static QList<SimulatedArrival> arrivalsFromTrace(const QVector<OperationTracer::Event>& aEvents);
+public slots:
+    void operationDone(void* aOperation);
+protected:
+    //override this method to simulate your own queue handler
+    virtual QueueHandler* createQueueHandler();
+private:
+    void ensureQueueHandler();
+    void add(const SimulatedArrival& aArrival);
+    /**
+      * Run everything which is due at the current time, without moving the clock.
+      */
+    void settle();
+    /**
+      * Move the clock to the next completion, timeout or wake up (rate limit or retry)
+      * (or @aLimit if earlier). Returns false if nothing is pending.
+      */
+    bool advanceRunning(qint64 aLimit);
+    quint32 random();
+    void clear();
+    /**
+      * An operation has just been started: note it if it is an idle priority one
+      * while other work is waiting.
+      */
+    void checkIdleStart();
+private:
+    QSemaphore m_semaphore;
+    VirtualWorkerClock m_clock;
+    QueueHandler* m_queueHandler;
+    QList<SimulatedOperation*> m_operations;
+    QHash<int, int> m_callbacks;
+    QList<SimulatedResult> m_results;
+    quint32 m_randomState;
+    QString m_lastError;
+    // tag of an idle priority operation started while other work was queued, -1 if none
+    int m_idleViolation;
+};
+
+#endif // SCHEDULINGSIMULATOR_H
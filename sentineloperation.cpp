@@ -1,15 +0,0 @@
-#include "sentineloperation.h"
-#include "abstractoperationobserver.h"
-
-SentinelOperation::SentinelOperation() : AbstractOperation()
-{
-}
-
-void SentinelOperation::execute()
-{
-}
-
-int SentinelOperation::id() const
-{
-    return KSENTINEL_OPERATION;
-};
@@ -0,0 +1,6 @@
+#ifndef ACTIVELOGS_H
+#define ACTIVELOGS_H
+
+// the tests run with every log category compiled out
+
+#endif // ACTIVELOGS_H
@@ -0,0 +1,14 @@
+QT += testlib
+QT -= gui
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+# started with --helper it is its own helper process
+TARGET = tst_processqueuehandler
+
+include(../../workerthread.pri)
+
+# activelogs.h of the tests: no log output
+INCLUDEPATH += $$PWD/..
+
+SOURCES += tst_processqueuehandler.cpp
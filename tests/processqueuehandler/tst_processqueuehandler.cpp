@@ -0,0 +1,298 @@
+#include <QtTest>
+#include <QCoreApplication>
+#include <QDataStream>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QtEndian>
+#include <cstdlib>
+
+#include "processchannel.h"
+#include "processhelper.h"
+#include "processworkerthread.h"
+#include "abstractoperation.h"
+
+namespace {
+    // the test program is its own helper when started with it
+    const char* const KHelperSwitch = "--helper";
+    const QByteArray KOperationType = "test";
+    const int KWaitTimeout = 10000;
+    const int KOperationTimeout = 1000;
+    // the highest worker id tried when looking for the server of the handler
+    const int KMaxWorkerId = 64;
+
+    /**
+      * Runs in the helper process: doubles its value, crashes the helper or outlasts its timeout.
+      */
+    class TestOperation : public AbstractOperation
+    {
+    public:
+        enum Action
+        {
+            ActionDouble,
+            ActionCrash,
+            ActionSlow
+        };
+    public:
+        TestOperation(Action aAction, int aValue, QObject* aObserver = 0, const char* aSlot = 0) :
+                AbstractOperation(aObserver, aSlot),
+                m_action(aAction),
+                m_value(aValue),
+                m_result(0)
+        {
+        }
+        static AbstractOperation* create(const QByteArray& aData, QObject* aObserver, const char* aSlot) {
+            QDataStream stream(aData);
+            stream.setVersion(KProcessChannelStreamVersion);
+            qint32 action = 0;
+            qint32 value = 0;
+            stream >> action >> value;
+            return new TestOperation((Action)action, value, aObserver, aSlot);
+        }
+    public: // from AbstractOperation
+        void execute() {
+            started();
+            switch(m_action) {
+            case ActionCrash:
+                abort();
+                break;
+            case ActionSlow: {
+                // the result comes after the timeout, if the helper is still there to send it
+                QMutex mutex;
+                QWaitCondition never;
+                mutex.lock();
+                never.wait(&mutex, 2 * KOperationTimeout);
+                mutex.unlock();
+                }
+                // then as ActionDouble
+            default:
+                m_result = 2 * m_value;
+                success();
+                break;
+            }
+            finished();
+        }
+        QByteArray journalType() const {
+            return KOperationType;
+        }
+        QByteArray serialize() const {
+            QByteArray data;
+            QDataStream stream(&data, QIODevice::WriteOnly);
+            stream.setVersion(KProcessChannelStreamVersion);
+            stream << (qint32)m_action << (qint32)m_value;
+            return data;
+        }
+        QVariant resultForCache() const {
+            return m_result;
+        }
+        void setResultFromCache(const QVariant& aResult) {
+            m_result = aResult.toInt();
+        }
+    public:
+        int result() const {
+            return m_result;
+        }
+    private:
+        Action m_action;
+        int m_value;
+        int m_result;
+    };
+
+    QByteArray frame(const QByteArray& aMessage) {
+        uchar length[sizeof(quint32)];
+        qToBigEndian<quint32>(aMessage.size(), length);
+        return QByteArray(reinterpret_cast<const char*>(length), sizeof(length)) + aMessage;
+    }
+}
+
+class TestProcessQueueHandler : public QObject
+{
+    Q_OBJECT
+public:
+    TestProcessQueueHandler() : m_worker(0) {}
+public slots:
+    void operationDone(void* aOperation);
+private slots:
+    void cleanup();
+    void channelFraming();
+    void execute();
+    void helperCrash();
+    void lateResultAfterTimeout();
+    void foreignConnection();
+private:
+    ProcessWorkerThread* startWorker();
+    TestOperation* addOperation(TestOperation::Action aAction, int aValue);
+    bool waitForCallbacks(int aCount);
+private:
+    ProcessWorkerThread* m_worker;
+    QList<TestOperation*> m_done;
+};
+
+void TestProcessQueueHandler::operationDone(void* aOperation) {
+    m_done.append(reinterpret_cast<TestOperation*>(aOperation));
+}
+
+void TestProcessQueueHandler::cleanup() {
+    if(m_worker) {
+        m_worker->terminateThread();
+        delete m_worker;
+        m_worker = 0;
+    }
+    qDeleteAll(m_done);
+    m_done.clear();
+}
+
+ProcessWorkerThread* TestProcessQueueHandler::startWorker() {
+    m_worker = new ProcessWorkerThread(QCoreApplication::applicationFilePath(), QStringList() << KHelperSwitch);
+    m_worker->setDefaultTimeout(KOperationTimeout);
+    m_worker->startThread();
+    return m_worker;
+}
+
+TestOperation* TestProcessQueueHandler::addOperation(TestOperation::Action aAction, int aValue) {
+    TestOperation* operation = new TestOperation(aAction, aValue, this, SLOT(operationDone(void*)));
+    m_worker->addOperation(operation);
+    return operation;
+}
+
+bool TestProcessQueueHandler::waitForCallbacks(int aCount) {
+    QElapsedTimer elapsed;
+    elapsed.start();
+    while(m_done.count() < aCount && elapsed.elapsed() < KWaitTimeout) {
+        QTest::qWait(10);
+    }
+    return m_done.count() == aCount;
+}
+
+// messages of any size, back to back or arriving in pieces, come out whole and in order
+void TestProcessQueueHandler::channelFraming() {
+    QLocalServer server;
+    QString serverName = QString("tst_processchannel-%1").arg(QCoreApplication::applicationPid());
+    QLocalServer::removeServer(serverName);
+    QVERIFY(server.listen(serverName));
+    QLocalSocket* client = new QLocalSocket();
+    client->connectToServer(serverName);
+    QVERIFY(client->waitForConnected(KWaitTimeout));
+    QVERIFY(server.waitForNewConnection(KWaitTimeout));
+    ProcessChannel receiver(server.nextPendingConnection());
+    QSignalSpy received(&receiver, SIGNAL(messageReceived(QByteArray)));
+
+    QList<QByteArray> messages;
+    messages << QByteArray() << QByteArray("a") << QByteArray(100000, 'x') << QByteArray("last");
+    QByteArray all;
+    foreach(const QByteArray& message, messages) {
+        all += frame(message);
+    }
+    // the length prefix and the first message split across writes
+    client->write(all.left(2));
+    client->flush();
+    QTest::qWait(50);
+    QCOMPARE(received.count(), 0);
+    client->write(all.mid(2));
+    client->flush();
+    QElapsedTimer elapsed;
+    elapsed.start();
+    while(received.count() < messages.count() && elapsed.elapsed() < KWaitTimeout) {
+        QTest::qWait(10);
+    }
+    QCOMPARE(received.count(), messages.count());
+    for(int i = 0; i < messages.count(); ++i) {
+        QCOMPARE(received.at(i).at(0).toByteArray(), messages.at(i));
+    }
+
+    // and the other way round, through send()
+    ProcessChannel clientChannel(client);
+    QSignalSpy echoed(&clientChannel, SIGNAL(messageReceived(QByteArray)));
+    receiver.send("pong");
+    elapsed.restart();
+    while(echoed.count() < 1 && elapsed.elapsed() < KWaitTimeout) {
+        QTest::qWait(10);
+    }
+    QCOMPARE(echoed.count(), 1);
+    QCOMPARE(echoed.at(0).at(0).toByteArray(), QByteArray("pong"));
+}
+
+void TestProcessQueueHandler::execute() {
+    startWorker();
+    addOperation(TestOperation::ActionDouble, 21);
+    QVERIFY(waitForCallbacks(1));
+    QCOMPARE(m_done.at(0)->status(), (int)AbstractOperation::OperationSuccess);
+    QCOMPARE(m_done.at(0)->result(), 42);
+}
+
+// the operation the helper dies with fails, the next one runs in a new helper
+void TestProcessQueueHandler::helperCrash() {
+    startWorker();
+    TestOperation* crashing = addOperation(TestOperation::ActionCrash, 0);
+    TestOperation* next = addOperation(TestOperation::ActionDouble, 5);
+    QVERIFY(waitForCallbacks(2));
+    QCOMPARE(m_done.at(0), crashing);
+    QCOMPARE(crashing->status(), (int)AbstractOperation::OperationFailed);
+    QCOMPARE(m_done.at(1), next);
+    QCOMPARE(next->status(), (int)AbstractOperation::OperationSuccess);
+    QCOMPARE(next->result(), 10);
+}
+
+// a timed out operation is given back once; whatever its helper still sends is not
+// taken for the result of the next request
+void TestProcessQueueHandler::lateResultAfterTimeout() {
+    startWorker();
+    TestOperation* slow = addOperation(TestOperation::ActionSlow, 1);
+    TestOperation* next = addOperation(TestOperation::ActionDouble, 7);
+    QVERIFY(waitForCallbacks(2));
+    QCOMPARE(m_done.at(0), slow);
+    QCOMPARE(slow->status(), (int)AbstractOperation::OperationTimedOut);
+    QCOMPARE(m_done.at(1), next);
+    QCOMPARE(next->status(), (int)AbstractOperation::OperationSuccess);
+    QCOMPARE(next->result(), 14);
+    // nothing late turns up
+    QTest::qWait(2 * KOperationTimeout);
+    QCOMPARE(m_done.count(), 2);
+}
+
+// another process connecting to the server of the handler gets nothing and changes nothing
+void TestProcessQueueHandler::foreignConnection() {
+    startWorker();
+    QList<QLocalSocket*> intruders;
+    QByteArray hello;
+    QDataStream stream(&hello, QIODevice::WriteOnly);
+    stream.setVersion(KProcessChannelStreamVersion);
+    stream << (quint8)ProcessChannel::MessageHello << QByteArray("forged");
+    for(int workerId = 1; workerId <= KMaxWorkerId; ++workerId) {
+        QLocalSocket* intruder = new QLocalSocket(this);
+        intruder->connectToServer(QString("workerthread-%1-%2").arg(QCoreApplication::applicationPid()).arg(workerId));
+        if(intruder->waitForConnected(100)) {
+            intruder->write(frame(hello));
+            intruder->flush();
+            intruders.append(intruder);
+        } else {
+            delete intruder;
+        }
+    }
+    QVERIFY(!intruders.isEmpty());
+    addOperation(TestOperation::ActionDouble, 4);
+    QVERIFY(waitForCallbacks(1));
+    QCOMPARE(m_done.at(0)->status(), (int)AbstractOperation::OperationSuccess);
+    QCOMPARE(m_done.at(0)->result(), 8);
+    foreach(QLocalSocket* intruder, intruders) {
+        QCOMPARE(intruder->bytesAvailable(), qint64(0));
+    }
+    qDeleteAll(intruders);
+}
+
+int main(int argc, char** argv) {
+    QCoreApplication app(argc, argv);
+    if(argc > 2 && qstrcmp(argv[1], KHelperSwitch) == 0) {
+        ProcessHelper helper;
+        helper.registerType(KOperationType, &TestOperation::create);
+        if(!helper.connectToHandler(app.arguments().last())) {
+            return 1;
+        }
+        return app.exec();
+    }
+    TestProcessQueueHandler test;
+    return QTest::qExec(&test, argc, argv);
+}
+
+#include "tst_processqueuehandler.moc"
@@ -0,0 +1,13 @@
+QT += testlib
+QT -= gui
+CONFIG += console testcase
+CONFIG -= app_bundle
+
+TARGET = tst_resultcache
+
+include(../../workerthread.pri)
+
+# activelogs.h of the tests: no log output
+INCLUDEPATH += $$PWD/..
+
+SOURCES += tst_resultcache.cpp
@@ -0,0 +1,305 @@
+#include <QtTest>
+#include <QCoreApplication>
+#include <QSet>
+#include <QTimer>
+
+#include "workerthread.h"
+#include "resultcache.h"
+#include "workerclock.h"
+#include "abstractoperation.h"
+
+namespace {
+    const QByteArray KCacheKey = "key";
+    const int KWaitTimeout = 10000;
+    // how often a held operation checks whether it has been released
+    const int KPollInterval = 5;
+    const int KTimeToLive = 100;
+}
+
+class TestOperation;
+
+/**
+  * Lives in the worker thread and finishes a held operation there once it is released.
+  */
+class Finisher : public QObject
+{
+    Q_OBJECT
+public:
+    explicit Finisher(TestOperation* aOperation);
+private slots:
+    void poll();
+private:
+    TestOperation* m_operation;
+};
+
+/**
+  * Doubles its value. A held one stays running, with the worker free, until release().
+  */
+class TestOperation : public AbstractOperation
+{
+public:
+    TestOperation(const QByteArray& aKey, int aValue, bool aHeld, QAtomicInt& aExecutions,
+                  QObject* aObserver, const char* aSlot) :
+            AbstractOperation(aObserver, aSlot),
+            m_key(aKey),
+            m_value(aValue),
+            m_result(0),
+            m_held(aHeld),
+            m_released(0),
+            m_executions(aExecutions)
+    {
+    }
+public: // from AbstractOperation
+    void execute() {
+        started();
+        m_executions.ref();
+        if(m_held && !isReleased()) {
+            new Finisher(this);
+            return;
+        }
+        complete();
+    }
+    QByteArray cacheKey() const {
+        return m_key;
+    }
+    QVariant resultForCache() const {
+        return m_result;
+    }
+    void setResultFromCache(const QVariant& aResult) {
+        m_result = aResult.toInt();
+    }
+public:
+    void complete() {
+        // a cancelled one keeps its status
+        if(status() == OperationRunning) {
+            m_result = 2 * m_value;
+            success();
+        }
+        finished();
+    }
+    void release() {
+        m_released.ref();
+    }
+    bool isReleased() {
+        return m_released.fetchAndAddAcquire(0) != 0;
+    }
+    int result() const {
+        return m_result;
+    }
+private:
+    QByteArray m_key;
+    int m_value;
+    int m_result;
+    bool m_held;
+    QAtomicInt m_released;
+    QAtomicInt& m_executions;
+};
+
+Finisher::Finisher(TestOperation* aOperation) :
+        m_operation(aOperation)
+{
+    QTimer::singleShot(KPollInterval, this, SLOT(poll()));
+}
+
+void Finisher::poll() {
+    if(m_operation->isReleased()) {
+        m_operation->complete();
+        deleteLater();
+    } else {
+        QTimer::singleShot(KPollInterval, this, SLOT(poll()));
+    }
+}
+
+class TestResultCache : public QObject
+{
+    Q_OBJECT
+public:
+    TestResultCache() : m_worker(0), m_cache(0) {}
+public slots:
+    void operationDone(void* aOperation);
+private slots:
+    void init();
+    void cleanup();
+    void hit();
+    void join();
+    void timeToLive();
+    void cancelledLeader();
+    void requeueWhileQueued();
+private:
+    void startWorker();
+    TestOperation* addOperation(const QByteArray& aKey, int aValue, bool aHeld = false);
+    bool waitForCallbacks(int aCount);
+    bool waitForExecutions(int aCount);
+    bool waitForStatus(TestOperation* aOperation, int aStatus);
+    int executions();
+private:
+    WorkerThread* m_worker;
+    ResultCache* m_cache;
+    VirtualWorkerClock m_clock;
+    QAtomicInt m_executions;
+    QList<TestOperation*> m_done;
+    QList<TestOperation*> m_held;
+};
+
+void TestResultCache::operationDone(void* aOperation) {
+    m_done.append(reinterpret_cast<TestOperation*>(aOperation));
+}
+
+void TestResultCache::init() {
+    m_executions = 0;
+    m_clock.setTime(0);
+    m_cache = new ResultCache(KDefaultResultCacheCost, KTimeToLive);
+    m_cache->setClock(&m_clock);
+}
+
+void TestResultCache::cleanup() {
+    foreach(TestOperation* operation, m_held) {
+        operation->release();
+    }
+    m_held.clear();
+    if(m_worker) {
+        m_worker->terminateThread();
+        delete m_worker;
+        m_worker = 0;
+    }
+    delete m_cache;
+    m_cache = 0;
+    // an operation given back twice is there twice
+    qDeleteAll(m_done.toSet());
+    m_done.clear();
+}
+
+void TestResultCache::startWorker() {
+    m_worker = new WorkerThread();
+    m_worker->setResultCache(m_cache);
+    m_worker->startThread();
+}
+
+TestOperation* TestResultCache::addOperation(const QByteArray& aKey, int aValue, bool aHeld) {
+    TestOperation* operation = new TestOperation(aKey, aValue, aHeld, m_executions,
+                                                 this, SLOT(operationDone(void*)));
+    if(aHeld) {
+        m_held.append(operation);
+    }
+    m_worker->addOperation(operation);
+    return operation;
+}
+
+bool TestResultCache::waitForCallbacks(int aCount) {
+    QElapsedTimer elapsed;
+    elapsed.start();
+    while(m_done.count() < aCount && elapsed.elapsed() < KWaitTimeout) {
+        QTest::qWait(10);
+    }
+    return m_done.count() == aCount;
+}
+
+bool TestResultCache::waitForExecutions(int aCount) {
+    QElapsedTimer elapsed;
+    elapsed.start();
+    while(executions() < aCount && elapsed.elapsed() < KWaitTimeout) {
+        QTest::qWait(10);
+    }
+    return executions() == aCount;
+}
+
+bool TestResultCache::waitForStatus(TestOperation* aOperation, int aStatus) {
+    QElapsedTimer elapsed;
+    elapsed.start();
+    while(aOperation->status() != aStatus && elapsed.elapsed() < KWaitTimeout) {
+        QTest::qWait(10);
+    }
+    return aOperation->status() == aStatus;
+}
+
+int TestResultCache::executions() {
+    return m_executions.fetchAndAddAcquire(0);
+}
+
+// the second operation with the key gets the result without running
+void TestResultCache::hit() {
+    startWorker();
+    addOperation(KCacheKey, 21);
+    QVERIFY(waitForCallbacks(1));
+    TestOperation* cached = addOperation(KCacheKey, 0);
+    QVERIFY(waitForCallbacks(2));
+    QCOMPARE(m_done.at(1), cached);
+    QCOMPARE(cached->status(), (int)AbstractOperation::OperationSuccess);
+    QCOMPARE(cached->result(), 42);
+    QCOMPARE(executions(), 1);
+    QCOMPARE(m_cache->count(), 1);
+}
+
+// added while the key is being computed, it waits for that execution
+void TestResultCache::join() {
+    startWorker();
+    TestOperation* leader = addOperation(KCacheKey, 21, true);
+    QVERIFY(waitForExecutions(1));
+    TestOperation* joined = addOperation(KCacheKey, 0);
+    QTest::qWait(50);
+    QVERIFY(m_done.isEmpty());
+    leader->release();
+    QVERIFY(waitForCallbacks(2));
+    QVERIFY(m_done.contains(leader));
+    QVERIFY(m_done.contains(joined));
+    QCOMPARE(joined->status(), (int)AbstractOperation::OperationSuccess);
+    QCOMPARE(joined->result(), 42);
+    QCOMPARE(executions(), 1);
+}
+
+void TestResultCache::timeToLive() {
+    startWorker();
+    addOperation(KCacheKey, 21);
+    QVERIFY(waitForCallbacks(1));
+    m_clock.advance(KTimeToLive / 2);
+    addOperation(KCacheKey, 21);
+    QVERIFY(waitForCallbacks(2));
+    QCOMPARE(executions(), 1);
+    // expired: it runs again
+    m_clock.advance(KTimeToLive);
+    TestOperation* expired = addOperation(KCacheKey, 21);
+    QVERIFY(waitForCallbacks(3));
+    QCOMPARE(m_done.at(2), expired);
+    QCOMPARE(expired->status(), (int)AbstractOperation::OperationSuccess);
+    QCOMPARE(executions(), 2);
+}
+
+// the operations which joined a cancelled one run on their own
+void TestResultCache::cancelledLeader() {
+    startWorker();
+    TestOperation* leader = addOperation(KCacheKey, 21, true);
+    QVERIFY(waitForExecutions(1));
+    TestOperation* joined = addOperation(KCacheKey, 21);
+    m_worker->cancelOperation(leader->id());
+    // the worker takes the cancellation before the release
+    QVERIFY(waitForStatus(leader, AbstractOperation::OperationCancelled));
+    leader->release();
+    QVERIFY(waitForCallbacks(2));
+    QCOMPARE(m_done.at(0), leader);
+    QCOMPARE(leader->status(), (int)AbstractOperation::OperationCancelled);
+    QCOMPARE(m_done.at(1), joined);
+    QCOMPARE(joined->status(), (int)AbstractOperation::OperationSuccess);
+    QCOMPARE(joined->result(), 42);
+    QCOMPARE(executions(), 2);
+}
+
+// added again while queued it is queued once, it does not wait for itself
+void TestResultCache::requeueWhileQueued() {
+    startWorker();
+    TestOperation* blocker = addOperation("other", 1, true);
+    QVERIFY(waitForExecutions(1));
+    TestOperation* operation = addOperation(KCacheKey, 21);
+    m_worker->addOperation(operation);
+    blocker->release();
+    QVERIFY(waitForCallbacks(2));
+    // nothing else turns up
+    QTest::qWait(50);
+    QCOMPARE(m_done.count(), 2);
+    QCOMPARE(m_done.at(1), operation);
+    QCOMPARE(operation->status(), (int)AbstractOperation::OperationSuccess);
+    QCOMPARE(executions(), 2);
+}
+
+QTEST_MAIN(TestResultCache)
+
+#include "tst_resultcache.moc"
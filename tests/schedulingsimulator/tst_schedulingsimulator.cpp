@@ -0,0 +1,151 @@
+#include <QtTest>
+
+#include "schedulingsimulator.h"
+#include "queuehandler.h"
+#include "abstractoperation.h"
+
+namespace {
+    const int KFuzzSeeds = 200;
+    const int KFuzzSteps = 400;
+
+    SimulatedArrival arrival(int aTag, qint64 aTime, int aDuration) {
+        SimulatedArrival result;
+        result.m_tag = aTag;
+        result.m_time = aTime;
+        result.m_duration = aDuration;
+        return result;
+    }
+
+    SimulatedResult resultOf(const QList<SimulatedResult>& aResults, int aTag) {
+        foreach(const SimulatedResult& result, aResults) {
+            if(result.m_tag == aTag) {
+                return result;
+            }
+        }
+        return SimulatedResult();
+    }
+}
+
+class TestSchedulingSimulator : public QObject
+{
+    Q_OBJECT
+private slots:
+    void emptyReplay();
+    void timeout();
+    void retry();
+    void retryExhausted();
+    void batch();
+    void idlePriority();
+    void fuzz_data();
+    void fuzz();
+};
+
+// nothing queued: settle() must not keep dispatching an empty queue
+void TestSchedulingSimulator::emptyReplay() {
+    SchedulingSimulator simulator;
+    simulator.replay(QList<SimulatedArrival>());
+    QVERIFY(simulator.results().isEmpty());
+}
+
+void TestSchedulingSimulator::timeout() {
+    SchedulingSimulator simulator;
+    SimulatedArrival slow = arrival(1, 0, 100);
+    slow.m_timeout = 10;
+    simulator.replay(QList<SimulatedArrival>() << slow);
+
+    QCOMPARE(simulator.results().count(), 1);
+    SimulatedResult result = simulator.results().first();
+    QCOMPARE(result.m_status, (int)AbstractOperation::OperationTimedOut);
+    QCOMPARE(result.m_end, qint64(10));
+}
+
+void TestSchedulingSimulator::retry() {
+    SchedulingSimulator simulator;
+    SimulatedArrival flaky = arrival(1, 0, 10);
+    flaky.m_failures = 2;
+    flaky.m_maxAttempts = 3;
+    simulator.replay(QList<SimulatedArrival>() << flaky);
+
+    QCOMPARE(simulator.results().count(), 1);
+    SimulatedResult result = simulator.results().first();
+    QCOMPARE(result.m_status, (int)AbstractOperation::OperationSuccess);
+    QCOMPARE(result.m_attempts, 3);
+    // 10 + 100 (first backoff) + 10 + 200 (second backoff) + 10
+    QCOMPARE(result.m_start, qint64(320));
+    QCOMPARE(result.m_end, qint64(330));
+}
+
+void TestSchedulingSimulator::retryExhausted() {
+    SchedulingSimulator simulator;
+    SimulatedArrival broken = arrival(1, 0, 10);
+    broken.m_failures = 5;
+    broken.m_maxAttempts = 2;
+    simulator.replay(QList<SimulatedArrival>() << broken);
+
+    QCOMPARE(simulator.results().count(), 1);
+    SimulatedResult result = simulator.results().first();
+    QCOMPARE(result.m_status, (int)AbstractOperation::OperationFailed);
+    QCOMPARE(result.m_attempts, 2);
+}
+
+void TestSchedulingSimulator::batch() {
+    SchedulingSimulator simulator;
+    simulator.queueHandler()->setBatching(4);
+    QList<SimulatedArrival> arrivals;
+    arrivals << arrival(0, 0, 10);
+    for(int tag = 1; tag <= 3; ++tag) {
+        SimulatedArrival member = arrival(tag, 1, 5);
+        member.m_batchKey = "key";
+        arrivals << member;
+    }
+    simulator.replay(arrivals);
+
+    QList<SimulatedResult> results = simulator.results();
+    QCOMPARE(results.count(), 4);
+    // queued behind the first one, they run as a single batch
+    for(int tag = 1; tag <= 3; ++tag) {
+        SimulatedResult result = resultOf(results, tag);
+        QCOMPARE(result.m_status, (int)AbstractOperation::OperationSuccess);
+        QCOMPARE(result.m_start, qint64(10));
+        QCOMPARE(result.m_end, qint64(15));
+    }
+}
+
+void TestSchedulingSimulator::idlePriority() {
+    SchedulingSimulator simulator;
+    SimulatedArrival idle = arrival(1, 0, 20);
+    idle.m_idlePriority = true;
+    SimulatedArrival normal = arrival(2, 5, 5);
+    simulator.replay(QList<SimulatedArrival>() << idle << normal);
+
+    QList<SimulatedResult> results = simulator.results();
+    QCOMPARE(results.count(), 2);
+    // the idle one makes way when it notices the normal one, and resumes after it
+    SimulatedResult normalResult = resultOf(results, 2);
+    QCOMPARE(normalResult.m_start, qint64(20));
+    QCOMPARE(normalResult.m_end, qint64(25));
+    SimulatedResult idleResult = resultOf(results, 1);
+    QCOMPARE(idleResult.m_status, (int)AbstractOperation::OperationSuccess);
+    QCOMPARE(idleResult.m_start, qint64(25));
+    QCOMPARE(idleResult.m_end, qint64(45));
+    // pausing is not a new attempt
+    QCOMPARE(idleResult.m_attempts, 1);
+}
+
+void TestSchedulingSimulator::fuzz_data() {
+    QTest::addColumn<quint32>("seed");
+    for(quint32 seed = 1; seed <= KFuzzSeeds; ++seed) {
+        QTest::newRow(qPrintable(QString::number(seed))) << seed;
+    }
+}
+
+// adds, cancels, group cancels, cancel all, timeouts, retries, batches and idle operations
+void TestSchedulingSimulator::fuzz() {
+    QFETCH(quint32, seed);
+    SchedulingSimulator simulator;
+    QVERIFY2(simulator.fuzz(seed, KFuzzSteps), qPrintable(simulator.lastError()));
+}
+
+QTEST_MAIN(TestSchedulingSimulator)
+
+#include "tst_schedulingsimulator.moc"
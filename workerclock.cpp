@@ -0,0 +1,37 @@
+#include "workerclock.h"
+
+#include <QElapsedTimer>
+
+namespace {
+    class SystemWorkerClock : public WorkerClock
+    {
+    public:
+        qint64 now() const {
+            return QElapsedTimer::msecsSinceReference();
+        }
+    };
+}
+
+WorkerClock* WorkerClock::systemClock() {
+    static SystemWorkerClock clock;
+    return &clock;
+}
+
+VirtualWorkerClock::VirtualWorkerClock(qint64 aStartTime) :
+        m_now(aStartTime)
+{
+}
+
+qint64 VirtualWorkerClock::now() const {
+    return m_now;
+}
+
+void VirtualWorkerClock::setTime(qint64 aTime) {
+    Q_ASSERT(aTime >= m_now);
+    m_now = aTime;
+}
+
+void VirtualWorkerClock::advance(qint64 aDelta) {
+    Q_ASSERT(aDelta >= 0);
+    m_now += aDelta;
+}
@@ -0,0 +1,41 @@
+#ifndef WORKERCLOCK_H
+#define WORKERCLOCK_H
+
+#include <QtGlobal>
+
+/**
+  * Monotonic time source used by the QueueHandler (timeouts, waiting times, ...).
+  * Replace it with a VirtualWorkerClock to make the scheduling deterministic.
+  */
+class WorkerClock
+{
+public:
+    virtual ~WorkerClock() {}
+    /**
+      * Current time in msecs, only differences between two values are meaningful.
+      */
+    virtual qint64 now() const = 0;
+    /**
+      * The real (monotonic) clock, shared by everyone.
+      */
+    static WorkerClock* systemClock();
+};
+
+/**
+  * A clock which moves only when told to.
+  * Not thread safe: meant for the single threaded SchedulingSimulator.
+  */
+class VirtualWorkerClock : public WorkerClock
+{
+public:
+    explicit VirtualWorkerClock(qint64 aStartTime = 0);
+public: // from WorkerClock
+    qint64 now() const;
+public:
+    void setTime(qint64 aTime);
+    void advance(qint64 aDelta);
+private:
+    qint64 m_now;
+};
+
+#endif // WORKERCLOCK_H
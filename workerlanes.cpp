@@ -0,0 +1,104 @@
+#include "workerlanes.h"
+#include "workerpool.h"
+
+#include "activelogs.h"
+#ifdef WORKER_LANES
+    #define ENABLE_LOG_MACROS
+#endif
+#include "workerlog.h"
+WORKER_LOG_CATEGORY("WorkerLanes");
+
+WorkerLanes::WorkerLanes(int aCpuWorkers, int aIoWorkers, QObject* aParent) :
+        QObject(aParent),
+        m_cpuLane(new WorkerPool(aCpuWorkers, this)),
+        m_ioLane(new WorkerPool(qMin(aCpuWorkers, aIoWorkers), this)),
+        m_cpuAdded(0),
+        m_ioAdded(0)
+{
+    m_ioLane->setElastic(qMin(aCpuWorkers, aIoWorkers), aIoWorkers);
+    m_ioLane->setScaleUpThresholds(KDefaultIoLaneQueueDepth, KDefaultScaleUpWaitTime);
+    m_ioLane->setDefaultTimeout(KDefaultIoLaneTimeout);
+}
+
+WorkerLanes::~WorkerLanes() {
+    terminateLanes();
+}
+
+void WorkerLanes::startLanes(QThread::Priority aPriority) {
+    m_cpuLane->startPool(aPriority);
+    m_ioLane->startPool(aPriority);
+}
+
+void WorkerLanes::terminateLanes() {
+    m_cpuLane->terminatePool();
+    m_ioLane->terminatePool();
+}
+
+WorkerPool* WorkerLanes::lane(AbstractOperation::WorkloadClass aClass) {
+    return aClass == AbstractOperation::WorkloadIo ? m_ioLane : m_cpuLane;
+}
+
+void WorkerLanes::setTracer(OperationTracer* aTracer) {
+    m_cpuLane->setTracer(aTracer);
+    m_ioLane->setTracer(aTracer);
+}
+
+void WorkerLanes::setResultCache(ResultCache* aCache) {
+    m_cpuLane->setResultCache(aCache);
+    m_ioLane->setResultCache(aCache);
+}
+
+void WorkerLanes::setJournal(OperationJournal* aJournal) {
+    m_cpuLane->setJournal(aJournal);
+    m_ioLane->setJournal(aJournal);
+}
+
+LaneStats WorkerLanes::stats(AbstractOperation::WorkloadClass aClass) {
+    WorkerPool* pool = lane(aClass);
+    LaneStats result;
+    result.m_workers = pool->workerCount();
+    result.m_pendingOperations = pool->pendingOperationsCount();
+    result.m_oldestPendingWait = pool->oldestPendingWait();
+    QAtomicInt& added = aClass == AbstractOperation::WorkloadIo ? m_ioAdded : m_cpuAdded;
+    result.m_addedOperations = added.fetchAndAddAcquire(0);
+    return result;
+}
+
+WorkerPool* WorkerLanes::route(AbstractOperation* aOperation) {
+    AbstractOperation::WorkloadClass workloadClass = aOperation->workloadClass();
+    if(workloadClass == AbstractOperation::WorkloadIo) {
+        m_ioAdded.ref();
+    } else {
+        m_cpuAdded.ref();
+    }
+    VERBOSE("operation" << aOperation->id() << "goes to lane" << workloadClass);
+    return lane(workloadClass);
+}
+
+void WorkerLanes::addOperation(AbstractOperation* aNewOperation) {
+    route(aNewOperation)->addOperation(aNewOperation);
+}
+
+void WorkerLanes::addHighPriorityOperation(AbstractOperation* aNewOperation) {
+    route(aNewOperation)->addHighPriorityOperation(aNewOperation);
+}
+
+void WorkerLanes::addIdleOperation(AbstractOperation* aNewOperation) {
+    route(aNewOperation)->addIdleOperation(aNewOperation);
+}
+
+void WorkerLanes::cancelOperation(int aOperationId) {
+    // ids are unique, only the lane holding the operation will act on it
+    m_cpuLane->cancelOperation(aOperationId);
+    m_ioLane->cancelOperation(aOperationId);
+}
+
+void WorkerLanes::cancelAllOperations() {
+    m_cpuLane->cancelAllOperations();
+    m_ioLane->cancelAllOperations();
+}
+
+void WorkerLanes::cancelGroup(const QByteArray& aTag) {
+    m_cpuLane->cancelGroup(aTag);
+    m_ioLane->cancelGroup(aTag);
+}
@@ -0,0 +1,90 @@
+#ifndef WORKERLANES_H
+#define WORKERLANES_H
+
+#include <QObject>
+#include <QThread>
+#include <QAtomicInt>
+#include <QByteArray>
+
+#include "abstractoperation.h"
+
+class WorkerPool;
+class OperationTracer;
+class ResultCache;
+class OperationJournal;
+
+// workers of the I/O lane for each core
+const int KDefaultIoLaneFactor = 4;
+// the I/O lane grows as soon as this many operations wait in a worker: waiting behind a blocked one is wasted
+const int KDefaultIoLaneQueueDepth = 2;
+// blocking operations depend on the other end, they get more time by default
+const int KDefaultIoLaneTimeout = 30 * 1000;
+
+/**
+  * Load of a lane, see WorkerLanes::stats().
+  */
+struct LaneStats {
+    LaneStats() : m_workers(0), m_pendingOperations(0), m_oldestPendingWait(0), m_addedOperations(0) {}
+    int m_workers;
+    int m_pendingOperations;
+    // msecs
+    qint64 m_oldestPendingWait;
+    // since the lanes have been created
+    int m_addedOperations;
+};
+
+/**
+  * Two WorkerPools, one per AbstractOperation::WorkloadClass, so that operations
+  * blocked on I/O do not hold the cores while the computing ones queue behind them:
+  * - the CPU lane has one worker per core;
+  * - the I/O lane starts with one worker per core and grows (elastic) up to
+  *   KDefaultIoLaneFactor per core when its queues get deep; its operations get
+  *   KDefaultIoLaneTimeout by default.
+  * Operations go to the lane of their workloadClass(). Each lane can be tuned through lane().
+  */
+class WorkerLanes : public QObject
+{
+    Q_OBJECT
+public:
+    WorkerLanes(int aCpuWorkers = QThread::idealThreadCount(),
+                int aIoWorkers = KDefaultIoLaneFactor * QThread::idealThreadCount(),
+                QObject* aParent = 0);
+    ~WorkerLanes();
+public:
+    /**
+      * Starts both lanes, call it BEFORE adding any requests.
+      */
+    void startLanes(QThread::Priority aPriority = QThread::LowestPriority);
+    /**
+      * Ends all the workers of both lanes (synchronously).
+      */
+    void terminateLanes();
+    WorkerPool* lane(AbstractOperation::WorkloadClass aClass);
+    /**
+      * Shared by both lanes (not owned), see WorkerPool::setTracer(), WorkerPool::setResultCache()
+      * and WorkerPool::setJournal().
+      */
+    void setTracer(OperationTracer* aTracer);
+    void setResultCache(ResultCache* aCache);
+    void setJournal(OperationJournal* aJournal);
+    LaneStats stats(AbstractOperation::WorkloadClass aClass);
+public:
+    void addOperation(AbstractOperation* aNewOperation);
+    void addHighPriorityOperation(AbstractOperation* aNewOperation);
+    void addIdleOperation(AbstractOperation* aNewOperation);
+    /**
+      * Cancel an operation by Id, in whatever lane it is.
+      */
+    void cancelOperation(int aOperationId);
+    void cancelAllOperations();
+    void cancelGroup(const QByteArray& aTag);
+private:
+    WorkerPool* route(AbstractOperation* aOperation);
+private:
+    WorkerPool* m_cpuLane;
+    WorkerPool* m_ioLane;
+    QAtomicInt m_cpuAdded;
+    QAtomicInt m_ioAdded;
+};
+
+#endif // WORKERLANES_H
@@ -0,0 +1,288 @@
+#include "workerlog.h"
+
+#include <QAtomicInt>
+#include <QAtomicPointer>
+#include <QDateTime>
+#include <QFile>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThread>
+#include <QCoreApplication>
+
+#include <stdio.h>
+
+// a slot of the ring
+struct WorkerLogRecord {
+    QAtomicInt m_sequence;
+    // position taken by WorkerLog::beginWrite(), published by WorkerLog::endWrite()
+    int m_position;
+    int m_level;
+    const char* m_category;
+    Qt::HANDLE m_thread;
+    qint64 m_time;
+    QString m_message;
+};
+
+namespace {
+    const int KLogRingSize = 4096; // must be a power of two
+    const int KLogWriterIdleSleep = 10;
+
+    const char* levelName(int aLevel) {
+        switch(aLevel) {
+        case WorkerLog::LevelVerbose:
+            return "VERBOSE";
+        case WorkerLog::LevelDebug:
+            return "DEBUG";
+        case WorkerLog::LevelWarning:
+            return "WARNING";
+        case WorkerLog::LevelCritical:
+            return "CRITICAL";
+        default:
+            return "";
+        }
+    }
+
+    // bounded multi producer / single consumer ring (Vyukov style):
+    // every slot (WorkerLogRecord) carries a sequence telling whether it can be written or read
+    class WorkerLogWriter : public QThread
+    {
+    public:
+        WorkerLogWriter() :
+                m_head(0),
+                m_tail(0),
+                m_dropped(0),
+                m_running(1),
+                m_output(0)
+        {
+            for(int i = 0; i < KLogRingSize; ++i) {
+                m_ring[i].m_sequence.fetchAndStoreRelaxed(i);
+            }
+        }
+
+        ~WorkerLogWriter() {
+            delete m_output;
+        }
+
+        // 0 if the ring is full
+        WorkerLogRecord* reserve(int aLevel, const char* aCategory) {
+            int position = m_head.fetchAndAddRelaxed(0);
+            WorkerLogRecord* record = 0;
+            forever {
+                record = &m_ring[position & (KLogRingSize - 1)];
+                int difference = record->m_sequence.fetchAndAddAcquire(0) - position;
+                if(difference == 0) {
+                    if(m_head.testAndSetRelaxed(position, position + 1)) {
+                        break;
+                    }
+                    position = m_head.fetchAndAddRelaxed(0);
+                } else if(difference < 0) {
+                    // the writer is lagging behind, do not block the caller
+                    m_dropped.ref();
+                    return 0;
+                } else {
+                    position = m_head.fetchAndAddRelaxed(0);
+                }
+            }
+            record->m_position = position;
+            record->m_level = aLevel;
+            record->m_category = aCategory;
+            record->m_thread = QThread::currentThreadId();
+            record->m_time = QDateTime::currentMSecsSinceEpoch();
+            return record;
+        }
+
+        void commit(WorkerLogRecord* aRecord) {
+            aRecord->m_sequence.fetchAndStoreRelease(aRecord->m_position + 1);
+        }
+
+        bool setOutputFile(const QString& aFileName) {
+            QFile* output = new QFile(aFileName);
+            if(!output->open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Text)) {
+                delete output;
+                return false;
+            }
+            QMutexLocker locker(&m_outputMutex);
+            delete m_output;
+            m_output = output;
+            return true;
+        }
+
+        int dropped() {
+            return m_dropped.fetchAndAddRelaxed(0);
+        }
+
+        void flush() {
+            while(m_tail.fetchAndAddAcquire(0) != m_head.fetchAndAddAcquire(0) && isRunning()) {
+                QThread::yieldCurrentThread();
+            }
+        }
+
+        void stop() {
+            m_running.fetchAndStoreRelease(0);
+            wait();
+            drain();
+        }
+    protected:
+        void run() {
+            while(m_running.fetchAndAddAcquire(0)) {
+                if(!drain()) {
+                    msleep(KLogWriterIdleSleep);
+                }
+            }
+        }
+    private:
+        // only called by the consumer
+        bool drain() {
+            bool written = false;
+            forever {
+                int position = m_tail.fetchAndAddRelaxed(0);
+                WorkerLogRecord& record = m_ring[position & (KLogRingSize - 1)];
+                if(record.m_sequence.fetchAndAddAcquire(0) != position + 1) {
+                    break;
+                }
+                // formatting the final line is done here, not by the caller
+                QByteArray line = QDateTime::fromMSecsSinceEpoch(record.m_time).toString("hh:mm:ss.zzz").toLatin1();
+                line += " [0x" + QByteArray::number((quintptr)record.m_thread, 16) + "] ";
+                line += levelName(record.m_level);
+                line += " ";
+                line += record.m_category;
+                line += ": ";
+                line += record.m_message.toUtf8();
+                line += "\n";
+                record.m_message.clear();
+                record.m_sequence.fetchAndStoreRelease(position + KLogRingSize);
+                m_tail.fetchAndStoreRelease(position + 1);
+                {
+                    QMutexLocker locker(&m_outputMutex);
+                    if(m_output) {
+                        m_output->write(line);
+                    } else {
+                        fputs(line.constData(), stderr);
+                    }
+                }
+                written = true;
+            }
+            if(written) {
+                QMutexLocker locker(&m_outputMutex);
+                if(m_output) {
+                    m_output->flush();
+                } else {
+                    fflush(stderr);
+                }
+            }
+            return written;
+        }
+    private:
+        WorkerLogRecord m_ring[KLogRingSize];
+        QAtomicInt m_head;
+        QAtomicInt m_tail;
+        QAtomicInt m_dropped;
+        QAtomicInt m_running;
+        QMutex m_outputMutex;
+        QFile* m_output;
+    };
+
+    QAtomicPointer<WorkerLogWriter> s_writer;
+
+    // constant initialised, safe to use from other static initialisers
+    WorkerLogCategory* s_firstCategory = 0;
+    int s_defaultLevel = WorkerLog::LevelWarning;
+
+    QMutex& categoriesMutex() {
+        static QMutex mutex;
+        return mutex;
+    }
+
+    void stopWriter() {
+        WorkerLogWriter* writer = s_writer.fetchAndStoreOrdered(0);
+        if(writer) {
+            writer->stop();
+            delete writer;
+        }
+    }
+
+    WorkerLogWriter* writer() {
+        WorkerLogWriter* current = s_writer;
+        if(!current) {
+            WorkerLogWriter* created = new WorkerLogWriter();
+            if(s_writer.testAndSetOrdered(0, created)) {
+                created->start(QThread::LowPriority);
+                qAddPostRoutine(stopWriter);
+            } else {
+                delete created;
+            }
+            current = s_writer;
+        }
+        return current;
+    }
+}
+
+WorkerLogCategory::WorkerLogCategory(const char* aName) :
+        m_name(aName),
+        m_level(WorkerLog::LevelWarning),
+        m_next(0)
+{
+    WorkerLog::registerCategory(this);
+}
+
+void WorkerLog::registerCategory(WorkerLogCategory* aCategory) {
+    QMutexLocker locker(&categoriesMutex());
+    aCategory->m_level = s_defaultLevel;
+    aCategory->m_next = s_firstCategory;
+    s_firstCategory = aCategory;
+}
+
+void WorkerLog::setLevel(Level aLevel) {
+    QMutexLocker locker(&categoriesMutex());
+    s_defaultLevel = aLevel;
+    for(WorkerLogCategory* category = s_firstCategory; category; category = category->m_next) {
+        category->m_level = aLevel;
+    }
+}
+
+bool WorkerLog::setCategoryLevel(const char* aCategory, Level aLevel) {
+    QMutexLocker locker(&categoriesMutex());
+    bool found = false;
+    for(WorkerLogCategory* category = s_firstCategory; category; category = category->m_next) {
+        if(qstrcmp(category->m_name, aCategory) == 0) {
+            category->m_level = aLevel;
+            found = true;
+        }
+    }
+    return found;
+}
+
+bool WorkerLog::setOutputFile(const QString& aFileName) {
+    return writer()->setOutputFile(aFileName);
+}
+
+void WorkerLog::write(int aLevel, const char* aCategory, const QString& aMessage) {
+    if(WorkerLogRecord* record = beginWrite(aLevel, aCategory)) {
+        record->m_message = aMessage;
+        endWrite(record);
+    }
+}
+
+WorkerLogRecord* WorkerLog::beginWrite(int aLevel, const char* aCategory) {
+    return writer()->reserve(aLevel, aCategory);
+}
+
+QString* WorkerLog::message(WorkerLogRecord* aRecord) {
+    return &aRecord->m_message;
+}
+
+void WorkerLog::endWrite(WorkerLogRecord* aRecord) {
+    writer()->commit(aRecord);
+}
+
+int WorkerLog::droppedMessages() {
+    WorkerLogWriter* current = s_writer;
+    return current ? current->dropped() : 0;
+}
+
+void WorkerLog::flush() {
+    WorkerLogWriter* current = s_writer;
+    if(current) {
+        current->flush();
+    }
+}
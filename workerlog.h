@@ -0,0 +1,147 @@
+#ifndef WORKERLOG_H
+#define WORKERLOG_H
+
+#include <QString>
+#include <QDebug>
+
+/**
+  * Runtime filtered, asynchronous replacement for logmacros.h.
+  *
+  * A file opts in exactly like with logmacros.h (its define in activelogs.h turns
+  * ENABLE_LOG_MACROS on) and declares its category once:
+  *
+  *     #include "activelogs.h"
+  *     #ifdef MY_FILE
+  *         #define ENABLE_LOG_MACROS
+  *     #endif
+  *     #include "workerlog.h"
+  *     WORKER_LOG_CATEGORY("MyFile");
+  *
+  * Each category has its own level that can be changed while running. A message below
+  * that level costs a single branch: the arguments are not even evaluated.
+  * An enabled message first takes a slot of a lock-free ring: if the ring is full it is
+  * dropped before anything is formatted. The arguments are then streamed straight into
+  * the slot (they may not outlive the call), and the line (time, thread, level, category)
+  * is put together and written out by a background thread.
+  * Do not include logmacros.h in the same file, the macro names are the same.
+  */
+
+class WorkerLogCategory;
+struct WorkerLogRecord;
+
+class WorkerLog
+{
+public:
+    enum Level
+    {
+        LevelVerbose = 0,
+        LevelDebug,
+        LevelWarning,
+        LevelCritical,
+        LevelOff
+    };
+public:
+    /**
+      * Set the level of all the categories (and of the ones which will be registered later).
+      */
+    static void setLevel(Level aLevel);
+    /**
+      * Set the level of a single category, returns false if it does not exist (yet).
+      */
+    static bool setCategoryLevel(const char* aCategory, Level aLevel);
+    /**
+      * Write the messages to @aFileName instead of stderr.
+      */
+    static bool setOutputFile(const QString& aFileName);
+    /**
+      * Queue a message, never blocks. If the ring is full the message is dropped.
+      */
+    static void write(int aLevel, const char* aCategory, const QString& aMessage);
+    /**
+      * Take a slot of the ring for a message, 0 if the ring is full (the message is dropped).
+      * Fill message() and hand it to endWrite() right away: the writer waits for it.
+      */
+    static WorkerLogRecord* beginWrite(int aLevel, const char* aCategory);
+    static QString* message(WorkerLogRecord* aRecord);
+    static void endWrite(WorkerLogRecord* aRecord);
+    /**
+      * Number of messages dropped because the writer could not keep up.
+      */
+    static int droppedMessages();
+    /**
+      * Wait until all the queued messages have been written.
+      */
+    static void flush();
+private:
+    friend class WorkerLogCategory;
+    static void registerCategory(WorkerLogCategory* aCategory);
+};
+
+class WorkerLogCategory
+{
+public:
+    explicit WorkerLogCategory(const char* aName);
+    inline bool isEnabled(int aLevel) const {
+        return aLevel >= m_level;
+    }
+    const char* name() const {
+        return m_name;
+    }
+private:
+    friend class WorkerLog;
+    const char* m_name;
+    volatile int m_level;
+    WorkerLogCategory* m_next;
+};
+
+#ifdef ENABLE_LOG_MACROS
+
+#define WORKER_LOG_CATEGORY(name) static WorkerLogCategory s_workerLogCategory(name)
+
+#define WORKER_LOG(level, tag, message) \
+    do { \
+        if(s_workerLogCategory.isEnabled(level)) { \
+            if(WorkerLogRecord* workerLogRecord = WorkerLog::beginWrite(level, tag)) { \
+                QDebug(WorkerLog::message(workerLogRecord)) << message; \
+                WorkerLog::endWrite(workerLogRecord); \
+            } \
+        } \
+    } while(0)
+
+#define VERBOSE_TAG(tag, message) WORKER_LOG(WorkerLog::LevelVerbose, tag, message)
+#define DEBUG_TAG(tag, message) WORKER_LOG(WorkerLog::LevelDebug, tag, message)
+#define WARNING_TAG(tag, message) WORKER_LOG(WorkerLog::LevelWarning, tag, message)
+#define CRITICAL_TAG(tag, message) WORKER_LOG(WorkerLog::LevelCritical, tag, message)
+
+#define VERBOSE(message) VERBOSE_TAG(s_workerLogCategory.name(), message)
+#define DEBUG(message) DEBUG_TAG(s_workerLogCategory.name(), message)
+#define WARNING(message) WARNING_TAG(s_workerLogCategory.name(), message)
+#define CRITICAL(message) CRITICAL_TAG(s_workerLogCategory.name(), message)
+
+#define VERBOSE_ENTER_FN() VERBOSE("->" << Q_FUNC_INFO)
+#define VERBOSE_EXIT_FN() VERBOSE("<-" << Q_FUNC_INFO)
+#define DEBUG_ENTER_FN() DEBUG("->" << Q_FUNC_INFO)
+#define DEBUG_EXIT_FN() DEBUG("<-" << Q_FUNC_INFO)
+
+#else
+
+#define WORKER_LOG_CATEGORY(name) struct WorkerLogCategoryUnused
+
+#define VERBOSE_TAG(tag, message) do {} while(0)
+#define DEBUG_TAG(tag, message) do {} while(0)
+#define WARNING_TAG(tag, message) do {} while(0)
+#define CRITICAL_TAG(tag, message) do {} while(0)
+
+#define VERBOSE(message) do {} while(0)
+#define DEBUG(message) do {} while(0)
+#define WARNING(message) do {} while(0)
+#define CRITICAL(message) do {} while(0)
+
+#define VERBOSE_ENTER_FN() do {} while(0)
+#define VERBOSE_EXIT_FN() do {} while(0)
+#define DEBUG_ENTER_FN() do {} while(0)
+#define DEBUG_EXIT_FN() do {} while(0)
+
+#endif // ENABLE_LOG_MACROS
+
+#endif // WORKERLOG_H
@@ -0,0 +1,395 @@
+#include "workerpool.h"
+#include "workerthread.h"
+#include "abstractoperation.h"
+#include "callbackdispatcher.h"
+
+#include <QMutexLocker>
+
+#include "activelogs.h"
+#ifdef WORKER_POOL
+    #define ENABLE_LOG_MACROS
+#endif
+#include "workerlog.h"
+WORKER_LOG_CATEGORY("WorkerPool");
+
+WorkerPool::WorkerPool(int aWorkerCount, QObject* aParent) :
+        QObject(aParent),
+        m_spareWorker(0),
+        m_workerCount(qMax(1, aWorkerCount)),
+        m_minWorkers(m_workerCount),
+        m_maxWorkers(m_workerCount),
+        m_elastic(false),
+        m_started(false),
+        m_scaleUpQueueDepth(KDefaultScaleUpQueueDepth),
+        m_scaleUpWaitTime(KDefaultScaleUpWaitTime),
+        m_idleCooldown(KDefaultIdleCooldown),
+        m_priority(QThread::LowestPriority),
+        m_tracer(0),
+        m_resultCache(0),
+        m_journal(0),
+        m_defaultTimeout(KDefaultTimeoutOperation),
+        m_callbackThread(0),
+        m_callbackPool(0)
+{
+    m_monitor.setInterval(KPoolMonitorInterval);
+    connect(&m_monitor, SIGNAL(timeout()), this, SLOT(checkPoolSize()));
+}
+
+WorkerPool::~WorkerPool() {
+    terminatePool();
+    // never started: nobody will run them
+    cancelAllOperations();
+}
+
+void WorkerPool::startPool(QThread::Priority aPriority) {
+    DEBUG_ENTER_FN();
+    {
+        QMutexLocker locker(&m_mutex);
+        if(m_started) {
+            WARNING("pool already started");
+            return;
+        }
+        m_started = true;
+        m_priority = aPriority;
+        int count = m_elastic ? m_minWorkers : m_workerCount;
+        for(int i = 0; i < count; ++i) {
+            m_workers.append(startWorker());
+        }
+        if(m_elastic && m_workers.count() < m_maxWorkers) {
+            m_spareWorker = startWorker();
+        }
+        // the workers queue them until they are up
+        for(int i = 0; i < m_pendingOperations.count(); ++i) {
+            addToWorker(leastLoadedWorker(), m_pendingOperations.at(i).first, m_pendingOperations.at(i).second);
+        }
+        m_pendingOperations.clear();
+    }
+    if(m_elastic) {
+        m_monitor.start();
+    }
+    DEBUG_EXIT_FN();
+}
+
+void WorkerPool::terminatePool() {
+    DEBUG_ENTER_FN();
+    m_monitor.stop();
+    QList<WorkerThread*> workers;
+    {
+        QMutexLocker locker(&m_mutex);
+        workers = m_workers;
+        m_workers.clear();
+        if(m_spareWorker) {
+            workers.append(m_spareWorker);
+            m_spareWorker = 0;
+        }
+        m_started = false;
+    }
+    foreach(WorkerThread* worker, workers) {
+        worker->terminateThread();
+        worker->wait();
+        delete worker;
+    }
+    DEBUG_EXIT_FN();
+}
+
+void WorkerPool::setElastic(int aMinWorkers, int aMaxWorkers) {
+    bool startMonitor = false;
+    {
+        QMutexLocker locker(&m_mutex);
+        m_minWorkers = qMax(1, aMinWorkers);
+        m_maxWorkers = qMax(m_minWorkers, aMaxWorkers);
+        m_elastic = true;
+        if(m_started) {
+            if(!m_spareWorker && m_workers.count() < m_maxWorkers) {
+                m_spareWorker = startWorker();
+            }
+            startMonitor = true;
+        }
+    }
+    if(startMonitor) {
+        m_monitor.start();
+    }
+}
+
+bool WorkerPool::isElastic() const {
+    return m_elastic;
+}
+
+void WorkerPool::setScaleUpThresholds(int aQueueDepth, int aWaitTime) {
+    QMutexLocker locker(&m_mutex);
+    m_scaleUpQueueDepth = aQueueDepth;
+    m_scaleUpWaitTime = aWaitTime;
+}
+
+void WorkerPool::setIdleCooldown(int aCooldown) {
+    QMutexLocker locker(&m_mutex);
+    m_idleCooldown = aCooldown;
+}
+
+void WorkerPool::setTracer(OperationTracer* aTracer) {
+    QMutexLocker locker(&m_mutex);
+    m_tracer = aTracer;
+    foreach(WorkerThread* worker, m_workers) {
+        worker->setTracer(aTracer);
+    }
+    if(m_spareWorker) {
+        m_spareWorker->setTracer(aTracer);
+    }
+}
+
+void WorkerPool::setResultCache(ResultCache* aCache) {
+    QMutexLocker locker(&m_mutex);
+    m_resultCache = aCache;
+}
+
+void WorkerPool::setJournal(OperationJournal* aJournal) {
+    QMutexLocker locker(&m_mutex);
+    m_journal = aJournal;
+}
+
+void WorkerPool::setDefaultTimeout(int aTimeout) {
+    QMutexLocker locker(&m_mutex);
+    m_defaultTimeout = aTimeout;
+}
+
+void WorkerPool::setCallbackThread(QThread* aThread) {
+    QMutexLocker locker(&m_mutex);
+    m_callbackThread = aThread;
+}
+
+void WorkerPool::setCallbackPool(QThreadPool* aPool) {
+    QMutexLocker locker(&m_mutex);
+    m_callbackPool = aPool;
+}
+
+int WorkerPool::workerCount() {
+    QMutexLocker locker(&m_mutex);
+    return m_workers.count();
+}
+
+int WorkerPool::pendingOperationsCount() {
+    QMutexLocker locker(&m_mutex);
+    int result = m_pendingOperations.count();
+    foreach(WorkerThread* worker, m_workers) {
+        result += worker->pendingOperationsCount();
+    }
+    return result;
+}
+
+qint64 WorkerPool::oldestPendingWait() {
+    QMutexLocker locker(&m_mutex);
+    qint64 result = 0;
+    foreach(WorkerThread* worker, m_workers) {
+        result = qMax(result, worker->oldestPendingWait());
+    }
+    return result;
+}
+
+void WorkerPool::addOperation(AbstractOperation* aNewOperation) {
+    QMutexLocker locker(&m_mutex);
+    WorkerThread* worker = leastLoadedWorker();
+    if(worker && m_elastic && needsMoreWorkers(worker)) {
+        scaleUp();
+        worker = m_workers.last();
+    }
+    if(worker) {
+        worker->addOperation(aNewOperation);
+    } else {
+        m_pendingOperations.append(qMakePair(aNewOperation, AbstractOperation::PriorityNormal));
+    }
+}
+
+void WorkerPool::addHighPriorityOperation(AbstractOperation* aNewOperation) {
+    QMutexLocker locker(&m_mutex);
+    WorkerThread* worker = leastLoadedWorker();
+    if(worker && m_elastic && needsMoreWorkers(worker)) {
+        scaleUp();
+        worker = m_workers.last();
+    }
+    if(worker) {
+        worker->addHighPriorityOperation(aNewOperation);
+    } else {
+        m_pendingOperations.append(qMakePair(aNewOperation, AbstractOperation::PriorityHigh));
+    }
+}
+
+void WorkerPool::addIdleOperation(AbstractOperation* aNewOperation) {
+    QMutexLocker locker(&m_mutex);
+    WorkerThread* worker = leastLoadedWorker();
+    if(worker) {
+        worker->addIdleOperation(aNewOperation);
+    } else {
+        m_pendingOperations.append(qMakePair(aNewOperation, AbstractOperation::PriorityIdle));
+    }
+}
+
+QList<AbstractOperation*> WorkerPool::spreadHighPriorityOperations(const QList<AbstractOperation*>& aNewOperations) {
+    QList<AbstractOperation*> left = aNewOperations;
+    QMutexLocker locker(&m_mutex);
+    foreach(WorkerThread* worker, m_workers) {
+        if(left.isEmpty()) {
+            break;
+        }
+        if(worker != QThread::currentThread()) {
+            worker->addHighPriorityOperation(left.takeFirst());
+        }
+    }
+    return left;
+}
+
+void WorkerPool::cancelOperation(int aOperationId) {
+    QMutexLocker locker(&m_mutex);
+    for(int i = m_pendingOperations.count() - 1; i >= 0; --i) {
+        if(m_pendingOperations.at(i).first->id() == aOperationId) {
+            deliverCancelled(m_pendingOperations.takeAt(i).first);
+        }
+    }
+    // ids are unique, only the worker holding the operation will act on it
+    foreach(WorkerThread* worker, m_workers) {
+        worker->cancelOperation(aOperationId);
+    }
+}
+
+void WorkerPool::cancelAllOperations() {
+    QMutexLocker locker(&m_mutex);
+    for(int i = 0; i < m_pendingOperations.count(); ++i) {
+        deliverCancelled(m_pendingOperations.at(i).first);
+    }
+    m_pendingOperations.clear();
+    foreach(WorkerThread* worker, m_workers) {
+        worker->cancelAllOperations();
+    }
+}
+
+void WorkerPool::cancelGroup(const QByteArray& aTag) {
+    QMutexLocker locker(&m_mutex);
+    for(int i = m_pendingOperations.count() - 1; i >= 0; --i) {
+        if(m_pendingOperations.at(i).first->hasGroupTag(aTag)) {
+            deliverCancelled(m_pendingOperations.takeAt(i).first);
+        }
+    }
+    foreach(WorkerThread* worker, m_workers) {
+        worker->cancelGroup(aTag);
+    }
+}
+
+WorkerThread* WorkerPool::createWorker() {
+    return new WorkerThread();
+}
+
+WorkerThread* WorkerPool::startWorker() {
+    WorkerThread* worker = createWorker();
+    worker->setTracer(m_tracer);
+    worker->setResultCache(m_resultCache);
+    worker->setJournal(m_journal);
+    worker->setDefaultTimeout(m_defaultTimeout);
+    worker->setCallbackThread(m_callbackThread);
+    worker->setCallbackPool(m_callbackPool);
+    connect(worker, SIGNAL(emptyQueue()), this, SLOT(onWorkerEmptyQueue()), Qt::QueuedConnection);
+    worker->startThreadAsync(m_priority);
+    return worker;
+}
+
+void WorkerPool::addToWorker(WorkerThread* aWorker, AbstractOperation* aOperation, AbstractOperation::PriorityClass aPriority) {
+    switch(aPriority) {
+    case AbstractOperation::PriorityHigh:
+        aWorker->addHighPriorityOperation(aOperation);
+        break;
+    case AbstractOperation::PriorityIdle:
+        aWorker->addIdleOperation(aOperation);
+        break;
+    default:
+        aWorker->addOperation(aOperation);
+        break;
+    }
+}
+
+void WorkerPool::deliverCancelled(AbstractOperation* aOperation) {
+    aOperation->setStatus(AbstractOperation::OperationCancelled);
+    if(aOperation->observer()) {
+        CallbackDispatcher::invokeCallback(aOperation, Qt::QueuedConnection);
+    } else {
+        aOperation->cleanThreadSpecificResources();
+    }
+}
+
+WorkerThread* WorkerPool::leastLoadedWorker() {
+    WorkerThread* result = 0;
+    int resultLoad = 0;
+    foreach(WorkerThread* worker, m_workers) {
+        // a busy worker counts as one more waiting operation
+        int load = worker->pendingOperationsCount() * 2 + (worker->idleTime() < 0 ? 1 : 0);
+        if(result == 0 || load < resultLoad) {
+            result = worker;
+            resultLoad = load;
+            if(load == 0) {
+                break;
+            }
+        }
+    }
+    return result;
+}
+
+bool WorkerPool::needsMoreWorkers(WorkerThread* aWorker) {
+    if(m_workers.count() >= m_maxWorkers) {
+        return false;
+    }
+    return aWorker->pendingOperationsCount() >= m_scaleUpQueueDepth ||
+            aWorker->oldestPendingWait() >= m_scaleUpWaitTime;
+}
+
+void WorkerPool::scaleUp() {
+    DEBUG_ENTER_FN();
+    if(m_workers.count() < m_maxWorkers) {
+        WorkerThread* worker = m_spareWorker ? m_spareWorker : startWorker();
+        m_spareWorker = 0;
+        m_workers.append(worker);
+        DEBUG_TAG("WorkerPool", "pool grown to" << m_workers.count() << "workers");
+        // warm up the next one in advance
+        if(m_workers.count() < m_maxWorkers) {
+            m_spareWorker = startWorker();
+        }
+    }
+    DEBUG_EXIT_FN();
+}
+
+void WorkerPool::checkPoolSize() {
+    WorkerThread* retired = 0;
+    {
+        QMutexLocker locker(&m_mutex);
+        if(!m_started || !m_elastic) {
+            return;
+        }
+        WorkerThread* worker = leastLoadedWorker();
+        if(worker && needsMoreWorkers(worker)) {
+            scaleUp();
+        } else if(m_workers.count() > m_minWorkers) {
+            // retire at most one worker per check, the newest first
+            for(int i = m_workers.count() - 1; i >= 0; --i) {
+                if(m_workers.at(i)->idleTime() >= m_idleCooldown) {
+                    retired = m_workers.takeAt(i);
+                    break;
+                }
+            }
+        }
+    }
+    if(retired) {
+        // it is idle and not reachable anymore, terminating it is quick
+        DEBUG_TAG("WorkerPool", "retiring an idle worker");
+        retired->terminateThread();
+        retired->wait();
+        delete retired;
+    }
+}
+
+void WorkerPool::onWorkerEmptyQueue() {
+    {
+        QMutexLocker locker(&m_mutex);
+        foreach(WorkerThread* worker, m_workers) {
+            if(worker->pendingOperationsCount()) {
+                return;
+            }
+        }
+    }
+    emit emptyQueue();
+}
@@ -0,0 +1,183 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <QObject>
+#include <QThread>
+#include <QMutex>
+#include <QList>
+#include <QPair>
+#include <QTimer>
+#include <QByteArray>
+
+#include "abstractoperation.h"
+
+class QThreadPool;
+class WorkerThread;
+class OperationTracer;
+class ResultCache;
+class OperationJournal;
+
+const int KDefaultScaleUpQueueDepth = 8;
+const int KDefaultScaleUpWaitTime = 200;
+const int KDefaultIdleCooldown = 30 * 1000;
+const int KPoolMonitorInterval = 100;
+
+/**
+  * A set of WorkerThreads sharing the operations added to the pool.
+  * Each operation goes to the least loaded worker.
+  * In elastic mode workers are added when the queues get too deep (or the operations
+  * wait too long) and removed when they have been idle for a while.
+  */
+class WorkerPool : public QObject
+{
+    Q_OBJECT
+public:
+    WorkerPool(int aWorkerCount = QThread::idealThreadCount(), QObject* aParent = 0);
+    ~WorkerPool();
+public:
+    /**
+      * Starts the workers, call it BEFORE adding any requests.
+      * It does not wait for the threads to be up and running.
+      * Operations added while the pool is not started wait for it to start.
+      */
+    void startPool(QThread::Priority aPriority = QThread::LowestPriority);
+    /**
+      * Ends all the workers (synchronously).
+      * Operations added afterwards wait for the pool to be started again.
+      */
+    void terminatePool();
+    /**
+      * Let the pool grow up to @aMaxWorkers and shrink down to @aMinWorkers.
+      * A spare worker is kept started so that growing never waits for a thread to come up.
+      */
+    void setElastic(int aMinWorkers, int aMaxWorkers);
+    bool isElastic() const;
+    /**
+      * Grow when the least loaded worker has more than @aQueueDepth operations waiting
+      * or its oldest operation has been waiting more than @aWaitTime msecs.
+      */
+    void setScaleUpThresholds(int aQueueDepth, int aWaitTime);
+    /**
+      * Remove a worker after it has been idle for @aCooldown msecs.
+      */
+    void setIdleCooldown(int aCooldown);
+    /**
+      * Trace all the workers in @aTracer (not owned).
+      */
+    void setTracer(OperationTracer* aTracer);
+    /**
+      * Share @aCache (not owned) among all the workers, so that a result computed
+      * by one of them is a hit for all. Call it before startPool().
+      */
+    void setResultCache(ResultCache* aCache);
+    /**
+      * Journal the operations of all the workers in @aJournal (not owned).
+      * Call it before startPool().
+      */
+    void setJournal(OperationJournal* aJournal);
+    /**
+      * Timeout of the operations which do not pick one (see QueueHandler::setDefaultTimeout()).
+      * Call it before startPool().
+      */
+    void setDefaultTimeout(int aTimeout);
+    /**
+      * Deliver the DeliverToCallbackThread operations of all the workers from @aThread or,
+      * if set, from @aPool (neither owned, see QueueHandler::setCallbackThread).
+      * Call them before startPool().
+      */
+    void setCallbackThread(QThread* aThread);
+    void setCallbackPool(QThreadPool* aPool);
+    /**
+      * Number of workers currently accepting operations.
+      */
+    int workerCount();
+    /**
+      * Operations waiting in all the workers.
+      */
+    int pendingOperationsCount();
+    /**
+      * How long (in msecs) the operation waiting the most in any worker has been waiting.
+      */
+    qint64 oldestPendingWait();
+public:
+    /**
+      * Add a normal priority @aNewOperation to the pool
+      */
+    virtual void addOperation(AbstractOperation* aNewOperation);
+    /**
+      * Add a high priority @aNewOperation to the pool
+      */
+    virtual void addHighPriorityOperation(AbstractOperation* aNewOperation);
+    /**
+      * Add an idle priority @aNewOperation to the pool, it never makes the pool grow
+      */
+    virtual void addIdleOperation(AbstractOperation* aNewOperation);
+    /**
+      * Add each of @aNewOperations with high priority to a different worker, never to the one
+      * running the calling thread (if it is one of ours). Returns the ones left over when
+      * there are not enough workers, the caller still owns them.
+      */
+    QList<AbstractOperation*> spreadHighPriorityOperations(const QList<AbstractOperation*>& aNewOperations);
+    /**
+      * Cancel an operation by Id
+      */
+    void cancelOperation(int aOperationId);
+    /**
+      * Cancel all the operations of all the workers.
+      */
+    void cancelAllOperations();
+    /**
+      * Cancel the operations tagged with @aTag in all the workers.
+      */
+    void cancelGroup(const QByteArray& aTag);
+signals:
+    void emptyQueue();
+protected:
+    //override this method to provide your own workers (e.g. with a custom queue handler)
+    virtual WorkerThread* createWorker();
+private slots:
+    /**
+      * Periodically grow or shrink the pool (elastic mode only).
+      */
+    void checkPoolSize();
+    void onWorkerEmptyQueue();
+private:
+    WorkerThread* startWorker();
+    // must be called with m_mutex locked
+    WorkerThread* leastLoadedWorker();
+    // must be called with m_mutex locked
+    bool needsMoreWorkers(WorkerThread* aWorker);
+    // must be called with m_mutex locked
+    void scaleUp();
+    void addToWorker(WorkerThread* aWorker, AbstractOperation* aOperation, AbstractOperation::PriorityClass aPriority);
+    /**
+      * Give back an operation cancelled before the pool started, from the observer thread.
+      */
+    void deliverCancelled(AbstractOperation* aOperation);
+private:
+    QMutex m_mutex;
+    QList<WorkerThread*> m_workers;
+    // started but not yet accepting operations, promoted by scaleUp()
+    WorkerThread* m_spareWorker;
+    // operations added while the pool was not started, handed over by startPool()
+    QList< QPair<AbstractOperation*, AbstractOperation::PriorityClass> > m_pendingOperations;
+
+    int m_workerCount;
+    int m_minWorkers;
+    int m_maxWorkers;
+    bool m_elastic;
+    bool m_started;
+    int m_scaleUpQueueDepth;
+    int m_scaleUpWaitTime;
+    int m_idleCooldown;
+    QThread::Priority m_priority;
+    OperationTracer* m_tracer;
+    ResultCache* m_resultCache;
+    OperationJournal* m_journal;
+    int m_defaultTimeout;
+    QThread* m_callbackThread;
+    QThreadPool* m_callbackPool;
+    QTimer m_monitor;
+};
+
+#endif // WORKERPOOL_H
@@ -6,21 +6,28 @@
 
 #include <QStringList>
 #include <QMetaObject>
+#include <QMutexLocker>
 
 
 #include "activelogs.h"
 #ifdef WORKER_THREAD
     #define ENABLE_LOG_MACROS
 #endif
-#include "logmacros.h"
+#include "workerlog.h"
+WORKER_LOG_CATEGORY("WorkerThread");
 
 
-#define KSENTINEL_OPERATION 0
-
 //Worker Thread
 WorkerThread::WorkerThread(QObject* aParent)
     : QThread(aParent),
-    m_queueHandler(0)
+    m_queueHandler(0),
+    m_tracer(0),
+    m_callbackThread(0),
+    m_callbackPool(0),
+    m_resultCache(0),
+    m_journal(0),
+    m_defaultTimeout(KDefaultTimeoutOperation),
+    m_startPending(false)
 {
     m_mainThread = currentThread();
 }
@@ -34,11 +41,26 @@ void WorkerThread::startThread(QThread::Priority aPriority) {
     m_semaphore.acquire(1);
 }
 
+void WorkerThread::startThreadAsync(QThread::Priority aPriority) {
+    m_startPending = true;
+    start(aPriority);
+}
+
 void WorkerThread::terminateThread() {
-    if(m_queueHandler) {
-        m_queueHandler->terminateThread();
+    if(m_startPending) {
+        // the thread must be up before it can be torn down
+        m_semaphore.acquire(1);
+        m_startPending = false;
+    }
+    QueueHandler* queueHandler = 0;
+    {
+        QMutexLocker locker(&m_queueHandlerMutex);
+        queueHandler = m_queueHandler;
         m_queueHandler = 0;
     }
+    if(queueHandler) {
+        queueHandler->terminateThread();
+    }
     quit();
     if(isRunning()) {
         wait(1500);
@@ -46,29 +68,110 @@ void WorkerThread::terminateThread() {
 }
 
 void WorkerThread::addOperation(AbstractOperation* aNewOperation) {
+    QMutexLocker locker(&m_queueHandlerMutex);
     if(m_queueHandler) {
         m_queueHandler->addOperation(aNewOperation);
+    } else if(m_startPending) {
+        m_pendingOperations.append(qMakePair(aNewOperation, AbstractOperation::PriorityNormal));
     }
 }
 
 void WorkerThread::addHighPriorityOperation(AbstractOperation* aNewOperation) {
+    QMutexLocker locker(&m_queueHandlerMutex);
     if(m_queueHandler) {
         m_queueHandler->addHighPriorityOperation(aNewOperation);
+    } else if(m_startPending) {
+        m_pendingOperations.append(qMakePair(aNewOperation, AbstractOperation::PriorityHigh));
+    }
+}
+
+void WorkerThread::addIdleOperation(AbstractOperation* aNewOperation) {
+    QMutexLocker locker(&m_queueHandlerMutex);
+    if(m_queueHandler) {
+        m_queueHandler->addIdleOperation(aNewOperation);
+    } else if(m_startPending) {
+        m_pendingOperations.append(qMakePair(aNewOperation, AbstractOperation::PriorityIdle));
     }
 }
 
 void WorkerThread::cancelAllOperations() {
+    QMutexLocker locker(&m_queueHandlerMutex);
     if(m_queueHandler) {
         m_queueHandler->cancelAllOperations();
     }
 }
 
+void WorkerThread::cancelGroup(const QByteArray& aTag) {
+    QMutexLocker locker(&m_queueHandlerMutex);
+    if(m_queueHandler) {
+        m_queueHandler->cancelGroup(aTag);
+    }
+}
+
 void WorkerThread::cancelOperation(int aOperationId) {
+    QMutexLocker locker(&m_queueHandlerMutex);
     if(m_queueHandler) {
         QMetaObject::invokeMethod(m_queueHandler, "doCancelOperation", Qt::AutoConnection,  Q_ARG( int, aOperationId));
     }
 }
 
+void WorkerThread::setTracer(OperationTracer* aTracer) {
+    QMutexLocker locker(&m_queueHandlerMutex);
+    m_tracer = aTracer;
+    if(m_queueHandler) {
+        m_queueHandler->setTracer(aTracer);
+    }
+}
+
+void WorkerThread::setCallbackThread(QThread* aThread) {
+    QMutexLocker locker(&m_queueHandlerMutex);
+    m_callbackThread = aThread;
+}
+
+void WorkerThread::setCallbackPool(QThreadPool* aPool) {
+    QMutexLocker locker(&m_queueHandlerMutex);
+    m_callbackPool = aPool;
+}
+
+void WorkerThread::setResultCache(ResultCache* aCache) {
+    QMutexLocker locker(&m_queueHandlerMutex);
+    m_resultCache = aCache;
+}
+
+void WorkerThread::setJournal(OperationJournal* aJournal) {
+    QMutexLocker locker(&m_queueHandlerMutex);
+    m_journal = aJournal;
+}
+
+void WorkerThread::setDefaultTimeout(int aTimeout) {
+    QMutexLocker locker(&m_queueHandlerMutex);
+    m_defaultTimeout = aTimeout;
+}
+
+int WorkerThread::pendingOperationsCount() {
+    QMutexLocker locker(&m_queueHandlerMutex);
+    if(m_queueHandler) {
+        return m_queueHandler->pendingOperationsCount();
+    }
+    return m_pendingOperations.count();
+}
+
+qint64 WorkerThread::oldestPendingWait() {
+    QMutexLocker locker(&m_queueHandlerMutex);
+    if(m_queueHandler) {
+        return m_queueHandler->oldestPendingWait();
+    }
+    return 0;
+}
+
+qint64 WorkerThread::idleTime() {
+    QMutexLocker locker(&m_queueHandlerMutex);
+    if(m_queueHandler) {
+        return m_queueHandler->idleTime();
+    }
+    return m_pendingOperations.isEmpty() ? 0 : -1;
+}
+
 QueueHandler* WorkerThread::createQueueHandler() {
     return new QueueHandler(m_semaphore, m_mainThread, this);
 }
@@ -77,8 +180,33 @@ QueueHandler* WorkerThread::createQueueHandler() {
 void WorkerThread::run() {
     //connect to the signal request finished so that when an operation finishes
     //we look for the next one in the queue
-    m_queueHandler = createQueueHandler();
-    connect(m_queueHandler, SIGNAL(emptyQueue()), this, SIGNAL(emptyQueue()));
+    QueueHandler* queueHandler = createQueueHandler();
+    connect(queueHandler, SIGNAL(emptyQueue()), this, SIGNAL(emptyQueue()));
+    {
+        QMutexLocker locker(&m_queueHandlerMutex);
+        queueHandler->setTracer(m_tracer);
+        queueHandler->setCallbackThread(m_callbackThread);
+        queueHandler->setCallbackPool(m_callbackPool);
+        queueHandler->setResultCache(m_resultCache);
+        queueHandler->setJournal(m_journal);
+        queueHandler->setDefaultTimeout(m_defaultTimeout);
+        m_queueHandler = queueHandler;
+        // hand over what has been added while we were starting (see startThreadAsync)
+        for(int i = 0; i < m_pendingOperations.count(); ++i) {
+            switch(m_pendingOperations.at(i).second) {
+            case AbstractOperation::PriorityHigh:
+                m_queueHandler->addHighPriorityOperation(m_pendingOperations.at(i).first);
+                break;
+            case AbstractOperation::PriorityIdle:
+                m_queueHandler->addIdleOperation(m_pendingOperations.at(i).first);
+                break;
+            default:
+                m_queueHandler->addOperation(m_pendingOperations.at(i).first);
+                break;
+            }
+        }
+        m_pendingOperations.clear();
+    }
     m_semaphore.release(1);
     exec();
 }
@@ -3,9 +3,18 @@
 
 #include <QThread>
 #include <QSemaphore>
+#include <QMutex>
+#include <QList>
+#include <QPair>
+#include <QByteArray>
+
+#include "abstractoperation.h"
 
 class QueueHandler;
-class AbstractOperation;
+class OperationTracer;
+class QThreadPool;
+class ResultCache;
+class OperationJournal;
 
 class WorkerThread : public QThread
 {
@@ -18,9 +27,15 @@ public:
       * Ideally call this method as soon as the WorkerThread has been created
       */
     void startThread(QThread::Priority aPriority = QThread::LowestPriority);
+    /**
+      * Starts the thread without waiting for it to be up and running.
+      * Operations added in the meanwhile are handed over as soon as the thread is ready.
+      */
+    void startThreadAsync(QThread::Priority aPriority = QThread::LowestPriority);
     /**
       * Ends the thread (synchronously).
       * It cancels all current operations and stops the thread.
+      * Journaled operations (see setJournal()) stay in the journal, to be replayed.
       */
     void terminateThread();
     /**
@@ -31,6 +46,10 @@ public:
       * Add a high priority @aNewOperation to the thread
       */
     virtual void addHighPriorityOperation(AbstractOperation* aNewOperation);
+    /**
+      * Add an idle priority @aNewOperation to the thread, it runs when there is nothing else to do
+      */
+    virtual void addIdleOperation(AbstractOperation* aNewOperation);
     /**
       * Cancel an operation by Id
       */
@@ -39,6 +58,47 @@ public:
       * Cancel all current operations. (the current one might not be cancelled).
       */
     void cancelAllOperations();
+    /**
+      * Cancel the operations tagged with @aTag (see AbstractOperation::addGroupTag()).
+      */
+    void cancelGroup(const QByteArray& aTag);
+    /**
+      * Trace the operations of this thread in @aTracer (not owned), 0 disables tracing.
+      */
+    void setTracer(OperationTracer* aTracer);
+    /**
+      * Deliver the operations with the AbstractOperation::DeliverToCallbackThread policy
+      * from @aThread or, if set, from @aPool (see QueueHandler::setCallbackThread).
+      * Call them before startThread().
+      */
+    void setCallbackThread(QThread* aThread);
+    void setCallbackPool(QThreadPool* aPool);
+    /**
+      * Look the operations up in @aCache (not owned, see QueueHandler::setResultCache).
+      * Call it before startThread().
+      */
+    void setResultCache(ResultCache* aCache);
+    /**
+      * Journal the operations in @aJournal (not owned, see QueueHandler::setJournal()).
+      * Call it before startThread().
+      */
+    void setJournal(OperationJournal* aJournal);
+    /**
+      * See QueueHandler::setDefaultTimeout(), call it before startThread().
+      */
+    void setDefaultTimeout(int aTimeout);
+    /**
+      * Number of operations waiting to be executed.
+      */
+    int pendingOperationsCount();
+    /**
+      * How long (in msecs) the oldest waiting operation has been in the queue.
+      */
+    qint64 oldestPendingWait();
+    /**
+      * How long (in msecs) the thread has been without anything to do, -1 if it is busy.
+      */
+    qint64 idleTime();
 signals:
     void emptyQueue();
 protected:
@@ -56,7 +116,19 @@ protected:
 protected:
     QThread* m_mainThread;
 private:
+    // protects m_queueHandler and m_pendingOperations while the thread is starting
+    QMutex m_queueHandlerMutex;
     QueueHandler* m_queueHandler;
+    OperationTracer* m_tracer;
+    QThread* m_callbackThread;
+    QThreadPool* m_callbackPool;
+    ResultCache* m_resultCache;
+    OperationJournal* m_journal;
+    int m_defaultTimeout;
+    // operations added before the queue handler was created, with their priority class
+    QList< QPair<AbstractOperation*, AbstractOperation::PriorityClass> > m_pendingOperations;
+    // startThreadAsync() has been called and nobody has waited for the thread yet
+    bool m_startPending;
 };
 
 bool genericOperationValidator(void* aOperation);
@@ -1,12 +1,46 @@
+QT += network
+
 INCLUDEPATH += $$PWD
 DEPENDPATH += $$PWD
 
 SOURCES +=  $$PWD/workerthread.cpp \
     $$PWD/queuehandler.cpp \
     $$PWD/abstractoperation.cpp \
-    $$PWD/sentineloperation.cpp
+    $$PWD/operationtracer.cpp \
+    $$PWD/workerpool.cpp \
+    $$PWD/workerlog.cpp \
+    $$PWD/workerclock.cpp \
+    $$PWD/schedulingsimulator.cpp \
+    $$PWD/ratelimiter.cpp \
+    $$PWD/operationsqueue.cpp \
+    $$PWD/callbackdispatcher.cpp \
+    $$PWD/paralleloperation.cpp \
+    $$PWD/resultcache.cpp \
+    $$PWD/workerlanes.cpp \
+    $$PWD/operationjournal.cpp \
+    $$PWD/processchannel.cpp \
+    $$PWD/processqueuehandler.cpp \
+    $$PWD/processworkerthread.cpp \
+    $$PWD/processworkerpool.cpp \
+    $$PWD/processhelper.cpp
 
 HEADERS +=  $$PWD/workerthread.h \
     $$PWD/queuehandler.h \
     $$PWD/abstractoperation.h \
-    $$PWD/sentineloperation.h
+    $$PWD/operationtracer.h \
+    $$PWD/workerpool.h \
+    $$PWD/workerlog.h \
+    $$PWD/workerclock.h \
+    $$PWD/schedulingsimulator.h \
+    $$PWD/ratelimiter.h \
+    $$PWD/operationsqueue.h \
+    $$PWD/callbackdispatcher.h \
+    $$PWD/paralleloperation.h \
+    $$PWD/resultcache.h \
+    $$PWD/workerlanes.h \
+    $$PWD/operationjournal.h \
+    $$PWD/processchannel.h \
+    $$PWD/processqueuehandler.h \
+    $$PWD/processworkerthread.h \
+    $$PWD/processworkerpool.h \
+    $$PWD/processhelper.h